@@ -0,0 +1,467 @@
+/*
+ * GStreamer
+ * Copyright (C) 2019 Yves De Muyter <yves@alfavisio.be>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Micro-benchmark of the compare and replace hot paths.
+ *
+ * Drives the match kernels and the slice pool directly on synthetic frames,
+ * without a pipeline, for every supported format at SD, HD and UHD sizes.
+ * The compare runs in three scenarios:
+ *
+ *  - match: the frame is within the error budget, the whole area is read
+ *  - nomatch: the difference sits in the bottom rows, so the whole area is
+ *    read before the frame is rejected
+ *  - early: the top rows differ completely, the compare gives up right away
+ *  - coarse: the nomatch frame compared only on a grid of every Nth row and
+ *    pixel, as the coarse stage of the element does
+ *
+ * The replace case is the line by line copy of all planes used when the
+ * replacement can't be pushed as is, the fingerprint case the candidate
+ * selection done with several references.
+ *
+ * Every measurement is printed as one JSON object per line. gb_per_s counts
+ * the bytes the case would touch when running to completion, so it reads
+ * low for the early scenario. For the coarse scenario that is only the
+ * rows on the grid.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <glib.h>
+#include <string.h>
+
+#include "gststillreplacematch.h"
+#include "gststillreplaceslices.h"
+
+#define MAX_PLANES 3
+
+/* Plane layout of a format: bytes per pixel (per group of @group pixels)
+ * and subsampling shifts. Only plane 0 is compared, through the lanes in
+ * match_lanes. */
+typedef struct
+{
+  const gchar *name;
+  guint n_planes;
+  guint pstride[MAX_PLANES];
+  guint wsub[MAX_PLANES], hsub[MAX_PLANES];
+  guint match_lanes;
+  StillReplaceSampleFormat sample;
+  guint depth;
+  guint group;
+} BenchFormat;
+
+static const BenchFormat formats[] = {
+  {"RGBx", 1, {4}, {0}, {0}, 0x7, STILLREPLACE_SAMPLE_8, 8, 1},
+  {"RGB", 1, {3}, {0}, {0}, 0x7, STILLREPLACE_SAMPLE_8, 8, 1},
+  {"YUY2", 1, {2}, {0}, {0}, 0x1, STILLREPLACE_SAMPLE_8, 8, 1},
+  {"UYVY", 1, {2}, {0}, {0}, 0x2, STILLREPLACE_SAMPLE_8, 8, 1},
+  {"I420", 3, {1, 1, 1}, {0, 1, 1}, {0, 1, 1}, 0x1, STILLREPLACE_SAMPLE_8, 8,
+      1},
+  {"NV12", 2, {1, 2}, {0, 1}, {0, 1}, 0x1, STILLREPLACE_SAMPLE_8, 8, 1},
+  {"P010_10LE", 2, {2, 4}, {0, 1}, {0, 1}, 0x1, STILLREPLACE_SAMPLE_16, 16,
+      1},
+  {"I422_10LE", 3, {2, 2, 2}, {0, 1, 1}, {0, 0, 0}, 0x1,
+      STILLREPLACE_SAMPLE_16, 10, 1},
+  {"ARGB64", 1, {8}, {0}, {0}, 0xf, STILLREPLACE_SAMPLE_16, 16, 1},
+  {"v210", 1, {STILLREPLACE_V210_GROUP_BYTES}, {0}, {0}, 0x2,
+      STILLREPLACE_SAMPLE_V210, 10, STILLREPLACE_V210_GROUP_PIXELS},
+};
+
+typedef struct
+{
+  const gchar *name;
+  guint width, height;
+} BenchResolution;
+
+static const BenchResolution resolutions[] = {
+  {"SD", 720, 576},
+  {"HD", 1920, 1080},
+  {"UHD", 3840, 2160},
+};
+
+typedef struct
+{
+  guint8 *data[MAX_PLANES];
+  gsize stride[MAX_PLANES];
+  guint rows[MAX_PLANES];
+  gsize row_bytes[MAX_PLANES];
+} BenchFrame;
+
+static void
+frame_alloc (BenchFrame * frame, const BenchFormat * format, guint width,
+    guint height, guint padding)
+{
+  guint p;
+
+  memset (frame, 0, sizeof (*frame));
+  for (p = 0; p < format->n_planes; ++p) {
+    guint w = (width + (1 << format->wsub[p]) - 1) >> format->wsub[p];
+
+    w = (w + format->group - 1) / format->group;
+
+    frame->rows[p] = (height + (1 << format->hsub[p]) - 1) >> format->hsub[p];
+    frame->row_bytes[p] = (gsize) w * format->pstride[p];
+    frame->stride[p] = (frame->row_bytes[p] + padding + 63) & ~(gsize) 63;
+    frame->data[p] = g_malloc (frame->stride[p] * frame->rows[p]);
+  }
+}
+
+static void
+frame_free (BenchFrame * frame)
+{
+  guint p;
+
+  for (p = 0; p < MAX_PLANES; ++p)
+    g_free (frame->data[p]);
+}
+
+static void
+frame_fill (BenchFrame * frame, GRand * rand)
+{
+  guint p;
+  gsize i;
+
+  for (p = 0; p < MAX_PLANES && frame->data[p]; ++p) {
+    for (i = 0; i < frame->stride[p] * frame->rows[p]; ++i)
+      frame->data[p][i] = g_rand_int_range (rand, 16, 240);
+  }
+}
+
+/* Copy of @ref with a difference of @delta, in 8-bit units, on rows
+ * [@first, @last) of plane 0 */
+static void
+frame_perturb (BenchFrame * frame, const BenchFrame * ref,
+    const BenchFormat * format, guint first, guint last, gint delta)
+{
+  guint p, row, k;
+  gsize i;
+
+  for (p = 0; p < MAX_PLANES && frame->data[p]; ++p)
+    memcpy (frame->data[p], ref->data[p], frame->stride[p] * frame->rows[p]);
+  for (row = first; row < last; ++row) {
+    guint8 *line = frame->data[0] + row * frame->stride[0];
+
+    if (format->sample == STILLREPLACE_SAMPLE_16) {
+      guint16 *words = (guint16 *) line;
+      gint d = delta << (format->depth - 8);
+      for (i = 0; i < frame->row_bytes[0] / 2; ++i)
+        words[i] = CLAMP (words[i] + ((i & 1) ? d : -d), 0, 65535);
+    } else if (format->sample == STILLREPLACE_SAMPLE_V210) {
+      guint32 *words = (guint32 *) line;
+      for (i = 0; i < frame->row_bytes[0] / 4; ++i) {
+        guint32 v = 0;
+        for (k = 0; k < 3; ++k) {
+          gint sample = (words[i] >> (10 * k)) & 0x3ff;
+          sample = CLAMP (sample + (((i + k) & 1) ? delta : -delta) * 4, 0,
+              1023);
+          v |= (guint32) sample << (10 * k);
+        }
+        words[i] = v;
+      }
+    } else {
+      for (i = 0; i < frame->row_bytes[0]; ++i)
+        line[i] = CLAMP (line[i] + ((i & 1) ? delta : -delta), 0, 255);
+    }
+  }
+}
+
+typedef struct
+{
+  const BenchFrame *ref, *frame;
+  StillReplaceSampleFormat sample;
+  guint n_lanes, lane_mask;
+  const guint64 *limits;
+  guint64 (*sums)[STILLREPLACE_MATCH_MAX_PSTRIDE];
+  gint over;
+  guint pstride;
+  guint step;                   /* grid of every step-th row and pixel */
+} CompareJob;
+
+static void
+compare_slice (gpointer data, guint slice, guint n_slices)
+{
+  CompareJob *job = data;
+  guint rows = (job->frame->rows[0] + job->step - 1) / job->step;
+  guint first = (guint64) rows * slice / n_slices;
+  guint last = (guint64) rows * (slice + 1) / n_slices;
+
+  memset (job->sums[slice], 0, sizeof (job->sums[slice]));
+  if (!stillreplace_match_sse_grid_bounded (job->ref->data[0] +
+          first * job->step * job->ref->stride[0],
+          job->ref->stride[0] * job->step,
+          job->frame->data[0] + first * job->step * job->frame->stride[0],
+          job->frame->stride[0] * job->step,
+          job->frame->row_bytes[0] / job->pstride, last - first,
+          job->pstride, job->step, job->sample, job->n_lanes,
+          job->lane_mask, job->limits, job->sums[slice]))
+    g_atomic_int_set (&job->over, 1);
+}
+
+typedef struct
+{
+  const BenchFrame *src, *dest;
+  guint n_planes;
+} CopyJob;
+
+static void
+copy_slice (gpointer data, guint slice, guint n_slices)
+{
+  CopyJob *job = data;
+  guint p, row;
+
+  for (p = 0; p < job->n_planes; ++p) {
+    guint rows = job->dest->rows[p];
+    guint first = (guint64) rows * slice / n_slices;
+    guint last = (guint64) rows * (slice + 1) / n_slices;
+    for (row = first; row < last; ++row)
+      memcpy (job->dest->data[p] + row * job->dest->stride[p],
+          job->src->data[p] + row * job->src->stride[p],
+          job->dest->row_bytes[p]);
+  }
+}
+
+typedef struct
+{
+  const gchar *scenario;
+  StillReplaceSlicePool *pool;
+  guint n_slices;
+  CompareJob *compare;
+  CopyJob *copy;
+  const BenchFrame *fingerprint;
+  StillReplaceRect area;
+  const BenchFormat *format;
+} BenchCase;
+
+static void
+run_once (BenchCase * c)
+{
+  if (c->compare) {
+    c->compare->over = 0;
+    stillreplace_slice_pool_run (c->pool, compare_slice, c->compare,
+        c->n_slices);
+  } else if (c->copy) {
+    stillreplace_slice_pool_run (c->pool, copy_slice, c->copy, c->n_slices);
+  } else {
+    guint8 fp[STILLREPLACE_FINGERPRINT_SIZE];
+    stillreplace_match_fingerprint (c->fingerprint->data[0],
+        c->fingerprint->stride[0], c->format->pstride[0], c->format->sample,
+        c->format->depth, c->format->match_lanes, &c->area, fp);
+  }
+}
+
+static void
+measure (const gchar * name, const BenchFormat * format,
+    const BenchResolution * res, BenchCase * c, guint threads, gsize bytes,
+    gdouble min_time)
+{
+  gint64 start, elapsed;
+  guint64 iterations = 0;
+  gdouble ns, gbs, fps;
+
+  /* warm up caches and the worker threads */
+  run_once (c);
+
+  start = g_get_monotonic_time ();
+  do {
+    run_once (c);
+    ++iterations;
+    elapsed = g_get_monotonic_time () - start;
+  } while (elapsed < min_time * G_USEC_PER_SEC);
+
+  ns = (gdouble) elapsed * 1000.0 / iterations;
+  gbs = bytes / ns;
+  fps = 1e9 / ns;
+  g_print ("{\"case\":\"%s\",\"scenario\":\"%s\",\"format\":\"%s\","
+      "\"resolution\":\"%s\",\"width\":%u,\"height\":%u,\"threads\":%u,"
+      "\"impl\":\"%s\",\"iterations\":%" G_GUINT64_FORMAT ","
+      "\"ns_per_frame\":%.1f,\"gb_per_s\":%.3f,\"frames_per_s\":%.1f}\n",
+      name, c->scenario, format->name, res->name, res->width, res->height,
+      threads, stillreplace_match_impl_name (), iterations, ns, gbs, fps);
+}
+
+static gboolean
+selected (gchar ** filter, const gchar * name)
+{
+  if (filter == NULL)
+    return TRUE;
+  for (; *filter; ++filter) {
+    if (g_ascii_strcasecmp (*filter, name) == 0)
+      return TRUE;
+  }
+  return FALSE;
+}
+
+int
+main (int argc, char *argv[])
+{
+  gint threads = 1;
+  gint psnr = 30;
+  gint coarse_step = 4;
+  gdouble min_time = 0.5;
+  gchar **format_filter = NULL, **resolution_filter = NULL;
+  GOptionEntry entries[] = {
+    {"threads", 't', 0, G_OPTION_ARG_INT, &threads,
+        "Slice threads, as the n-threads property (0 = one per core)", "N"},
+    {"psnr", 'p', 0, G_OPTION_ARG_INT, &psnr, "Match threshold", "DB"},
+    {"coarse-step", 'c', 0, G_OPTION_ARG_INT, &coarse_step,
+        "Row and pixel step of the coarse scenario", "N"},
+    {"min-time", 'm', 0, G_OPTION_ARG_DOUBLE, &min_time,
+        "Seconds to run each measurement for", "S"},
+    {"format", 'f', 0, G_OPTION_ARG_STRING_ARRAY, &format_filter,
+        "Only run this format (repeatable)", "NAME"},
+    {"resolution", 'r', 0, G_OPTION_ARG_STRING_ARRAY, &resolution_filter,
+        "Only run SD, HD or UHD (repeatable)", "NAME"},
+    {NULL}
+  };
+  GOptionContext *ctx;
+  GError *error = NULL;
+  StillReplaceSlicePool *pool;
+  GRand *rand;
+  guint f, r, s;
+
+  ctx = g_option_context_new ("- benchmark the stillreplace hot paths");
+  g_option_context_add_main_entries (ctx, entries, NULL);
+  if (!g_option_context_parse (ctx, &argc, &argv, &error)) {
+    g_printerr ("%s\n", error->message);
+    g_clear_error (&error);
+    g_option_context_free (ctx);
+    return 1;
+  }
+  g_option_context_free (ctx);
+
+  stillreplace_match_init ();
+  coarse_step = MAX (coarse_step, 1);
+  if (threads <= 0)
+    threads = g_get_num_processors ();
+  pool = threads > 1 ? stillreplace_slice_pool_new (threads) : NULL;
+  rand = g_rand_new_with_seed (0x5717);
+
+  for (f = 0; f < G_N_ELEMENTS (formats); ++f) {
+    const BenchFormat *format = &formats[f];
+    guint pstride = format->pstride[0];
+    guint n_lanes = stillreplace_match_n_lanes (format->sample, pstride);
+
+    if (!selected (format_filter, format->name))
+      continue;
+
+    for (r = 0; r < G_N_ELEMENTS (resolutions); ++r) {
+      const BenchResolution *res = &resolutions[r];
+      BenchFrame ref, frame, dest;
+      guint64 limits[STILLREPLACE_MATCH_MAX_PSTRIDE] = { 0, };
+      guint64 samples;
+      gsize plane_bytes = 0, frame_bytes = 0;
+      guint n_slices, lane, p;
+
+      if (!selected (resolution_filter, res->name))
+        continue;
+
+      frame_alloc (&ref, format, res->width, res->height, 0);
+      frame_alloc (&frame, format, res->width, res->height, 0);
+      frame_alloc (&dest, format, res->width, res->height, 128);
+      frame_fill (&ref, rand);
+
+      samples = (guint64) ref.row_bytes[0] / pstride * format->group *
+          ref.rows[0];
+      for (lane = 0; lane < n_lanes; ++lane) {
+        if (format->match_lanes & (1 << lane))
+          limits[lane] =
+              stillreplace_match_budget_limit_depth
+              (stillreplace_match_psnr_to_budget (psnr), samples,
+              format->depth);
+      }
+      plane_bytes = ref.row_bytes[0] * ref.rows[0];
+      for (p = 0; p < format->n_planes; ++p)
+        frame_bytes += ref.row_bytes[p] * ref.rows[p];
+      n_slices = MAX (MIN ((guint) threads, ref.rows[0] / 32), 1);
+
+      for (s = 0; s < 3; ++s) {
+        static const gchar *scenarios[] = { "match", "nomatch", "early" };
+        guint64 sums[16][STILLREPLACE_MATCH_MAX_PSTRIDE];
+        CompareJob job = { &ref, &frame, format->sample, n_lanes,
+          format->match_lanes, limits, NULL, 0, pstride, 1
+        };
+        BenchCase c = { scenarios[s], pool, MIN (n_slices, 16), &job, };
+
+        if (s == 0)
+          frame_perturb (&frame, &ref, format, 0, frame.rows[0], 1);
+        else if (s == 1)
+          frame_perturb (&frame, &ref, format,
+              frame.rows[0] - frame.rows[0] / 10, frame.rows[0], 120);
+        else
+          frame_perturb (&frame, &ref, format, 0, 8, 120);
+        job.sums = sums;
+        measure ("compare", format, res, &c, threads, 2 * plane_bytes,
+            min_time);
+      }
+
+      {
+        guint64 coarse_limits[STILLREPLACE_MATCH_MAX_PSTRIDE] = { 0, };
+        guint64 sums[16][STILLREPLACE_MATCH_MAX_PSTRIDE];
+        guint rows = (ref.rows[0] + coarse_step - 1) / coarse_step;
+        guint64 coarse_samples = (guint64) ((ref.row_bytes[0] / pstride +
+                coarse_step - 1) / coarse_step) * format->group * rows;
+        CompareJob job = { &ref, &frame, format->sample, n_lanes,
+          format->match_lanes, coarse_limits, sums, 0, pstride, coarse_step
+        };
+        BenchCase c = { "coarse", pool, MIN (MAX (MIN ((guint) threads,
+                    rows / 32), 1), 16), &job,
+        };
+
+        for (lane = 0; lane < n_lanes; ++lane) {
+          if (format->match_lanes & (1 << lane))
+            coarse_limits[lane] =
+                stillreplace_match_budget_limit_depth
+                (stillreplace_match_psnr_to_budget (psnr), coarse_samples,
+                format->depth);
+        }
+        frame_perturb (&frame, &ref, format,
+            frame.rows[0] - frame.rows[0] / 10, frame.rows[0], 120);
+        measure ("compare", format, res, &c, threads,
+            2 * ref.row_bytes[0] * rows, min_time);
+      }
+
+      {
+        CopyJob job = { &ref, &dest, format->n_planes };
+        BenchCase c = { "copy", pool, n_slices, NULL, &job, };
+        measure ("replace", format, res, &c, threads, 2 * frame_bytes,
+            min_time);
+      }
+
+      {
+        BenchCase c = { "fingerprint", NULL, 1, NULL, NULL, &ref,
+          {0, 0, ref.row_bytes[0] / pstride, ref.rows[0]}, format
+        };
+        measure ("fingerprint", format, res, &c, 1,
+            STILLREPLACE_FINGERPRINT_SIZE * 4 * pstride, min_time);
+      }
+
+      frame_free (&ref);
+      frame_free (&frame);
+      frame_free (&dest);
+    }
+  }
+
+  stillreplace_slice_pool_unref (pool);
+  g_rand_free (rand);
+  g_strfreev (format_filter);
+  g_strfreev (resolution_filter);
+  return 0;
+}
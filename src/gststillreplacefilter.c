@@ -48,6 +48,81 @@
  *
  * Replace still image on the source with another still image.
  *
+ * The first frame received on the sink pad is taken as reference and
+ * replaced by frames from the replacesink pad, or by the image set with
+ * replace-location. That image is decoded on a thread of its own whenever
+ * it or the caps change; the replacesink stream stands in until it is
+ * ready, and is dropped while the image replaces. More references can be added
+ * through refsink_N request pads, each paired with a replacesink_N request
+ * pad providing its replacement.
+ *
+ * With n-threads, the compare and the replace copy of a frame are split
+ * into horizontal slices running on a persistent pool of worker threads.
+ *
+ * The stats property holds running frame, match and miss counts and the
+ * total time spent comparing, replacing and waiting for the replacesink.
+ * With post-messages set, an element message named "stillreplacefilter"
+ * carries the per component psnr, the decision and these times for every
+ * frame.
+ *
+ * Setting hold-frames or hold-duration turns a match into a replacement
+ * window: following frames are replaced with only hold-check-lines lines in
+ * the middle of the compared area checked, until the window runs out or the
+ * check fails.
+ *
+ * With signature-lines set, that many lines of the compared area are hashed
+ * for every input frame; a frame hashing the same as the previous one gets
+ * its decision without a compare, as long as the references and settings
+ * didn't change.
+ *
+ * coarse-row-step and coarse-column-step make the full compare of a frame
+ * two staged: first only every Nth row and every Mth pixel of the compared
+ * area is compared against the same psnr, and the frame is only compared
+ * in full when that sparse grid passes. Frames without the ident are then
+ * rejected after reading a fraction of the area.
+ *
+ * The save-reference action writes the current reference to a file that
+ * reference-location later maps as reference, so a restart doesn't need
+ * to capture the reference again. The file also lists the rects compared
+ * at the time, which is what the offline scanner compares.
+ *
+ * References only keep the pixels of the area compared when they were
+ * taken. When regions or compare_lines later select something outside
+ * of that area, the idents are not matched until they get a new reference:
+ * ident 0 through resample or reference-location, with a warning posted,
+ * the other idents through a new buffer on their refsink pad.
+ *
+ * Settings and references are handed to the streaming thread as immutable
+ * snapshots, so changing them while playing never blocks the stream. A
+ * change applies from the next frame on.
+ *
+ * replace-regions limits a replacement to a few rectangles, each taken
+ * from its own position in the replacement frame, so an ident covering a
+ * corner of the picture only has that corner rewritten.
+ *
+ * With replace-mode set to overlay, matched frames are pushed untouched
+ * with the replacement attached as GstVideoOverlayCompositionMeta, for
+ * encoders and compositors that draw overlays themselves. When downstream
+ * doesn't announce that meta in the ALLOCATION query, it would never draw
+ * it, so the replacement is copied into the frame as in the other mode.
+ *
+ * Replaced frames that can't be written in place go into buffers of a pool
+ * negotiated with downstream through the ALLOCATION query, which the main
+ * sink passes on to downstream. The replacesink and refsink pads accept
+ * frames of any stride described by GstVideoMeta.
+ *
+ * With pipeline-depth set, frames are matched on a separate thread while
+ * the streaming thread replaces and pushes the frames before them. Up to
+ * pipeline-depth frames are held back, which is added to the latency
+ * reported upstream.
+ *
+ * More streams showing the same idents can go through one element as feeds:
+ * each sink_N request pad is paired with a src_N request pad. All feeds
+ * share the references, the replacements and the worker threads, so their
+ * caps may only differ in frame rate and pixel aspect ratio. Only the main
+ * sink captures the reference
+ * of ident 0. The stats add up all feeds, the element messages name theirs.
+ *
  * <refsect2>
  * <title>Example launch line</title>
  * |[
@@ -66,6 +141,9 @@
 #include <string.h>
 
 #include "gststillreplacefilter.h"
+#include "gststillreplacematch.h"
+#include "gststillreplaceref.h"
+#include "gststillreplaceslices.h"
 
 GST_DEBUG_CATEGORY_STATIC (stillreplacefilter_debug);
 #define GST_CAT_DEFAULT stillreplacefilter_debug
@@ -73,26 +151,92 @@ GST_DEBUG_CATEGORY_STATIC (stillreplacefilter_debug);
 /* Filter signals and args */
 enum
 {
-  /* FILL ME */
+  SIGNAL_SAVE_REFERENCE,
   LAST_SIGNAL
 };
 
+static guint stillreplacefilter_signals[LAST_SIGNAL] = { 0 };
+
 enum
 {
   PROP_0,
   PROP_SILENT,
   PROP_COMPARELINES,
   PROP_PSNR,
-  PROP_RESAMPLE
+  PROP_RESAMPLE,
+  PROP_REGIONS,
+  PROP_ROI_X,
+  PROP_ROI_Y,
+  PROP_ROI_WIDTH,
+  PROP_ROI_HEIGHT,
+  PROP_REPLACE_QUEUE_SIZE,
+  PROP_REPLACE_POLICY,
+  PROP_REPLACE_LOCATION,
+  PROP_N_THREADS,
+  PROP_POST_MESSAGES,
+  PROP_STATS,
+  PROP_HOLD_FRAMES,
+  PROP_HOLD_DURATION,
+  PROP_HOLD_CHECK_LINES,
+  PROP_SIGNATURE_LINES,
+  PROP_REFERENCE_LOCATION,
+  PROP_PIPELINE_DEPTH,
+  PROP_REPLACE_REGIONS,
+  PROP_REPLACE_MODE,
+  PROP_COARSE_ROW_STEP,
+  PROP_COARSE_COLUMN_STEP
 };
 
+#define DEFAULT_REPLACE_QUEUE_SIZE 1
+#define DEFAULT_REPLACE_POLICY GST_STILL_REPLACE_POLICY_BLOCK
+#define DEFAULT_REPLACE_MODE GST_STILL_REPLACE_MODE_PIXELS
+#define DEFAULT_N_THREADS 1
+#define DEFAULT_HOLD_CHECK_LINES 8
+
+GType
+gst_still_replace_policy_get_type (void)
+{
+  static gsize policy_type = 0;
+  static const GEnumValue policies[] = {
+    {GST_STILL_REPLACE_POLICY_BLOCK, "Block the replacesink when full, wait for it when empty", "block"},
+    {GST_STILL_REPLACE_POLICY_DROP_OLDEST, "Drop the oldest frame when full, wait for the replacesink when empty", "drop-oldest"},
+    {GST_STILL_REPLACE_POLICY_REPEAT_LAST, "Drop the oldest frame when full, repeat the last frame when empty", "repeat-last"},
+    {0, NULL, NULL}
+  };
+
+  if (g_once_init_enter (&policy_type)) {
+    GType tmp = g_enum_register_static ("GstStillReplacePolicy", policies);
+    g_once_init_leave (&policy_type, tmp);
+  }
+  return (GType) policy_type;
+}
+
+GType
+gst_still_replace_mode_get_type (void)
+{
+  static gsize mode_type = 0;
+  static const GEnumValue modes[] = {
+    {GST_STILL_REPLACE_MODE_PIXELS, "Write the replacement into the frame", "pixels"},
+    {GST_STILL_REPLACE_MODE_OVERLAY, "Attach the replacement as overlay composition meta to the untouched frame", "overlay"},
+    {0, NULL, NULL}
+  };
+
+  if (g_once_init_enter (&mode_type)) {
+    GType tmp = g_enum_register_static ("GstStillReplaceMode", modes);
+    g_once_init_leave (&mode_type, tmp);
+  }
+  return (GType) mode_type;
+}
+
 /* the capabilities of the inputs and outputs.
  *
  * describe the real formats here.
  */
 #define VIDEO_STILLREPLACE_CAPS                     \
   GST_VIDEO_CAPS_MAKE ("{ RGBx, xRGB, BGRx, xBGR, " \
-                       "RGBA, ARGB, BGRA, ABGR, RGB, BGR }")
+                       "RGBA, ARGB, BGRA, ABGR, RGB, BGR, " \
+                       "I420, YV12, NV12, NV21, YUY2, UYVY, " \
+                       "v210, P010_10LE, P016_LE, I422_10LE, ARGB64 }")
 
 static GstStaticPadTemplate sink_factory = GST_STATIC_PAD_TEMPLATE ("sink",
     GST_PAD_SINK,
@@ -106,12 +250,36 @@ static GstStaticPadTemplate replacesink_factory = GST_STATIC_PAD_TEMPLATE ("repl
     GST_STATIC_CAPS (VIDEO_STILLREPLACE_CAPS)
     );
 
+static GstStaticPadTemplate refsink_request_factory = GST_STATIC_PAD_TEMPLATE ("refsink_%u",
+    GST_PAD_SINK,
+    GST_PAD_REQUEST,
+    GST_STATIC_CAPS (VIDEO_STILLREPLACE_CAPS)
+    );
+
+static GstStaticPadTemplate replacesink_request_factory = GST_STATIC_PAD_TEMPLATE ("replacesink_%u",
+    GST_PAD_SINK,
+    GST_PAD_REQUEST,
+    GST_STATIC_CAPS (VIDEO_STILLREPLACE_CAPS)
+    );
+
 static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE ("src",
     GST_PAD_SRC,
     GST_PAD_ALWAYS,
     GST_STATIC_CAPS (VIDEO_STILLREPLACE_CAPS)
     );
 
+static GstStaticPadTemplate sink_request_factory = GST_STATIC_PAD_TEMPLATE ("sink_%u",
+    GST_PAD_SINK,
+    GST_PAD_REQUEST,
+    GST_STATIC_CAPS (VIDEO_STILLREPLACE_CAPS)
+    );
+
+static GstStaticPadTemplate src_request_factory = GST_STATIC_PAD_TEMPLATE ("src_%u",
+    GST_PAD_SRC,
+    GST_PAD_REQUEST,
+    GST_STATIC_CAPS (VIDEO_STILLREPLACE_CAPS)
+    );
+
 #define stillreplacefilter_parent_class parent_class
 G_DEFINE_TYPE (GstStillReplaceFilter, stillreplacefilter, GST_TYPE_ELEMENT);
 
@@ -121,14 +289,37 @@ static void stillreplacefilter_get_property (GObject * object, guint prop_id,
     GValue * value, GParamSpec * pspec);
 
 static gboolean stillreplacefilter_sink_event (GstPad * pad, GstObject * parent, GstEvent * event);
+static gboolean stillreplacefilter_sink_activate_mode (GstPad * pad, GstObject * parent, GstPadMode mode, gboolean active);
+static gboolean stillreplacefilter_src_query (GstPad * pad, GstObject * parent, GstQuery * query);
 static GstFlowReturn stillreplacefilter_chain (GstPad * pad, GstObject * parent, GstBuffer * buf);
 
 static gboolean stillreplacefilter_replacepad_sink_event (GstPad * pad, GstObject * parent, GstEvent * event);
+static gboolean stillreplacefilter_readpad_query (GstPad * pad, GstObject * parent, GstQuery * query);
 static GstFlowReturn stillreplacefilter_replacepad_chain (GstPad * pad, GstObject * parent, GstBuffer * buf);
 
+static gboolean stillreplacefilter_refpad_sink_event (GstPad * pad, GstObject * parent, GstEvent * event);
+static GstFlowReturn stillreplacefilter_refpad_chain (GstPad * pad, GstObject * parent, GstBuffer * buf);
+
+static GstIterator* stillreplacefilter_iterate_internal_links (GstPad * pad, GstObject * parent);
+
+static GstPad* stillreplacefilter_request_new_pad (GstElement * element, GstPadTemplate * templ, const gchar * name, const GstCaps * caps);
+static void stillreplacefilter_release_pad (GstElement * element, GstPad * pad);
+static GstStateChangeReturn stillreplacefilter_change_state (GstElement * element, GstStateChange transition);
+
 /* GObject vmethod implementations */
 static void stillreplacefilter_finalize (GObject * object);
 
+static gboolean stillreplacefilter_save_reference (GstStillReplaceFilter * filter, const gchar * location);
+
+static void publishConfig (GstStillReplaceFilter * filter);
+static void configUnref (GstStillReplaceConfig * cfg);
+static void endHold (GstStillReplaceFeed * feed);
+static void forgetDecision (GstStillReplaceFeed * feed);
+static void forgetOverlay (GstStillReplaceFeed * feed);
+static void dropOutputPool (GstStillReplaceFeed * feed);
+static GstFlowReturn finishPendingFrames (GstStillReplaceFeed * feed, guint depth, gboolean push);
+static gboolean matchRect (const GstVideoInfo * info, guint comp, const StillReplaceRect * rect, StillReplaceRect * out);
+
 /* initialize the stillreplacefilter's class */
 static void
 stillreplacefilter_class_init (GstStillReplaceFilterClass * klass)
@@ -154,6 +345,85 @@ stillreplacefilter_class_init (GstStillReplaceFilterClass * klass)
   g_object_class_install_property (gobject_class, PROP_RESAMPLE,
       g_param_spec_boolean ("resample", "Resample", "Resample reference image from input",
           TRUE, G_PARAM_READWRITE | GST_PARAM_CONTROLLABLE | GST_PARAM_MUTABLE_PLAYING));
+  g_object_class_install_property (gobject_class, PROP_REGIONS,
+      g_param_spec_string ("regions", "Regions", "Rectangles to compare as \"x,y,width,height;...\". Overrides compare_lines and the roi-* properties when set",
+          NULL, G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING));
+  g_object_class_install_property (gobject_class, PROP_ROI_X,
+      g_param_spec_uint ("roi-x", "ROI x", "Left edge of a single region to compare, ignored while regions is set",
+          0, G_MAXINT, 0, G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING));
+  g_object_class_install_property (gobject_class, PROP_ROI_Y,
+      g_param_spec_uint ("roi-y", "ROI y", "Top edge of a single region to compare, ignored while regions is set",
+          0, G_MAXINT, 0, G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING));
+  g_object_class_install_property (gobject_class, PROP_ROI_WIDTH,
+      g_param_spec_uint ("roi-width", "ROI width", "Width of a single region to compare (0 = no region), ignored while regions is set",
+          0, G_MAXINT, 0, G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING));
+  g_object_class_install_property (gobject_class, PROP_ROI_HEIGHT,
+      g_param_spec_uint ("roi-height", "ROI height", "Height of a single region to compare (0 = no region), ignored while regions is set",
+          0, G_MAXINT, 0, G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING));
+  g_object_class_install_property (gobject_class, PROP_REPLACE_QUEUE_SIZE,
+      g_param_spec_uint ("replace-queue-size", "Replace queue size", "Amount of replacement frames buffered per replacesink pad",
+          1, 64, DEFAULT_REPLACE_QUEUE_SIZE, G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING));
+  g_object_class_install_property (gobject_class, PROP_REPLACE_POLICY,
+      g_param_spec_enum ("replace-policy", "Replace policy", "What to do when the replacement queue is full or empty",
+          GST_TYPE_STILL_REPLACE_POLICY, DEFAULT_REPLACE_POLICY, G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING));
+  g_object_class_install_property (gobject_class, PROP_REPLACE_LOCATION,
+      g_param_spec_string ("replace-location", "Replace location", "Image file to replace the reference with instead of the replacesink stream",
+          NULL, G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING));
+  g_object_class_install_property (gobject_class, PROP_N_THREADS,
+      g_param_spec_uint ("n-threads", "Threads", "Amount of threads to split compare and replace of a frame over (0 = one per CPU core)",
+          0, 64, DEFAULT_N_THREADS, G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING));
+  g_object_class_install_property (gobject_class, PROP_POST_MESSAGES,
+      g_param_spec_boolean ("post-messages", "Post messages", "Post an element message with the match statistics of every frame",
+          FALSE, G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING));
+  g_object_class_install_property (gobject_class, PROP_STATS,
+      g_param_spec_boxed ("stats", "Statistics", "Frame, match and miss counts and total compare, replace and wait times in ns",
+          GST_TYPE_STRUCTURE, G_PARAM_READABLE));
+  g_object_class_install_property (gobject_class, PROP_HOLD_FRAMES,
+      g_param_spec_uint ("hold-frames", "Hold frames", "Frames to keep replacing after a match with only a spot check (0 = compare every frame)",
+          0, G_MAXUINT, 0, G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING));
+  g_object_class_install_property (gobject_class, PROP_HOLD_DURATION,
+      g_param_spec_uint64 ("hold-duration", "Hold duration", "Time in ns to keep replacing after a match with only a spot check (0 = compare every frame)",
+          0, G_MAXUINT64, 0, G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING));
+  g_object_class_install_property (gobject_class, PROP_HOLD_CHECK_LINES,
+      g_param_spec_uint ("hold-check-lines", "Hold check lines", "Lines in the middle of the compared area checked on every held frame (0 = no check)",
+          0, 32000, DEFAULT_HOLD_CHECK_LINES, G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING));
+  g_object_class_install_property (gobject_class, PROP_SIGNATURE_LINES,
+      g_param_spec_uint ("signature-lines", "Signature lines", "Lines of the compared area hashed to detect repeated input frames, which reuse the previous decision (0 = compare every frame)",
+          0, 32000, 0, G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING));
+  g_object_class_install_property (gobject_class, PROP_REFERENCE_LOCATION,
+      g_param_spec_string ("reference-location", "Reference location", "Reference file written by save-reference, memory mapped as reference instead of capturing the first frame",
+          NULL, G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING));
+  g_object_class_install_property (gobject_class, PROP_PIPELINE_DEPTH,
+      g_param_spec_uint ("pipeline-depth", "Pipeline depth", "Frames matched on a separate thread ahead of the one being replaced and pushed, adds as many frames of latency (0 = match in the streaming thread)",
+          0, 16, 0, G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING));
+  g_object_class_install_property (gobject_class, PROP_REPLACE_MODE,
+      g_param_spec_enum ("replace-mode", "Replace mode", "Write replacements into the frame, or leave the frame alone and attach them as overlay composition meta for downstream to draw (written into the frame when downstream doesn't support that meta)",
+          GST_TYPE_STILL_REPLACE_MODE, DEFAULT_REPLACE_MODE, G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING));
+  g_object_class_install_property (gobject_class, PROP_REPLACE_REGIONS,
+      g_param_spec_string ("replace-regions", "Replace regions", "Rectangles written on a replacement as \"x,y,width,height[@srcx,srcy];...\", taken from the replacement at srcx,srcy (default x,y). Left and right edges are widened to whole chroma samples (2 pixels for YUY2, UYVY and 4:2:x formats, 6-pixel groups for v210). The rest of the input frame is kept. Replaces the whole frame when empty",
+          NULL, G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING));
+  g_object_class_install_property (gobject_class, PROP_COARSE_ROW_STEP,
+      g_param_spec_uint ("coarse-row-step", "Coarse row step", "Compare only every Nth row of the compared area first, and the full area only when that matches (1 = no coarse compare)",
+          1, 64, 1, G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING));
+  g_object_class_install_property (gobject_class, PROP_COARSE_COLUMN_STEP,
+      g_param_spec_uint ("coarse-column-step", "Coarse column step", "Compare only every Nth pixel of a row of the compared area first, and the full area only when that matches (1 = no coarse compare)",
+          1, 64, 1, G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING));
+
+  /**
+   * GstStillReplaceFilter::save-reference:
+   * @filter: the stillreplacefilter
+   * @location: file to write, or NULL for reference-location
+   *
+   * Write the current reference and the rects currently compared to
+   * @location, to be loaded through reference-location later. Returns FALSE
+   * when there is no reference yet or writing failed.
+   */
+  stillreplacefilter_signals[SIGNAL_SAVE_REFERENCE] =
+      g_signal_new ("save-reference", G_TYPE_FROM_CLASS (klass),
+      G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+      G_STRUCT_OFFSET (GstStillReplaceFilterClass, save_reference), NULL, NULL,
+      NULL, G_TYPE_BOOLEAN, 1, G_TYPE_STRING);
+  klass->save_reference = stillreplacefilter_save_reference;
 
   gst_element_class_set_details_simple(gstelement_class,
     "Still replace filter",
@@ -165,10 +435,150 @@ stillreplacefilter_class_init (GstStillReplaceFilterClass * klass)
       gst_static_pad_template_get (&src_factory));
   gst_element_class_add_pad_template (gstelement_class,
       gst_static_pad_template_get (&sink_factory));
+  gst_element_class_add_pad_template (gstelement_class,
+      gst_static_pad_template_get (&refsink_request_factory));
+  gst_element_class_add_pad_template (gstelement_class,
+      gst_static_pad_template_get (&replacesink_request_factory));
+  gst_element_class_add_pad_template (gstelement_class,
+      gst_static_pad_template_get (&sink_request_factory));
+  gst_element_class_add_pad_template (gstelement_class,
+      gst_static_pad_template_get (&src_request_factory));
+
+  gstelement_class->request_new_pad = GST_DEBUG_FUNCPTR( stillreplacefilter_request_new_pad );
+  gstelement_class->release_pad = GST_DEBUG_FUNCPTR( stillreplacefilter_release_pad );
+  gstelement_class->change_state = GST_DEBUG_FUNCPTR( stillreplacefilter_change_state );
 
   gobject_class->finalize = GST_DEBUG_FUNCPTR( stillreplacefilter_finalize );
 }
 
+static GstStillReplaceRef* referenceRef( GstStillReplaceRef* ref )
+{
+  g_atomic_int_inc( &ref->refcount );
+  return ref;
+}
+
+static void referenceUnref( GstStillReplaceRef* ref )
+{
+  if (g_atomic_int_dec_and_test( &ref->refcount ))
+  {
+    if (ref->storage_free)
+      ref->storage_free( ref->storage );
+    g_free( ref );
+  }
+}
+
+/* Like gst_buffer_replace() for references */
+static void referenceReplace( GstStillReplaceRef** old, GstStillReplaceRef* ref )
+{
+  if (*old == ref)
+    return;
+  if (ref)
+    referenceRef( ref );
+  if (*old)
+    referenceUnref( *old );
+  *old = ref;
+}
+
+/* Replacement queue of an ident, called with replacesinkMutex held */
+static void queueResize( GstStillReplaceIdent* ident, guint size )
+{
+  GstBuffer** queue = size ? g_new0( GstBuffer*, size ) : NULL;
+  guint length = 0;
+
+  /* keep the newest frames */
+  while (ident->replaceQueueLength > size)
+  {
+    gst_buffer_unref( ident->replaceQueue[ident->replaceQueueHead] );
+    ident->replaceQueueHead = (ident->replaceQueueHead + 1) % ident->replaceQueueSize;
+    ident->replaceQueueLength--;
+  }
+  while (ident->replaceQueueLength > 0)
+  {
+    queue[length++] = ident->replaceQueue[ident->replaceQueueHead];
+    ident->replaceQueueHead = (ident->replaceQueueHead + 1) % ident->replaceQueueSize;
+    ident->replaceQueueLength--;
+  }
+  g_free( ident->replaceQueue );
+  ident->replaceQueue = queue;
+  ident->replaceQueueHead = 0;
+  ident->replaceQueueLength = length;
+  ident->replaceQueueSize = size;
+}
+
+static GstBuffer* queuePop( GstStillReplaceIdent* ident )
+{
+  if (ident->replaceQueueLength == 0)
+    return NULL;
+  GstBuffer* buf = ident->replaceQueue[ident->replaceQueueHead];
+  ident->replaceQueue[ident->replaceQueueHead] = NULL;
+  ident->replaceQueueHead = (ident->replaceQueueHead + 1) % ident->replaceQueueSize;
+  ident->replaceQueueLength--;
+  return buf;
+}
+
+static void queueClear( GstStillReplaceIdent* ident )
+{
+  while (ident->replaceQueueLength > 0)
+    gst_buffer_unref( queuePop( ident ) );
+}
+
+/* Append @buf, dropping the oldest frame when the queue is full */
+static void queuePush( GstStillReplaceIdent* ident, GstBuffer* buf )
+{
+  if (ident->replaceQueueLength == ident->replaceQueueSize)
+    gst_buffer_unref( queuePop( ident ) );
+  ident->replaceQueue[(ident->replaceQueueHead + ident->replaceQueueLength) % ident->replaceQueueSize] = buf;
+  ident->replaceQueueLength++;
+}
+
+static GstStillReplaceIdent* newIdent( guint index )
+{
+  GstStillReplaceIdent* ident = g_new0( GstStillReplaceIdent, 1 );
+  ident->index = index;
+  return ident;
+}
+
+static void freeIdent( GstStillReplaceIdent* ident )
+{
+  referenceReplace( &ident->refImage, NULL );
+  queueResize( ident, 0 );
+  gst_buffer_replace( &ident->lastReplaceBuffer, NULL );
+  gst_buffer_replace( &ident->replaceStill, NULL );
+  referenceReplace( &ident->fingerprintRef, NULL );
+  g_free( ident );
+}
+
+static GstStillReplaceFeed* newFeed( GstStillReplaceFilter* filter, guint index )
+{
+  GstStillReplaceFeed* feed = g_new0( GstStillReplaceFeed, 1 );
+  feed->filter = filter;
+  feed->index = index;
+  feed->replaceSeen = g_array_new( FALSE, TRUE, sizeof(guint64) );
+  feed->overlay.converters = g_ptr_array_new_with_free_func( (GDestroyNotify)freeOverlayConverter );
+  g_queue_init( &feed->pendingFrames );
+  g_mutex_init( &feed->pipelineMutex );
+  g_cond_init( &feed->pipelineDone );
+  return feed;
+}
+
+static void freeFeed( GstStillReplaceFeed* feed )
+{
+  if (feed->matchThread)
+    g_thread_pool_free( feed->matchThread, FALSE, TRUE );
+  finishPendingFrames( feed, 0, FALSE );
+  g_mutex_clear( &feed->pipelineMutex );
+  g_cond_clear( &feed->pipelineDone );
+  endHold( feed );
+  forgetDecision( feed );
+  forgetOverlay( feed );
+  g_ptr_array_unref( feed->overlay.converters );
+  dropOutputPool( feed );
+  g_clear_object( &feed->pushPad );
+  g_clear_pointer( &feed->config, configUnref );
+  g_array_unref( feed->replaceSeen );
+  g_free( feed );
+}
+
 /* initialize the new element
  * instantiate pads and add them to element
  * set pad calback functions
@@ -179,328 +589,2638 @@ stillreplacefilter_init (GstStillReplaceFilter * filter)
 {
   g_mutex_init (&filter->replacesinkMutex);
   g_cond_init (&filter->replacesinkEvent);
+  g_mutex_init (&filter->fingerprintMutex);
+
+  GstStillReplaceFeed* feed = newFeed( filter, 0 );
+  filter->feeds = g_ptr_array_new_with_free_func( (GDestroyNotify)freeFeed );
+  g_ptr_array_add( filter->feeds, feed );
 
   filter->sinkpad = gst_pad_new_from_static_template (&sink_factory, "sink");
+  gst_pad_set_element_private (filter->sinkpad, feed);
   gst_pad_set_event_function (filter->sinkpad,
                               GST_DEBUG_FUNCPTR(stillreplacefilter_sink_event));
   gst_pad_set_chain_function (filter->sinkpad,
                               GST_DEBUG_FUNCPTR(stillreplacefilter_chain));
+  gst_pad_set_activatemode_function (filter->sinkpad,
+                              GST_DEBUG_FUNCPTR(stillreplacefilter_sink_activate_mode));
   GST_PAD_SET_PROXY_CAPS (filter->sinkpad);
+  /* input frames are pushed as they are, so upstream may use downstream's
+   * pool and metas */
+  GST_PAD_SET_PROXY_ALLOCATION (filter->sinkpad);
+  gst_pad_set_iterate_internal_links_function (filter->sinkpad,
+                              GST_DEBUG_FUNCPTR(stillreplacefilter_iterate_internal_links));
   gst_element_add_pad (GST_ELEMENT (filter), filter->sinkpad);
+  feed->sinkpad = filter->sinkpad;
 
-  filter->replacesinkpad = gst_pad_new_from_static_template (&replacesink_factory, "replacesink");
-  gst_pad_set_event_function (filter->replacesinkpad,
+  GstStillReplaceIdent* ident = newIdent( 0 );
+  filter->idents = g_ptr_array_new_with_free_func( (GDestroyNotify)freeIdent );
+  g_ptr_array_add( filter->idents, ident );
+
+  ident->replacesinkpad = gst_pad_new_from_static_template (&replacesink_factory, "replacesink");
+  gst_pad_set_element_private (ident->replacesinkpad, ident);
+  gst_pad_set_event_function (ident->replacesinkpad,
                               GST_DEBUG_FUNCPTR(stillreplacefilter_replacepad_sink_event));
-  gst_pad_set_chain_function (filter->replacesinkpad,
+  gst_pad_set_chain_function (ident->replacesinkpad,
                               GST_DEBUG_FUNCPTR(stillreplacefilter_replacepad_chain));
-  GST_PAD_SET_PROXY_CAPS (filter->replacesinkpad);
-  gst_element_add_pad (GST_ELEMENT (filter), filter->replacesinkpad);
+  gst_pad_set_query_function (ident->replacesinkpad,
+                              GST_DEBUG_FUNCPTR(stillreplacefilter_readpad_query));
+  gst_pad_set_iterate_internal_links_function (ident->replacesinkpad,
+                              GST_DEBUG_FUNCPTR(stillreplacefilter_iterate_internal_links));
+  gst_pad_set_activatemode_function (ident->replacesinkpad,
+                              GST_DEBUG_FUNCPTR(stillreplacefilter_sink_activate_mode));
+  GST_PAD_SET_PROXY_CAPS (ident->replacesinkpad);
+  gst_element_add_pad (GST_ELEMENT (filter), ident->replacesinkpad);
 
   filter->srcpad = gst_pad_new_from_static_template (&src_factory, "src");
+  gst_pad_set_element_private (filter->srcpad, feed);
+  gst_pad_set_query_function (filter->srcpad,
+                              GST_DEBUG_FUNCPTR(stillreplacefilter_src_query));
+  gst_pad_set_iterate_internal_links_function (filter->srcpad,
+                              GST_DEBUG_FUNCPTR(stillreplacefilter_iterate_internal_links));
   GST_PAD_SET_PROXY_CAPS (filter->srcpad);
   gst_element_add_pad (GST_ELEMENT (filter), filter->srcpad);
+  feed->srcpad = filter->srcpad;
+  g_atomic_int_inc( &feed->srcpadSerial );
 
   filter->eos = FALSE;
   filter->flushing = FALSE;
+  filter->replace_queue_size = DEFAULT_REPLACE_QUEUE_SIZE;
+  filter->replace_policy = DEFAULT_REPLACE_POLICY;
+  filter->n_threads = DEFAULT_N_THREADS;
+  filter->slicePool = NULL;
+  filter->post_messages = FALSE;
+  filter->hold_frames = 0;
+  filter->hold_duration = 0;
+  filter->hold_check_lines = DEFAULT_HOLD_CHECK_LINES;
+  filter->signature_lines = 0;
+  filter->coarse_row_step = 1;
+  filter->coarse_column_step = 1;
 
   filter->silent = TRUE;
   filter->compare_lines = 0;
-  filter->refImageBuffer = NULL;
-  filter->nextReplaceBuffer = NULL;
+  filter->psnr = 100;
+  filter->sse_budget = stillreplace_match_psnr_to_budget( filter->psnr );
+  filter->regions = g_array_new( FALSE, FALSE, sizeof(StillReplaceRect) );
+  memset( &filter->roi, 0, sizeof(filter->roi) );
+  filter->regionsSet = FALSE;
+  filter->replace_regions = g_array_new( FALSE, FALSE, sizeof(GstStillReplaceRegion) );
+  filter->replace_mode = DEFAULT_REPLACE_MODE;
+  filter->pipeline_depth = 0;
+
+  filter->stillLoader = NULL;
+  filter->stillGeneration = 0;
+
+  filter->config = NULL;
+  filter->configSerial = 0;
+  GST_OBJECT_LOCK(filter);
+  publishConfig( filter );
+  GST_OBJECT_UNLOCK(filter);
 }
 static void
 stillreplacefilter_finalize (GObject * object)
 {
   GstStillReplaceFilter *filter = GST_STILLREPLACEFILTER (object);
-  if (filter->refImageBuffer)
-    gst_buffer_replace( &filter->refImageBuffer, NULL );
-  if (filter->nextReplaceBuffer)
-    gst_buffer_replace( &filter->nextReplaceBuffer, NULL );
+  if (filter->stillLoader)
+  {
+    /* loads still queued see they're outdated and return right away */
+    GST_OBJECT_LOCK(filter);
+    filter->stillGeneration++;
+    GST_OBJECT_UNLOCK(filter);
+    g_thread_pool_free( filter->stillLoader, FALSE, TRUE );
+  }
+  g_ptr_array_unref( filter->feeds );
+  g_ptr_array_unref( filter->idents );
+  g_array_unref( filter->regions );
+  g_array_unref( filter->replace_regions );
+  g_free( filter->replace_location );
+  g_free( filter->reference_location );
+  stillreplace_slice_pool_unref( filter->slicePool );
+  g_clear_pointer( &filter->config, configUnref );
+  g_mutex_clear (&filter->fingerprintMutex);
   g_cond_clear (&filter->replacesinkEvent);
   g_mutex_clear (&filter->replacesinkMutex);
 }
 
-static void
-stillreplacefilter_set_property (GObject * object, guint prop_id,
-    const GValue * value, GParamSpec * pspec)
+/* Parse the @n comma separated numbers in @str into @values. Returns FALSE
+ * unless @str holds exactly @n of them, each a decimal in the range of a
+ * gint without sign. */
+static gboolean parseNumbers( const gchar* str, guint* values, guint n )
 {
-  GstStillReplaceFilter *filter = GST_STILLREPLACEFILTER (object);
-
-  switch (prop_id)
+  gchar** fields = g_strsplit( str, ",", -1 );
+  gboolean ok = (g_strv_length( fields ) == n);
+  for ( guint i = 0; ok && (i < n); ++i )
   {
-    case PROP_SILENT:
-      GST_OBJECT_LOCK(filter);
-      filter->silent = g_value_get_boolean (value);
-      GST_OBJECT_UNLOCK(filter);
-      break;
-    case PROP_COMPARELINES:
-      GST_OBJECT_LOCK(filter);
-      filter->compare_lines = g_value_get_uint (value);
-      GST_OBJECT_UNLOCK(filter);
-      break;
-    case PROP_PSNR:
-      GST_OBJECT_LOCK(filter);
-      filter->psnr = g_value_get_uint (value);
-      GST_OBJECT_UNLOCK(filter);
-      break;
-    case PROP_RESAMPLE:
-      gst_buffer_replace( &filter->refImageBuffer, NULL );
-      break;
-    default:
-      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
-      break;
+    guint64 value;
+    ok = g_ascii_string_to_unsigned( g_strstrip( fields[i] ), 10, 0, G_MAXINT, &value, NULL );
+    values[i] = value;
   }
+  g_strfreev( fields );
+  return ok;
 }
 
-static void
-stillreplacefilter_get_property (GObject * object, guint prop_id,
-    GValue * value, GParamSpec * pspec)
+/* Parse "x,y,width,height;x,y,width,height;..." into an array of
+ * StillReplaceRect. Malformed or empty rectangles are skipped. */
+static GArray* parseRegions( GstStillReplaceFilter* filter, const gchar* str )
 {
-  GstStillReplaceFilter *filter = GST_STILLREPLACEFILTER (object);
+  GArray* regions = g_array_new( FALSE, FALSE, sizeof(StillReplaceRect) );
+  if (str == NULL)
+    return regions;
 
-  switch (prop_id) {
-    case PROP_SILENT:
-      GST_OBJECT_LOCK(filter);
-      g_value_set_boolean (value, filter->silent);
-      GST_OBJECT_UNLOCK(filter);
-      break;
-    case PROP_COMPARELINES:
-      GST_OBJECT_LOCK(filter);
-      g_value_set_uint (value, filter->compare_lines);
-      GST_OBJECT_UNLOCK(filter);
-      break;
-    case PROP_PSNR:
-      GST_OBJECT_LOCK(filter);
-      g_value_set_uint (value, filter->psnr);
-      GST_OBJECT_UNLOCK(filter);
-      break;
-    default:
-      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
-      break;
+  gchar** rects = g_strsplit( str, ";", -1 );
+  for ( guint i = 0; rects[i] != NULL; ++i )
+  {
+    guint v[4];
+    if (*g_strstrip( rects[i] ) == '\0')
+      continue;
+    if (!parseNumbers( rects[i], v, 4 )||(v[2] == 0)||(v[3] == 0))
+    {
+      GST_WARNING_OBJECT( filter, "Ignoring invalid region '%s'", rects[i] );
+      continue;
+    }
+    StillReplaceRect rect = { v[0], v[1], v[2], v[3] };
+    g_array_append_val( regions, rect );
   }
+  g_strfreev( rects );
+  return regions;
 }
 
-
-/* GstElement vmethod implementations */
-
-/* this function handles sink events */
-static gboolean
-stillreplacefilter_sink_event (GstPad * pad, GstObject * parent, GstEvent * event)
+static gchar* formatRegions( GArray* regions )
 {
-  GstStillReplaceFilter *filter;
-  gboolean ret;
-
-  filter = GST_STILLREPLACEFILTER (parent);
+  GString* str = g_string_new( NULL );
+  for ( guint i = 0; i < regions->len; ++i )
+  {
+    StillReplaceRect* rect = &g_array_index( regions, StillReplaceRect, i );
+    g_string_append_printf( str, "%s%u,%u,%u,%u", i ? ";" : "", rect->x, rect->y, rect->width, rect->height );
+  }
+  return g_string_free( str, FALSE );
+}
 
-  GST_LOG_OBJECT (filter, "Received %s event: %" GST_PTR_FORMAT,
-      GST_EVENT_TYPE_NAME (event), event);
+/* Parse "x,y,width,height[@srcx,srcy];..." into an array of
+ * GstStillReplaceRegion, the source defaults to the destination position.
+ * Malformed or empty rectangles are skipped. */
+static GArray* parseReplaceRegions( GstStillReplaceFilter* filter, const gchar* str )
+{
+  GArray* regions = g_array_new( FALSE, FALSE, sizeof(GstStillReplaceRegion) );
+  if (str == NULL)
+    return regions;
 
-  switch (GST_EVENT_TYPE (event)) {
-    case GST_EVENT_CAPS:
+  gchar** rects = g_strsplit( str, ";", -1 );
+  for ( guint i = 0; rects[i] != NULL; ++i )
+  {
+    guint v[6];
+    if (*g_strstrip( rects[i] ) == '\0')
+      continue;
+    gchar** parts = g_strsplit( rects[i], "@", -1 );
+    guint n = g_strv_length( parts );
+    gboolean ok = ((n == 1)||(n == 2))&&parseNumbers( parts[0], v, 4 )&&((n == 1)||parseNumbers( parts[1], v + 4, 2 ));
+    g_strfreev( parts );
+    if (!ok||(v[2] == 0)||(v[3] == 0))
     {
-      GstCaps * caps;
-      GstVideoInfo info;
-
-      gst_event_parse_caps (event, &caps);
-      /* do something with the caps */
-      if (!gst_video_info_from_caps (&info, caps))
-      {
-        return FALSE;
-      }
-      GST_OBJECT_LOCK(filter);
-      filter->sink_info = info;
-      GST_OBJECT_UNLOCK(filter);
-
-      if (!gst_pad_set_caps( filter->replacesinkpad, caps )) {
-        GST_ERROR_OBJECT( filter, "Caps negotiation failed: Replacesink pad must allow the same caps as the main sink");
-        return FALSE;
-      }
-
-      /* and forward */
-      ret = gst_pad_event_default (pad, parent, event);
-      break;
+      GST_WARNING_OBJECT( filter, "Ignoring invalid replace region '%s'", rects[i] );
+      continue;
     }
-    case GST_EVENT_EOS:
+    GstStillReplaceRegion region = { { v[0], v[1], v[2], v[3] }, v[0], v[1] };
+    if (n == 2)
     {
-      g_mutex_lock (&filter->replacesinkMutex);
-      filter->eos = TRUE;
-      g_cond_broadcast( &filter->replacesinkEvent );
-      g_mutex_unlock (&filter->replacesinkMutex);
-      ret = gst_pad_event_default (pad, parent, event);
-      break;
+      region.src_x = v[4];
+      region.src_y = v[5];
     }
-    default:
-      ret = gst_pad_event_default (pad, parent, event);
-      break;
+    g_array_append_val( regions, region );
   }
-  return ret;
+  g_strfreev( rects );
+  return regions;
+}
+
+static gchar* formatReplaceRegions( GArray* regions )
+{
+  GString* str = g_string_new( NULL );
+  for ( guint i = 0; i < regions->len; ++i )
+  {
+    GstStillReplaceRegion* region = &g_array_index( regions, GstStillReplaceRegion, i );
+    g_string_append_printf( str, "%s%u,%u,%u,%u", i ? ";" : "", region->dest.x, region->dest.y,
+        region->dest.width, region->dest.height );
+    if ((region->src_x != region->dest.x)||(region->src_y != region->dest.y))
+      g_string_append_printf( str, "@%u,%u", region->src_x, region->src_y );
+  }
+  return g_string_free( str, FALSE );
+}
+
+/* Region list of the roi-* properties, empty while roi-width or
+ * roi-height is 0. Called with the object lock held. */
+static GArray* roiRegions( GstStillReplaceFilter* filter )
+{
+  GArray* regions = g_array_new( FALSE, FALSE, sizeof(StillReplaceRect) );
+  if ((filter->roi.width > 0)&&(filter->roi.height > 0))
+    g_array_append_val( regions, filter->roi );
+  return regions;
+}
+
+/* Set one field of the single-region shorthand properties. They only take
+ * effect while the regions property is empty. The region list is never
+ * modified in place since the streaming thread may hold a ref. */
+static void setRoi( GstStillReplaceFilter* filter, guint prop_id, guint value )
+{
+  GST_OBJECT_LOCK(filter);
+  switch (prop_id)
+  {
+    case PROP_ROI_X: filter->roi.x = value; break;
+    case PROP_ROI_Y: filter->roi.y = value; break;
+    case PROP_ROI_WIDTH: filter->roi.width = value; break;
+    case PROP_ROI_HEIGHT: filter->roi.height = value; break;
+  }
+  gboolean ignored = filter->regionsSet;
+  if (!ignored)
+  {
+    g_array_unref( filter->regions );
+    filter->regions = roiRegions( filter );
+    publishConfig( filter );
+  }
+  GST_OBJECT_UNLOCK(filter);
+  if (ignored)
+    GST_WARNING_OBJECT( filter, "roi-* are ignored while regions is set" );
 }
 
-static GstBuffer* getNextReplaceBuffer( GstStillReplaceFilter* filter )
+/* Decode the image at @location and convert it to the format and size in
+ * @info. Runs a small pipeline up to preroll, so this blocks until the
+ * image is decoded. */
+static GstBuffer* loadReplaceStill( GstStillReplaceFilter* filter, const gchar* location, const GstVideoInfo* info )
 {
+  GError* error = NULL;
   GstBuffer* ret = NULL;
-  g_mutex_lock( &filter->replacesinkMutex );
-  if ( !gst_pad_is_linked( filter->replacesinkpad) )
+  GstElement* pipeline = gst_parse_launch( "filesrc name=src ! decodebin ! videoconvert ! videoscale ! "
+      "capsfilter name=filter ! fakesink name=sink sync=false enable-last-sample=true", &error );
+  if (!pipeline)
   {
-    if (filter->nextReplaceBuffer)
+    GST_ERROR_OBJECT( filter, "Could not create pipeline to load %s: %s", location, error ? error->message : "unknown error" );
+    g_clear_error( &error );
+    return NULL;
+  }
+  g_clear_error( &error );
+
+  /* stills come without a framerate */
+  GstVideoInfo stillInfo = *info;
+  stillInfo.fps_n = 0;
+  stillInfo.fps_d = 1;
+  GstCaps* caps = gst_video_info_to_caps( &stillInfo );
+
+  GstElement* src = gst_bin_get_by_name( GST_BIN(pipeline), "src" );
+  GstElement* capsfilter = gst_bin_get_by_name( GST_BIN(pipeline), "filter" );
+  GstElement* sink = gst_bin_get_by_name( GST_BIN(pipeline), "sink" );
+  g_object_set( src, "location", location, NULL );
+  g_object_set( capsfilter, "caps", caps, NULL );
+  gst_caps_unref( caps );
+
+  gst_element_set_state( pipeline, GST_STATE_PAUSED );
+  if (gst_element_get_state( pipeline, NULL, NULL, 10 * GST_SECOND ) == GST_STATE_CHANGE_SUCCESS)
+  {
+    GstSample* sample = NULL;
+    g_object_get( sink, "last-sample", &sample, NULL );
+    if (sample)
     {
-      ret = gst_buffer_ref( filter->nextReplaceBuffer );
+      /* detach from the decoder's pool */
+      ret = gst_buffer_copy_deep( gst_sample_get_buffer( sample ) );
+      gst_sample_unref( sample );
     }
-    g_mutex_unlock( &filter->replacesinkMutex );
-    return ret;
   }
-  while ((filter->nextReplaceBuffer == NULL)&&(!filter->eos)&&(!filter->flushing))
+  if (!ret)
   {
-    g_cond_wait( &filter->replacesinkEvent, &filter->replacesinkMutex );
+    GST_ERROR_OBJECT( filter, "Could not load replacement image %s", location );
   }
-  ret = filter->nextReplaceBuffer;
-  filter->nextReplaceBuffer = NULL;
-  g_cond_broadcast( &filter->replacesinkEvent );
-  g_mutex_unlock( &filter->replacesinkMutex );
+  gst_element_set_state( pipeline, GST_STATE_NULL );
+  gst_object_unref( src );
+  gst_object_unref( capsfilter );
+  gst_object_unref( sink );
+  gst_object_unref( pipeline );
   return ret;
 }
 
-static double squareError( guint8* p1, guint8* p2, gsize d, gsize size )
+/* A replace-location image to decode for caps @info */
+typedef struct
+{
+  gchar* location;
+  GstVideoInfo info;
+  guint generation;
+} StillLoad;
+
+/* Runs on stillLoader. Publishes the decoded image unless a newer load was
+ * asked for meanwhile. While an image replaces ident 0, its replacesink
+ * stream isn't used, so what is queued there is dropped to let upstream
+ * go on. */
+static void stillLoadWorker( gpointer data, gpointer user_data )
 {
-  guint64 sad = 0;
-  for( int i=0; i<size; i+=d)
+  StillLoad* load = data;
+  GstStillReplaceFilter* filter = user_data;
+  GstStillReplaceIdent* ident = g_ptr_array_index( filter->idents, 0 );
+
+  GST_OBJECT_LOCK(filter);
+  gboolean current = (load->generation == filter->stillGeneration);
+  GST_OBJECT_UNLOCK(filter);
+  GstBuffer* still = current ? loadReplaceStill( filter, load->location, &load->info ) : NULL;
+
+  GST_OBJECT_LOCK(filter);
+  if (still && (load->generation == filter->stillGeneration))
   {
-    int tmp = p1[i] - p2[i];
-    sad += tmp*tmp;
+    gst_buffer_replace( &ident->replaceStill, still );
+    publishConfig( filter );
+    g_mutex_lock (&filter->replacesinkMutex);
+    queueClear( ident );
+    g_cond_broadcast( &filter->replacesinkEvent );
+    g_mutex_unlock (&filter->replacesinkMutex);
   }
-  return (double)sad;
-  //return (double)(10 * log10(65025.0f * (size/d)/sad));
-}
-static double psnr( double mse )
-{
-  return (double)(10 * log10(65025.0f/mse));
+  GST_OBJECT_UNLOCK(filter);
+  if (still)
+    gst_buffer_unref( still );
+  g_free( load->location );
+  g_free( load );
 }
 
-
-/* chain function
- * this function does the actual processing
- */
-static GstFlowReturn
-stillreplacefilter_chain (GstPad * pad, GstObject * parent, GstBuffer * buf)
+/* (Re)load the replace-location image for the current caps. Called from
+ * the caps event and when the property changes. The old image goes right
+ * away, as it is of another location or size, and ident 0 is replaced
+ * from its replacesink stream until the new one is decoded on stillLoader,
+ * so no streaming thread waits for the decode. */
+static void updateReplaceStill( GstStillReplaceFilter* filter )
 {
-  GstStillReplaceFilter *filter;
+  GstStillReplaceIdent* ident = g_ptr_array_index( filter->idents, 0 );
+  GError* error = NULL;
 
-  filter = GST_STILLREPLACEFILTER (parent);
+  GST_OBJECT_LOCK(filter);
+  filter->stillGeneration++;
+  gst_buffer_replace( &ident->replaceStill, NULL );
+  publishConfig( filter );
+  if ((filter->replace_location == NULL)||(filter->sink_info.finfo == NULL))
+  {
+    GST_OBJECT_UNLOCK(filter);
+    return;
+  }
+  StillLoad* load = g_new0( StillLoad, 1 );
+  load->location = g_strdup( filter->replace_location );
+  load->info = filter->sink_info;
+  load->generation = filter->stillGeneration;
+  if (filter->stillLoader == NULL)
+    filter->stillLoader = g_thread_pool_new( stillLoadWorker, filter, 1, FALSE, &error );
+  GThreadPool* loader = filter->stillLoader;
+  GST_OBJECT_UNLOCK(filter);
 
-  GstBuffer* refImageBuffer = NULL;
-  GST_OBJECT_LOCK( filter );
-  if (filter->refImageBuffer) 
+  if ((loader == NULL)||!g_thread_pool_push( loader, load, &error ))
   {
-    refImageBuffer = gst_buffer_ref(filter->refImageBuffer);
+    GST_ERROR_OBJECT( filter, "Could not start loading %s: %s", load->location, error ? error->message : "unknown error" );
+    g_clear_error( &error );
+    g_free( load->location );
+    g_free( load );
   }
-  GST_OBJECT_UNLOCK( filter );
+}
 
-  gboolean replace = FALSE;
-  if (!refImageBuffer)
+/* Map a reference file written by save-reference, see gststillreplaceref.c
+ * for the layout. The mapped file is used without copying. */
+static GstStillReplaceRef* loadReference( GstStillReplaceFilter* filter, const gchar* location, const GstVideoInfo* info )
+{
+  GError* error = NULL;
+  GMappedFile* file = g_mapped_file_new( location, FALSE, &error );
+  if (!file)
   {
-    if (filter->silent == FALSE)
-      GST_INFO("replacing refImageBuffer\n");
-    gst_buffer_replace( &filter->refImageBuffer, buf );
+    GST_ERROR_OBJECT( filter, "Could not map reference %s: %s", location, error->message );
+    g_clear_error( &error );
+    return NULL;
   }
-  else if (filter->psnr > 0)
+
+  StillReplaceRefFile header;
+  if (!stillreplace_ref_file_parse( g_mapped_file_get_contents( file ), g_mapped_file_get_length( file ), &header ))
   {
-    // Compare frame
-    GstVideoFrame refFrame;
-    if (gst_video_frame_map (&refFrame, &filter->sink_info, refImageBuffer, GST_MAP_READ))
-    {
-      GstVideoFrame frame;
-      if (gst_video_frame_map (&frame, &filter->sink_info, buf, GST_MAP_READ))
-      {
-        guint lines = filter->compare_lines;
-        if ((lines == 0)||(lines > filter->sink_info.height))
-        {
-          lines = filter->sink_info.height;
-        }
-        int planes = GST_VIDEO_FRAME_N_PLANES(&refFrame);
-        if (planes > GST_VIDEO_FRAME_N_PLANES(&frame) )
-        {
-          planes = GST_VIDEO_FRAME_N_PLANES(&frame);
-        }
-        for ( int plane=0; plane<planes && replace == FALSE; ++plane)
-        {
-          guint8 *pRefData = GST_VIDEO_FRAME_PLANE_DATA(&refFrame, plane);
-          guint8 *pData = GST_VIDEO_FRAME_PLANE_DATA(&frame, plane);
-          gsize rowbytes = GST_VIDEO_FRAME_PLANE_STRIDE(&frame, plane);
-          guint comps = GST_VIDEO_FRAME_N_COMPONENTS(&frame);
-          for ( int comp = 0; comp < comps && replace == FALSE; ++comp) {
-            double mse = squareError(pRefData + comp, pData + comp, GST_VIDEO_FRAME_N_COMPONENTS(&frame), rowbytes * lines)/(lines*(rowbytes/comps));
-            double val = psnr( mse );
-            if (filter->silent == FALSE )
-              GST_INFO("psnr: %f  \n", val);
-            if (val > (double)filter->psnr)
-            {
-              replace = TRUE;
-            }
-          }
-        }
-        gst_video_frame_unmap( &frame );
-      }
-      gst_video_frame_unmap( &refFrame );
-    }
+    GST_ERROR_OBJECT( filter, "%s is not a reference file", location );
+    g_mapped_file_unref( file );
+    return NULL;
   }
-  if (replace)
+  /* the element compares its own regions, the rects are for the scanner */
+  stillreplace_ref_file_clear( &header );
+  if ((gst_video_format_from_string( header.format ) != GST_VIDEO_INFO_FORMAT(info))||
+      (header.width != (guint)info->width)||(header.height != (guint)info->height))
   {
-    buf = gst_buffer_make_writable(buf);
-    GstBuffer* replaceBuffer = getNextReplaceBuffer( filter );
-    if (replaceBuffer)
-    {
-      GstVideoFrame srcFrame;
-      if (gst_video_frame_map (&srcFrame, &filter->replacesink_info, replaceBuffer, GST_MAP_READ))
+    GST_ERROR_OBJECT( filter, "Reference %s is %s %ux%u, stream is %s %dx%d", location,
+        header.format, header.width, header.height, GST_VIDEO_INFO_NAME(info), info->width, info->height );
+    g_mapped_file_unref( file );
+    return NULL;
+  }
+  /* the compare reads the plane of comp at the file's area with its pixel
+   * layout, so they must be those of the stream */
+  StillReplaceRect frameRect = { 0, 0, info->width, info->height }, plane;
+  gboolean v210 = (GST_VIDEO_INFO_FORMAT(info) == GST_VIDEO_FORMAT_v210);
+  if ((header.comp >= GST_VIDEO_INFO_N_COMPONENTS(info))||(GST_VIDEO_INFO_COMP_PLANE(info, header.comp) != 0)||
+      (header.data.pstride != (v210 ? STILLREPLACE_V210_GROUP_BYTES : (guint)GST_VIDEO_INFO_COMP_PSTRIDE(info, header.comp)))||
+      (!matchRect( info, header.comp, &frameRect, &plane ))||
+      ((guint64)header.data.area.x + header.data.area.width > plane.width)||
+      ((guint64)header.data.area.y + header.data.area.height > plane.height))
+  {
+    GST_ERROR_OBJECT( filter, "Reference %s doesn't fit the layout of %s", location, GST_VIDEO_INFO_NAME(info) );
+    g_mapped_file_unref( file );
+    return NULL;
+  }
+
+  /* the reference keeps the file mapped */
+  GstStillReplaceRef* ref = g_new0( GstStillReplaceRef, 1 );
+  ref->refcount = 1;
+  ref->format = GST_VIDEO_INFO_FORMAT(info);
+  ref->width = info->width;
+  ref->height = info->height;
+  ref->comp = header.comp;
+  ref->pstride = header.data.pstride;
+  ref->sample = header.data.sample;
+  ref->depth = header.data.depth;
+  ref->lane_mask = header.data.lane_mask;
+  ref->area = header.data.area;
+  ref->stride = header.data.stride;
+  ref->data = header.data.data;
+  ref->storage = file;
+  ref->storage_free = (GDestroyNotify)g_mapped_file_unref;
+  return ref;
+}
+
+/* Load the reference-location file as reference of ident 0 for the current
+ * caps. Called from the caps event and when the property changes. */
+static void updateReference( GstStillReplaceFilter* filter )
+{
+  GstStillReplaceIdent* ident = g_ptr_array_index( filter->idents, 0 );
+
+  GST_OBJECT_LOCK(filter);
+  gchar* location = g_strdup( filter->reference_location );
+  GstVideoInfo info = filter->sink_info;
+  GST_OBJECT_UNLOCK(filter);
+
+  if ((location != NULL)&&(info.finfo != NULL))
+  {
+    GstStillReplaceRef* ref = loadReference( filter, location, &info );
+    if (ref)
+    {
+      GST_OBJECT_LOCK(filter);
+      referenceReplace( &ident->refImage, ref );
+      publishConfig( filter );
+      GST_OBJECT_UNLOCK(filter);
+      referenceUnref( ref );
+    }
+  }
+  g_free( location );
+}
+
+/* Close the replacement window, the next frame gets a full compare again */
+static void endHold( GstStillReplaceFeed* feed )
+{
+  feed->holdIdent = NULL;
+  referenceReplace( &feed->holdRef, NULL );
+}
+
+/* Drop the decision kept for repeated input frames */
+static void forgetDecision( GstStillReplaceFeed* feed )
+{
+  g_clear_pointer( &feed->decision.refs, g_ptr_array_unref );
+  g_clear_pointer( &feed->decision.regions, g_array_unref );
+  feed->decision.match = NULL;
+}
+
+/* Converter of one overlay region, kept while the replacement format,
+ * the region and the thread count stay the same */
+typedef struct
+{
+  GstVideoInfo info; // Format of the replacement it reads
+  StillReplaceRect src; // Region of the replacement it converts
+  guint n_threads;
+  GstVideoConverter* converter;
+} OverlayConverter;
+
+static void freeOverlayConverter( OverlayConverter* c )
+{
+  if (c == NULL)
+    return;
+  gst_video_converter_free( c->converter );
+  g_free( c );
+}
+
+static void forgetOverlay( GstStillReplaceFeed* feed )
+{
+  g_clear_pointer( &feed->overlay.source, gst_buffer_unref );
+  g_clear_pointer( &feed->overlay.regions, g_array_unref );
+  g_clear_pointer( &feed->overlay.composition, gst_video_overlay_composition_unref );
+}
+
+static void dropOutputPool( GstStillReplaceFeed* feed )
+{
+  GST_OBJECT_LOCK(feed->filter);
+  GstBufferPool* pool = feed->outputPool;
+  feed->outputPool = NULL;
+  feed->downstreamVideoMeta = FALSE;
+  feed->downstreamOverlay = FALSE;
+  GST_OBJECT_UNLOCK(feed->filter);
+  if (pool)
+  {
+    gst_buffer_pool_set_active( pool, FALSE );
+    gst_object_unref( pool );
+  }
+}
+
+static void
+stillreplacefilter_set_property (GObject * object, guint prop_id,
+    const GValue * value, GParamSpec * pspec)
+{
+  GstStillReplaceFilter *filter = GST_STILLREPLACEFILTER (object);
+
+  switch (prop_id)
+  {
+    case PROP_SILENT:
+      GST_OBJECT_LOCK(filter);
+      filter->silent = g_value_get_boolean (value);
+      publishConfig( filter );
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_COMPARELINES:
+      GST_OBJECT_LOCK(filter);
+      filter->compare_lines = g_value_get_uint (value);
+      publishConfig( filter );
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_PSNR:
+      GST_OBJECT_LOCK(filter);
+      filter->psnr = g_value_get_uint (value);
+      filter->sse_budget = stillreplace_match_psnr_to_budget( filter->psnr );
+      publishConfig( filter );
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_RESAMPLE:
+    {
+      GstStillReplaceIdent* ident = g_ptr_array_index( filter->idents, 0 );
+      GST_OBJECT_LOCK(filter);
+      referenceReplace( &ident->refImage, NULL );
+      publishConfig( filter );
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    }
+    case PROP_REGIONS:
+    {
+      /* an empty list hands the compared area back to roi-* */
+      GArray* regions = parseRegions( filter, g_value_get_string (value) );
+      GST_OBJECT_LOCK(filter);
+      filter->regionsSet = regions->len > 0;
+      gboolean overridesRoi = filter->regionsSet && (filter->roi.width > 0)&&(filter->roi.height > 0);
+      if (!filter->regionsSet)
+      {
+        g_array_unref( regions );
+        regions = roiRegions( filter );
+      }
+      g_array_unref( filter->regions );
+      filter->regions = regions;
+      publishConfig( filter );
+      GST_OBJECT_UNLOCK(filter);
+      if (overridesRoi)
+        GST_WARNING_OBJECT( filter, "regions is set, roi-* are ignored" );
+      break;
+    }
+    case PROP_ROI_X:
+    case PROP_ROI_Y:
+    case PROP_ROI_WIDTH:
+    case PROP_ROI_HEIGHT:
+      setRoi( filter, prop_id, g_value_get_uint (value) );
+      break;
+    case PROP_REPLACE_MODE:
+      GST_OBJECT_LOCK(filter);
+      filter->replace_mode = g_value_get_enum (value);
+      publishConfig( filter );
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_REPLACE_REGIONS:
+    {
+      GArray* regions = parseReplaceRegions( filter, g_value_get_string (value) );
+      GST_OBJECT_LOCK(filter);
+      g_array_unref( filter->replace_regions );
+      filter->replace_regions = regions;
+      publishConfig( filter );
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    }
+    case PROP_REPLACE_QUEUE_SIZE:
+      g_mutex_lock (&filter->replacesinkMutex);
+      filter->replace_queue_size = g_value_get_uint (value);
+      g_cond_broadcast( &filter->replacesinkEvent );
+      g_mutex_unlock (&filter->replacesinkMutex);
+      break;
+    case PROP_REPLACE_POLICY:
+      g_mutex_lock (&filter->replacesinkMutex);
+      filter->replace_policy = g_value_get_enum (value);
+      g_cond_broadcast( &filter->replacesinkEvent );
+      g_mutex_unlock (&filter->replacesinkMutex);
+      break;
+    case PROP_REPLACE_LOCATION:
+      GST_OBJECT_LOCK(filter);
+      g_free( filter->replace_location );
+      filter->replace_location = g_value_dup_string (value);
+      GST_OBJECT_UNLOCK(filter);
+      updateReplaceStill( filter );
+      break;
+    case PROP_N_THREADS:
+      GST_OBJECT_LOCK(filter);
+      filter->n_threads = g_value_get_uint (value);
+      publishConfig( filter );
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_POST_MESSAGES:
+      GST_OBJECT_LOCK(filter);
+      filter->post_messages = g_value_get_boolean (value);
+      publishConfig( filter );
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_HOLD_FRAMES:
+      GST_OBJECT_LOCK(filter);
+      filter->hold_frames = g_value_get_uint (value);
+      publishConfig( filter );
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_HOLD_DURATION:
+      GST_OBJECT_LOCK(filter);
+      filter->hold_duration = g_value_get_uint64 (value);
+      publishConfig( filter );
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_HOLD_CHECK_LINES:
+      GST_OBJECT_LOCK(filter);
+      filter->hold_check_lines = g_value_get_uint (value);
+      publishConfig( filter );
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_SIGNATURE_LINES:
+      GST_OBJECT_LOCK(filter);
+      filter->signature_lines = g_value_get_uint (value);
+      publishConfig( filter );
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_COARSE_ROW_STEP:
+      GST_OBJECT_LOCK(filter);
+      filter->coarse_row_step = g_value_get_uint (value);
+      publishConfig( filter );
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_COARSE_COLUMN_STEP:
+      GST_OBJECT_LOCK(filter);
+      filter->coarse_column_step = g_value_get_uint (value);
+      publishConfig( filter );
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_REFERENCE_LOCATION:
+      GST_OBJECT_LOCK(filter);
+      g_free( filter->reference_location );
+      filter->reference_location = g_value_dup_string (value);
+      GST_OBJECT_UNLOCK(filter);
+      updateReference( filter );
+      break;
+    case PROP_PIPELINE_DEPTH:
+    {
+      GST_OBJECT_LOCK(filter);
+      guint old = filter->pipeline_depth;
+      filter->pipeline_depth = g_value_get_uint (value);
+      gboolean changed = (old != filter->pipeline_depth);
+      publishConfig( filter );
+      GST_OBJECT_UNLOCK(filter);
+      if (changed)
+        gst_element_post_message( GST_ELEMENT(filter), gst_message_new_latency( GST_OBJECT(filter) ) );
+      break;
+    }
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+/* Add up the counters of all feeds into @sum, without stopping their
+ * streaming threads */
+static void sumStats( GstStillReplaceFilter* filter, GstStillReplaceStats* sum )
+{
+  memset( sum, 0, sizeof(*sum) );
+  GST_OBJECT_LOCK(filter);
+  for ( guint i = 0; i < filter->feeds->len; ++i )
+  {
+    GstStillReplaceFeed* feed = g_ptr_array_index( filter->feeds, i );
+    GstStillReplaceStats s;
+    gint seq;
+    do
+    {
+      while ((seq = g_atomic_int_get( &feed->statsSeq )) & 1)
+        g_thread_yield();
+      s = feed->stats;
+    } while (g_atomic_int_get( &feed->statsSeq ) != seq);
+    sum->frames += s.frames;
+    sum->compared += s.compared;
+    sum->matches += s.matches;
+    sum->misses += s.misses;
+    sum->held += s.held;
+    sum->reused += s.reused;
+    sum->coarse_rejects += s.coarse_rejects;
+    sum->compare_time += s.compare_time;
+    sum->replace_time += s.replace_time;
+    sum->wait_time += s.wait_time;
+  }
+  GST_OBJECT_UNLOCK(filter);
+}
+
+static void
+stillreplacefilter_get_property (GObject * object, guint prop_id,
+    GValue * value, GParamSpec * pspec)
+{
+  GstStillReplaceFilter *filter = GST_STILLREPLACEFILTER (object);
+
+  switch (prop_id) {
+    case PROP_SILENT:
+      GST_OBJECT_LOCK(filter);
+      g_value_set_boolean (value, filter->silent);
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_COMPARELINES:
+      GST_OBJECT_LOCK(filter);
+      g_value_set_uint (value, filter->compare_lines);
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_PSNR:
+      GST_OBJECT_LOCK(filter);
+      g_value_set_uint (value, filter->psnr);
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_REGIONS:
+      GST_OBJECT_LOCK(filter);
+      g_value_take_string (value, filter->regionsSet ? formatRegions( filter->regions ) : NULL);
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_REPLACE_MODE:
+      GST_OBJECT_LOCK(filter);
+      g_value_set_enum (value, filter->replace_mode);
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_REPLACE_REGIONS:
+      GST_OBJECT_LOCK(filter);
+      g_value_take_string (value, formatReplaceRegions( filter->replace_regions ));
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_ROI_X:
+    case PROP_ROI_Y:
+    case PROP_ROI_WIDTH:
+    case PROP_ROI_HEIGHT:
+      GST_OBJECT_LOCK(filter);
+      g_value_set_uint (value, prop_id == PROP_ROI_X ? filter->roi.x : prop_id == PROP_ROI_Y ? filter->roi.y :
+          prop_id == PROP_ROI_WIDTH ? filter->roi.width : filter->roi.height);
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_REPLACE_QUEUE_SIZE:
+      g_mutex_lock (&filter->replacesinkMutex);
+      g_value_set_uint (value, filter->replace_queue_size);
+      g_mutex_unlock (&filter->replacesinkMutex);
+      break;
+    case PROP_REPLACE_POLICY:
+      g_mutex_lock (&filter->replacesinkMutex);
+      g_value_set_enum (value, filter->replace_policy);
+      g_mutex_unlock (&filter->replacesinkMutex);
+      break;
+    case PROP_REPLACE_LOCATION:
+      GST_OBJECT_LOCK(filter);
+      g_value_set_string (value, filter->replace_location);
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_N_THREADS:
+      GST_OBJECT_LOCK(filter);
+      g_value_set_uint (value, filter->n_threads);
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_POST_MESSAGES:
+      GST_OBJECT_LOCK(filter);
+      g_value_set_boolean (value, filter->post_messages);
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_HOLD_FRAMES:
+      GST_OBJECT_LOCK(filter);
+      g_value_set_uint (value, filter->hold_frames);
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_HOLD_DURATION:
+      GST_OBJECT_LOCK(filter);
+      g_value_set_uint64 (value, filter->hold_duration);
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_HOLD_CHECK_LINES:
+      GST_OBJECT_LOCK(filter);
+      g_value_set_uint (value, filter->hold_check_lines);
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_SIGNATURE_LINES:
+      GST_OBJECT_LOCK(filter);
+      g_value_set_uint (value, filter->signature_lines);
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_COARSE_ROW_STEP:
+      GST_OBJECT_LOCK(filter);
+      g_value_set_uint (value, filter->coarse_row_step);
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_COARSE_COLUMN_STEP:
+      GST_OBJECT_LOCK(filter);
+      g_value_set_uint (value, filter->coarse_column_step);
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_REFERENCE_LOCATION:
+      GST_OBJECT_LOCK(filter);
+      g_value_set_string (value, filter->reference_location);
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_PIPELINE_DEPTH:
+      GST_OBJECT_LOCK(filter);
+      g_value_set_uint (value, filter->pipeline_depth);
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    case PROP_STATS:
+    {
+      GstStillReplaceStats stats;
+      sumStats( filter, &stats );
+      g_value_take_boxed (value, gst_structure_new ("stillreplacefilter-stats",
+          "frames", G_TYPE_UINT64, stats.frames,
+          "compared", G_TYPE_UINT64, stats.compared,
+          "matches", G_TYPE_UINT64, stats.matches,
+          "misses", G_TYPE_UINT64, stats.misses,
+          "held", G_TYPE_UINT64, stats.held,
+          "reused", G_TYPE_UINT64, stats.reused,
+          "coarse-rejects", G_TYPE_UINT64, stats.coarse_rejects,
+          "compare-time", G_TYPE_UINT64, stats.compare_time,
+          "replace-time", G_TYPE_UINT64, stats.replace_time,
+          "wait-time", G_TYPE_UINT64, stats.wait_time,
+          NULL));
+      break;
+    }
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+
+/* GstElement vmethod implementations */
+
+/* Whether @pad carries one of the feeds: sink and src, or sink_N and src_N */
+static gboolean isFeedPad( GstPad* pad )
+{
+  GstPadTemplate* templ = GST_PAD_PAD_TEMPLATE (pad);
+  if (templ == NULL)
+    return FALSE;
+  const gchar* name = GST_PAD_TEMPLATE_NAME_TEMPLATE (templ);
+  return g_str_equal( name, "sink" )||g_str_equal( name, "src" )||
+      g_str_equal( name, "sink_%u" )||g_str_equal( name, "src_%u" );
+}
+
+/* Whether @info describes frames laid out and coloured like those of the
+ * other feeds. The feeds share references and replacements with @feed,
+ * and the config maps the frames of all of them with the caps of the last
+ * one, so only frame rate and pixel aspect ratio may differ. Called with
+ * the object lock held. */
+static gboolean feedCapsCompatible( GstStillReplaceFilter* filter, GstStillReplaceFeed* feed, const GstVideoInfo* info )
+{
+  for ( guint i = 0; i < filter->feeds->len; ++i )
+  {
+    GstStillReplaceFeed* other = g_ptr_array_index( filter->feeds, i );
+    if ((other == feed)||(other->sinkpad == NULL)||(other->info.finfo == NULL))
+      continue;
+    if ((GST_VIDEO_INFO_FORMAT(info) != GST_VIDEO_INFO_FORMAT(&other->info))||
+        (info->width != other->info.width)||(info->height != other->info.height)||
+        (GST_VIDEO_INFO_INTERLACE_MODE(info) != GST_VIDEO_INFO_INTERLACE_MODE(&other->info))||
+        (GST_VIDEO_INFO_VIEWS(info) != GST_VIDEO_INFO_VIEWS(&other->info))||
+        (info->chroma_site != other->info.chroma_site)||
+        !gst_video_colorimetry_is_equal( &info->colorimetry, &other->info.colorimetry )||
+        (GST_VIDEO_INFO_SIZE(info) != GST_VIDEO_INFO_SIZE(&other->info)))
+      return FALSE;
+    for ( guint plane = 0; plane < GST_VIDEO_INFO_N_PLANES(info); ++plane )
+    {
+      if ((GST_VIDEO_INFO_PLANE_STRIDE(info, plane) != GST_VIDEO_INFO_PLANE_STRIDE(&other->info, plane))||
+          (GST_VIDEO_INFO_PLANE_OFFSET(info, plane) != GST_VIDEO_INFO_PLANE_OFFSET(&other->info, plane)))
+        return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+/* Set filter->eos and filter->flushing once every feed still having its
+ * sink pad is at EOS or flushing, and wake everything waiting on the
+ * replacesink. Called with the object lock and replacesinkMutex held. */
+static void updateFeedState( GstStillReplaceFilter* filter )
+{
+  filter->eos = TRUE;
+  filter->flushing = TRUE;
+  for ( guint i = 0; i < filter->feeds->len; ++i )
+  {
+    GstStillReplaceFeed* feed = g_ptr_array_index( filter->feeds, i );
+    if (feed->sinkpad && !feed->eos)
+      filter->eos = FALSE;
+    if (feed->sinkpad && !feed->flushing)
+      filter->flushing = FALSE;
+  }
+  g_cond_broadcast( &filter->replacesinkEvent );
+}
+
+static void setFeedFlushing( GstStillReplaceFeed* feed, gboolean flushing )
+{
+  GstStillReplaceFilter* filter = feed->filter;
+  GST_OBJECT_LOCK(filter);
+  g_mutex_lock (&filter->replacesinkMutex);
+  feed->flushing = flushing;
+  /* a flush also ends EOS */
+  if (!flushing)
+    feed->eos = FALSE;
+  updateFeedState( filter );
+  g_mutex_unlock (&filter->replacesinkMutex);
+  GST_OBJECT_UNLOCK(filter);
+}
+
+/* Deactivating a sink pad wakes its streaming thread when it waits for a
+ * replacement or for room in the replacement queue, so the pad can take
+ * the stream lock. */
+static gboolean
+stillreplacefilter_sink_activate_mode (GstPad * pad, GstObject * parent, GstPadMode mode, gboolean active)
+{
+  GstStillReplaceFilter *filter = GST_STILLREPLACEFILTER (parent);
+
+  if (isFeedPad( pad ))
+  {
+    setFeedFlushing( gst_pad_get_element_private (pad), !active );
+    return TRUE;
+  }
+  /* request pads are activated before they are added, nothing waits yet */
+  if (filter == NULL)
+    return TRUE;
+  GstStillReplaceIdent *ident = gst_pad_get_element_private (pad);
+  g_mutex_lock (&filter->replacesinkMutex);
+  ident->replaceFlushing = !active;
+  if (active)
+    ident->replaceEos = FALSE;
+  g_cond_broadcast( &filter->replacesinkEvent );
+  g_mutex_unlock (&filter->replacesinkMutex);
+  return TRUE;
+}
+
+/* this function handles sink events of all feeds */
+static gboolean
+stillreplacefilter_sink_event (GstPad * pad, GstObject * parent, GstEvent * event)
+{
+  GstStillReplaceFilter *filter;
+  GstStillReplaceFeed *feed = gst_pad_get_element_private (pad);
+  gboolean ret;
+
+  filter = GST_STILLREPLACEFILTER (parent);
+
+  GST_LOG_OBJECT (pad, "Received %s event: %" GST_PTR_FORMAT,
+      GST_EVENT_TYPE_NAME (event), event);
+
+  /* frames still in the match pipeline go out before anything serialized
+   * after them, or are dropped when flushing */
+  if (GST_EVENT_TYPE (event) == GST_EVENT_FLUSH_STOP)
+    finishPendingFrames( feed, 0, FALSE );
+  else if (GST_EVENT_IS_SERIALIZED (event))
+    finishPendingFrames( feed, 0, TRUE );
+
+  switch (GST_EVENT_TYPE (event)) {
+    case GST_EVENT_FLUSH_START:
+    case GST_EVENT_FLUSH_STOP:
+    {
+      /* wake up the streaming thread waiting for a replacement or an output
+       * buffer, only once downstream flushes so the frame it was working on
+       * doesn't get out */
+      gboolean start = (GST_EVENT_TYPE (event) == GST_EVENT_FLUSH_START);
+      if (!start)
+        setFeedFlushing( feed, FALSE );
+      ret = gst_pad_event_default (pad, parent, event);
+      if (start)
+        setFeedFlushing( feed, TRUE );
+      GST_OBJECT_LOCK(filter);
+      if (feed->outputPool)
+        gst_buffer_pool_set_flushing( feed->outputPool, start );
+      GST_OBJECT_UNLOCK(filter);
+      break;
+    }
+    case GST_EVENT_CAPS:
+    {
+      GstCaps * caps;
+      GstVideoInfo info;
+
+      gst_event_parse_caps (event, &caps);
+      /* do something with the caps */
+      if (!gst_video_info_from_caps (&info, caps))
+      {
+        return FALSE;
+      }
+      GST_OBJECT_LOCK(filter);
+      if (!feedCapsCompatible( filter, feed, &info ))
+      {
+        GST_OBJECT_UNLOCK(filter);
+        GST_ERROR_OBJECT( pad, "Caps negotiation failed: all feeds must have the same caps apart from framerate and pixel-aspect-ratio" );
+        gst_event_unref( event );
+        return FALSE;
+      }
+      GST_OBJECT_UNLOCK(filter);
+      /* buffers of the old size are no use anymore, the pool is negotiated
+       * again for the next replacement */
+      dropOutputPool( feed );
+      GST_OBJECT_LOCK(filter);
+      feed->info = info;
+      /* the still and the reference file only depend on format and size,
+       * other caps changes keep them and the reference ident 0 has now */
+      gboolean resized = (filter->sink_info.finfo == NULL)||(GST_VIDEO_INFO_FORMAT(&info) != GST_VIDEO_INFO_FORMAT(&filter->sink_info))||
+          (info.width != filter->sink_info.width)||(info.height != filter->sink_info.height);
+      gboolean reloadStill = (filter->replace_location != NULL)&&resized;
+      gboolean reloadReference = (filter->reference_location != NULL)&&resized;
+      filter->sink_info = info;
+      publishConfig( filter );
+      GST_OBJECT_UNLOCK(filter);
+      endHold( feed );
+      forgetDecision( feed );
+
+      if (reloadStill)
+        updateReplaceStill( filter );
+      if (reloadReference)
+        updateReference( filter );
+
+      GPtrArray* replacePads = g_ptr_array_new_with_free_func( gst_object_unref );
+      GST_OBJECT_LOCK(filter);
+      for ( guint i = 0; i < filter->idents->len; ++i )
+      {
+        GstStillReplaceIdent* ident = g_ptr_array_index( filter->idents, i );
+        if (ident->replacesinkpad)
+          g_ptr_array_add( replacePads, gst_object_ref( ident->replacesinkpad ) );
+      }
+      GST_OBJECT_UNLOCK(filter);
+      for ( guint i = 0; i < replacePads->len; ++i )
+      {
+        if (!gst_pad_set_caps( g_ptr_array_index( replacePads, i ), caps )) {
+          GST_ERROR_OBJECT( filter, "Caps negotiation failed: Replacesink pad must allow the same caps as the main sink");
+          g_ptr_array_unref( replacePads );
+          return FALSE;
+        }
+      }
+      g_ptr_array_unref( replacePads );
+
+      /* and forward */
+      ret = gst_pad_event_default (pad, parent, event);
+      break;
+    }
+    case GST_EVENT_EOS:
+    {
+      /* the replacesink streams keep going while any feed does */
+      GST_OBJECT_LOCK(filter);
+      g_mutex_lock (&filter->replacesinkMutex);
+      feed->eos = TRUE;
+      updateFeedState( filter );
+      g_mutex_unlock (&filter->replacesinkMutex);
+      GST_OBJECT_UNLOCK(filter);
+      ret = gst_pad_event_default (pad, parent, event);
+      break;
+    }
+    default:
+      ret = gst_pad_event_default (pad, parent, event);
+      break;
+  }
+  return ret;
+}
+
+/* this function handles src queries: pipelined matching holds back
+ * pipeline-depth frames, which adds to the upstream latency */
+static gboolean
+stillreplacefilter_src_query (GstPad * pad, GstObject * parent, GstQuery * query)
+{
+  GstStillReplaceFilter *filter = GST_STILLREPLACEFILTER (parent);
+  GstStillReplaceFeed *feed = gst_pad_get_element_private (pad);
+
+  switch (GST_QUERY_TYPE (query)) {
+    case GST_QUERY_LATENCY:
+    {
+      gboolean live;
+      GstClockTime min, max, latency = 0;
+
+      GST_OBJECT_LOCK(filter);
+      GstPad* sinkpad = feed->sinkpad ? gst_object_ref( feed->sinkpad ) : NULL;
+      GST_OBJECT_UNLOCK(filter);
+      gboolean ok = sinkpad && gst_pad_peer_query (sinkpad, query);
+      if (sinkpad)
+        gst_object_unref( sinkpad );
+      if (!ok)
+        return FALSE;
+      gst_query_parse_latency (query, &live, &min, &max);
+
+      GST_OBJECT_LOCK(filter);
+      if ((filter->pipeline_depth > 0)&&(feed->info.fps_n > 0))
+        latency = gst_util_uint64_scale_int (filter->pipeline_depth * GST_SECOND,
+            feed->info.fps_d, feed->info.fps_n);
+      GST_OBJECT_UNLOCK(filter);
+
+      GST_DEBUG_OBJECT (filter, "Adding %" GST_TIME_FORMAT " pipelining latency", GST_TIME_ARGS (latency));
+      min += latency;
+      if (GST_CLOCK_TIME_IS_VALID (max))
+        max += latency;
+      gst_query_set_latency (query, live, min, max);
+      return TRUE;
+    }
+    default:
+      return gst_pad_query_default (pad, parent, query);
+  }
+}
+
+/* Take the next replacement frame for @ident on @feed. Depending on the
+ * policy this waits for the replacesink or repeats the previous frame when
+ * the queue is empty. A frame another feed took from the queue, and @feed
+ * didn't show yet, comes first, so feeds replacing at the same time show
+ * the same frames. */
+static GstBuffer* getNextReplaceBuffer( GstStillReplaceFeed* feed, GstStillReplaceIdent* ident )
+{
+  GstStillReplaceFilter* filter = feed->filter;
+  GstBuffer* ret = NULL;
+  g_mutex_lock( &filter->replacesinkMutex );
+  if ( (ident->replacesinkpad == NULL)||(!gst_pad_is_linked( ident->replacesinkpad )) )
+  {
+    if (ident->replaceQueueLength > 0)
+    {
+      ret = gst_buffer_ref( ident->replaceQueue[(ident->replaceQueueHead + ident->replaceQueueLength - 1) % ident->replaceQueueSize] );
+    }
+    else if (ident->lastReplaceBuffer)
+    {
+      ret = gst_buffer_ref( ident->lastReplaceBuffer );
+    }
+    g_mutex_unlock( &filter->replacesinkMutex );
+    return ret;
+  }
+  if (feed->replaceSeen->len <= ident->index)
+    g_array_set_size( feed->replaceSeen, ident->index + 1 );
+  guint64* seen = &g_array_index( feed->replaceSeen, guint64, ident->index );
+  if (ident->lastReplaceBuffer && (*seen < ident->replaceGeneration))
+  {
+    *seen = ident->replaceGeneration;
+    ret = gst_buffer_ref( ident->lastReplaceBuffer );
+    g_mutex_unlock( &filter->replacesinkMutex );
+    return ret;
+  }
+  while ((ident->replaceQueueLength == 0)&&(filter->replace_policy != GST_STILL_REPLACE_POLICY_REPEAT_LAST)&&
+         (!ident->replaceEos)&&(!filter->eos)&&(!feed->flushing))
+  {
+    g_cond_wait( &filter->replacesinkEvent, &filter->replacesinkMutex );
+  }
+  ret = queuePop( ident );
+  if (ret)
+  {
+    gst_buffer_replace( &ident->lastReplaceBuffer, ret );
+    *seen = ++ident->replaceGeneration;
+  }
+  /* an ended replacement stream keeps showing its last frame */
+  else if (((filter->replace_policy == GST_STILL_REPLACE_POLICY_REPEAT_LAST)||(ident->replaceEos))&&(ident->lastReplaceBuffer))
+  {
+    ret = gst_buffer_ref( ident->lastReplaceBuffer );
+  }
+  g_cond_broadcast( &filter->replacesinkEvent );
+  g_mutex_unlock( &filter->replacesinkMutex );
+  return ret;
+}
+
+/* First component stored in @plane */
+static guint planeComponent( const GstVideoFrame* frame, int plane )
+{
+  for ( guint comp = 0; comp < GST_VIDEO_FRAME_N_COMPONENTS(frame); ++comp )
+  {
+    if (GST_VIDEO_FRAME_COMP_PLANE(frame, comp) == plane)
+      return comp;
+  }
+  return 0;
+}
+
+/* Components taking part in the match: every component for RGB, only luma
+ * for YUV since the chroma planes add little for recognising an ident. */
+static guint matchComponents( const GstVideoFrame* frame )
+{
+  if (GST_VIDEO_INFO_IS_YUV(&frame->info))
+    return 1 << 0;
+  return (1 << GST_VIDEO_FRAME_N_COMPONENTS(frame)) - 1;
+}
+
+/* How the match kernels see the matched components of a plane */
+typedef struct
+{
+  gint pstride; // Bytes per pixel, per group of pixels for v210
+  guint comp; // First matched component in the plane
+  guint lane_mask; // Lanes of the matched components inside a pixel
+  StillReplaceSampleFormat sample;
+  guint depth; // Range of a sample in bits, counting the shift of MSB aligned formats
+} MatchLayout;
+
+/* Lane holding @comp in pixels of @layout */
+static guint componentLane( const GstVideoFormatInfo* finfo, guint comp, const MatchLayout* layout )
+{
+  if (layout->sample == STILLREPLACE_SAMPLE_V210)
+    return comp == 0 ? 1 : 0; // luma on the odd samples
+  if (layout->sample == STILLREPLACE_SAMPLE_16)
+    return (GST_VIDEO_FORMAT_INFO_POFFSET(finfo, comp) / 2) % (layout->pstride / 2);
+  return GST_VIDEO_FORMAT_INFO_POFFSET(finfo, comp) % layout->pstride;
+}
+
+/* Layout of the matched components in @plane. Returns FALSE when the plane
+ * has no matched components or can't be handled by the match kernels. */
+static gboolean planeLayout( const GstVideoFrame* frame, int plane, MatchLayout* layout )
+{
+  const GstVideoFormatInfo* finfo = frame->info.finfo;
+  guint comps = matchComponents( frame );
+  memset( layout, 0, sizeof(*layout) );
+
+  if (GST_VIDEO_FRAME_FORMAT(frame) == GST_VIDEO_FORMAT_v210)
+  {
+    /* 6 pixels in 4 words of three 10-bit samples, compared group by group */
+    if (plane != 0)
+      return FALSE;
+    layout->pstride = STILLREPLACE_V210_GROUP_BYTES;
+    layout->sample = STILLREPLACE_SAMPLE_V210;
+    layout->lane_mask = 1 << componentLane( finfo, 0, layout );
+    layout->depth = 10;
+    return TRUE;
+  }
+
+  layout->sample = GST_VIDEO_FORMAT_INFO_BITS(finfo) > 8 ? STILLREPLACE_SAMPLE_16 : STILLREPLACE_SAMPLE_8;
+  guint sampleBytes = layout->sample == STILLREPLACE_SAMPLE_16 ? 2 : 1;
+#if G_BYTE_ORDER == G_BIG_ENDIAN
+  /* the 16-bit kernels read native words */
+  if ((sampleBytes == 2)&&GST_VIDEO_FORMAT_INFO_IS_LE(finfo))
+    return FALSE;
+#endif
+  for ( guint comp = GST_VIDEO_FRAME_N_COMPONENTS(frame); comp-- > 0; )
+  {
+    if ((comps & (1 << comp))&&(GST_VIDEO_FRAME_COMP_PLANE(frame, comp) == plane))
+    {
+      layout->pstride = GST_VIDEO_FRAME_COMP_PSTRIDE(frame, comp);
+      layout->comp = comp;
+      layout->depth = GST_VIDEO_FORMAT_INFO_DEPTH(finfo, comp) + GST_VIDEO_FORMAT_INFO_SHIFT(finfo, comp);
+      if ((layout->pstride >= (gint)sampleBytes)&&(layout->pstride / sampleBytes <= STILLREPLACE_MATCH_MAX_PSTRIDE))
+        layout->lane_mask |= 1 << componentLane( finfo, comp, layout );
+    }
+  }
+  if ((layout->pstride < (gint)sampleBytes)||(layout->pstride % sampleBytes != 0)||
+      (layout->pstride / sampleBytes > STILLREPLACE_MATCH_MAX_PSTRIDE))
+    return FALSE;
+  return TRUE;
+}
+
+/* Smallest rectangle holding all of @rects */
+static StillReplaceRect boundingRect( const StillReplaceRect* rects, guint n_rects )
+{
+  StillReplaceRect bbox = { 0, 0, 0, 0 };
+  if (n_rects == 0)
+    return bbox;
+  guint64 x1 = 0, y1 = 0;
+  bbox.x = rects[0].x;
+  bbox.y = rects[0].y;
+  for ( guint i = 0; i < n_rects; ++i )
+  {
+    bbox.x = MIN( bbox.x, rects[i].x );
+    bbox.y = MIN( bbox.y, rects[i].y );
+    x1 = MAX( x1, (guint64)rects[i].x + rects[i].width );
+    y1 = MAX( y1, (guint64)rects[i].y + rects[i].height );
+  }
+  bbox.width = MIN( x1 - bbox.x, G_MAXUINT );
+  bbox.height = MIN( y1 - bbox.y, G_MAXUINT );
+  return bbox;
+}
+
+/* Map @rect onto the plane holding @comp, clipped to the frame and scaled
+ * for chroma subsampling. Returns FALSE when nothing of it is left. */
+static gboolean planeRect( const GstVideoInfo* info, guint comp, const StillReplaceRect* rect, StillReplaceRect* out )
+{
+  const GstVideoFormatInfo* finfo = info->finfo;
+  guint width = GST_VIDEO_INFO_WIDTH(info);
+  guint height = GST_VIDEO_INFO_HEIGHT(info);
+  guint x0 = MIN( rect->x, width );
+  guint y0 = MIN( rect->y, height );
+  guint x1 = MIN( (guint64)rect->x + rect->width, width );
+  guint y1 = MIN( (guint64)rect->y + rect->height, height );
+
+  out->x = GST_VIDEO_FORMAT_INFO_SCALE_WIDTH(finfo, comp, x0);
+  out->y = GST_VIDEO_FORMAT_INFO_SCALE_HEIGHT(finfo, comp, y0);
+  out->width = GST_VIDEO_FORMAT_INFO_SCALE_WIDTH(finfo, comp, x1) - out->x;
+  out->height = GST_VIDEO_FORMAT_INFO_SCALE_HEIGHT(finfo, comp, y1) - out->y;
+  return (out->width > 0)&&(out->height > 0);
+}
+
+/* planeRect() in the units the match kernels work in: pixels, or groups of
+ * 6 pixels for v210, widened to hold all of @rect */
+static gboolean matchRect( const GstVideoInfo* info, guint comp, const StillReplaceRect* rect, StillReplaceRect* out )
+{
+  if (!planeRect( info, comp, rect, out ))
+    return FALSE;
+  if (GST_VIDEO_INFO_FORMAT(info) == GST_VIDEO_FORMAT_v210)
+  {
+    guint x1 = (out->x + out->width + STILLREPLACE_V210_GROUP_PIXELS - 1) / STILLREPLACE_V210_GROUP_PIXELS;
+    out->x /= STILLREPLACE_V210_GROUP_PIXELS;
+    out->width = x1 - out->x;
+  }
+  return TRUE;
+}
+
+/* Bytes of the pixel at @x onwards in a row of @comp's plane, in whole
+ * v210 groups */
+static gsize rowOffset( const GstVideoInfo* info, guint comp, guint x )
+{
+  if (GST_VIDEO_INFO_FORMAT(info) == GST_VIDEO_FORMAT_v210)
+    return (gsize)(x / STILLREPLACE_V210_GROUP_PIXELS) * STILLREPLACE_V210_GROUP_BYTES;
+  return (gsize)x * GST_VIDEO_INFO_COMP_PSTRIDE(info, comp);
+}
+
+/* Bytes needed for @width pixels of @comp's plane starting at @x, in
+ * whole v210 groups */
+static gsize rowBytes( const GstVideoInfo* info, guint comp, guint x, guint width )
+{
+  if (GST_VIDEO_INFO_FORMAT(info) == GST_VIDEO_FORMAT_v210)
+    return rowOffset( info, comp, x + width + STILLREPLACE_V210_GROUP_PIXELS - 1 ) - rowOffset( info, comp, x );
+  return (gsize)width * GST_VIDEO_INFO_COMP_PSTRIDE(info, comp);
+}
+
+/* Bounding box of what gets compared: the regions, or the top
+ * compare_lines lines of the frame */
+static StillReplaceRect compareArea( const GstVideoInfo* info, guint compareLines, GArray* regions )
+{
+  if (regions->len > 0)
+    return boundingRect( (StillReplaceRect*)regions->data, regions->len );
+  StillReplaceRect top = { 0, 0, info->width, compareLines };
+  if ((top.height == 0)||(top.height > (guint)info->height))
+    top.height = info->height;
+  return top;
+}
+
+/* Copy the pixels of @buf inside @area into a new packed reference. The
+ * matched components of the supported formats all live in plane 0.
+ *
+ * Whole pixels are kept, including the components that aren't compared
+ * (the chroma of YUY2, UYVY and v210, the pad byte of RGBx). The match
+ * kernels run over a reference row and a frame row of the same layout;
+ * keeping only the matched lanes would mean gathering them out of every
+ * input row before comparing, which costs more than it saves. */
+static GstStillReplaceRef* packReference( const GstVideoInfo* info, GstBuffer* buf, const StillReplaceRect* area )
+{
+  GstVideoFrame frame;
+  GstStillReplaceRef* ref = NULL;
+  if (!gst_video_frame_map (&frame, info, buf, GST_MAP_READ))
+    return NULL;
+
+  MatchLayout layout;
+  StillReplaceRect r;
+  if (planeLayout( &frame, 0, &layout )&&matchRect( info, layout.comp, area, &r ))
+  {
+    ref = g_new0( GstStillReplaceRef, 1 );
+    ref->refcount = 1;
+    ref->format = GST_VIDEO_INFO_FORMAT(info);
+    ref->width = info->width;
+    ref->height = info->height;
+    ref->comp = layout.comp;
+    ref->pstride = layout.pstride;
+    ref->lane_mask = layout.lane_mask;
+    ref->sample = layout.sample;
+    ref->depth = layout.depth;
+    ref->area = r;
+    ref->stride = (gsize)r.width * layout.pstride;
+    guint8* data = g_malloc( ref->stride * r.height );
+    for ( guint y = 0; y < r.height; ++y )
+    {
+      memcpy( data + y * ref->stride, (const guint8*)GST_VIDEO_FRAME_PLANE_DATA(&frame, 0) +
+          (r.y + y) * GST_VIDEO_FRAME_PLANE_STRIDE(&frame, 0) + (gsize)r.x * layout.pstride, ref->stride );
+    }
+    ref->data = data;
+    ref->storage = data;
+    ref->storage_free = g_free;
+  }
+  gst_video_frame_unmap( &frame );
+  return ref;
+}
+
+/* Whether @ref was taken from frames of the format and size in @info */
+static gboolean referenceFitsCaps( const GstStillReplaceRef* ref, const GstVideoInfo* info )
+{
+  return (info->finfo != NULL)&&(ref->format == GST_VIDEO_INFO_FORMAT(info))&&
+      (ref->width == info->width)&&(ref->height == info->height);
+}
+
+/* Whether @ref holds everything needed to compare @area of frames with
+ * layout @info */
+static gboolean referenceCovers( const GstStillReplaceRef* ref, const GstVideoInfo* info, const StillReplaceRect* area )
+{
+  StillReplaceRect r;
+  if (!referenceFitsCaps( ref, info ))
+    return FALSE;
+  if (!matchRect( info, ref->comp, area, &r ))
+    return TRUE;
+  return (r.x >= ref->area.x)&&(r.y >= ref->area.y)&&
+      ((guint64)r.x + r.width <= (guint64)ref->area.x + ref->area.width)&&
+      ((guint64)r.y + r.height <= (guint64)ref->area.y + ref->area.height);
+}
+
+static GstStillReplaceConfig* configRef( GstStillReplaceConfig* cfg )
+{
+  g_atomic_int_inc( &cfg->refcount );
+  return cfg;
+}
+
+static void configUnref( GstStillReplaceConfig* cfg )
+{
+  if (g_atomic_int_dec_and_test( &cfg->refcount ))
+  {
+    for ( guint i = 0; i < cfg->n_refs; ++i )
+      referenceUnref( cfg->refs[i] );
+    g_free( cfg->refs );
+    g_free( cfg->idents );
+    g_array_unref( cfg->regions );
+    g_array_unref( cfg->replace_regions );
+    if (cfg->replaceStill)
+      gst_buffer_unref( cfg->replaceStill );
+    stillreplace_slice_pool_unref( cfg->slicePool );
+    g_free( cfg );
+  }
+}
+
+/* Build a snapshot of the current settings and references and make it the
+ * one the feeds pick up for their next frame. Called with the object lock
+ * held after every change that affects matching, so only one thread
+ * publishes at a time. */
+static void publishConfig( GstStillReplaceFilter* filter )
+{
+  GstStillReplaceConfig* cfg = g_new0( GstStillReplaceConfig, 1 );
+  GstStillReplaceIdent* ident0 = g_ptr_array_index( filter->idents, 0 );
+  cfg->refcount = 1;
+  cfg->info = filter->sink_info;
+  cfg->silent = filter->silent;
+  cfg->compare_lines = filter->compare_lines;
+  cfg->regions = g_array_ref( filter->regions );
+  cfg->replace_regions = g_array_ref( filter->replace_regions );
+  cfg->replace_mode = filter->replace_mode;
+  cfg->psnr = filter->psnr;
+  cfg->sse_budget = filter->sse_budget;
+  cfg->n_threads = filter->n_threads;
+  /* one slice pool serves all feeds, a new one only comes with a new
+   * n-threads, and the old one goes once no snapshot uses it anymore */
+  guint n_threads = filter->n_threads ? filter->n_threads : g_get_num_processors();
+  if (stillreplace_slice_pool_get_n_threads( filter->slicePool ) != n_threads)
+  {
+    stillreplace_slice_pool_unref( filter->slicePool );
+    filter->slicePool = (n_threads > 1) ? stillreplace_slice_pool_new( n_threads ) : NULL;
+  }
+  cfg->slicePool = stillreplace_slice_pool_ref( filter->slicePool );
+  cfg->post_messages = filter->post_messages;
+  cfg->hold_frames = filter->hold_frames;
+  cfg->hold_duration = filter->hold_duration;
+  cfg->hold_check_lines = filter->hold_check_lines;
+  cfg->signature_lines = filter->signature_lines;
+  cfg->coarse_row_step = filter->coarse_row_step;
+  cfg->coarse_column_step = filter->coarse_column_step;
+  cfg->pipeline_depth = filter->pipeline_depth;
+
+  /* references only hold the area compared when they were taken */
+  cfg->area = compareArea( &filter->sink_info, filter->compare_lines, filter->regions );
+  cfg->idents = g_new( GstStillReplaceIdent*, filter->idents->len );
+  cfg->refs = g_new( GstStillReplaceRef*, filter->idents->len );
+  for ( guint i = 0; i < filter->idents->len; ++i )
+  {
+    GstStillReplaceIdent* ident = g_ptr_array_index( filter->idents, i );
+    if (ident->refImage && referenceCovers( ident->refImage, &filter->sink_info, &cfg->area ))
+    {
+      cfg->idents[cfg->n_refs] = ident;
+      cfg->refs[cfg->n_refs++] = referenceRef( ident->refImage );
+    }
+    else if (ident->refImage && (filter->silent == FALSE))
+    {
+      GST_INFO("reference of ident %u doesn't cover the compared area\n", ident->index);
+    }
+  }
+  /* a reference of ident 0 that doesn't cover the area is kept, it may have
+   * been loaded or set on purpose, and whatever is on air now may not show
+   * the ident; it only gets replaced when it can't be used at all */
+  gboolean usable = ident0->refImage && referenceFitsCaps( ident0->refImage, &filter->sink_info );
+  gboolean uncovered = usable && ((cfg->n_refs == 0)||(cfg->idents[0] != ident0));
+  cfg->capture = !usable;
+  if (uncovered && !filter->referenceUncovered)
+    g_atomic_int_set( &filter->uncoveredWarning, 1 );
+  filter->referenceUncovered = uncovered;
+  if (ident0->replaceStill)
+    cfg->replaceStill = gst_buffer_ref( ident0->replaceStill );
+
+  GstStillReplaceConfig* old = filter->config;
+  filter->config = cfg;
+  g_atomic_int_inc( &filter->configSerial );
+  if (old)
+    configUnref( old );
+}
+
+/* Snapshot to handle the next frame of @feed with: the newest published
+ * one, or the one used for the previous frame when nothing changed, in
+ * which case no lock is taken. Only called from the feed's streaming
+ * thread, which owns feed->config. */
+static GstStillReplaceConfig* currentConfig( GstStillReplaceFeed* feed )
+{
+  GstStillReplaceFilter* filter = feed->filter;
+  if (feed->config && (g_atomic_int_get( &filter->configSerial ) == feed->configSerial))
+    return feed->config;
+
+  GstStillReplaceConfig* old = feed->config;
+  GST_OBJECT_LOCK(filter);
+  feed->config = configRef( filter->config );
+  feed->configSerial = g_atomic_int_get( &filter->configSerial );
+  GST_OBJECT_UNLOCK(filter);
+  if (old)
+    configUnref( old );
+  return feed->config;
+}
+
+/* Pad the streaming thread of @feed pushes to, NULL without one. The ref
+ * is kept in the feed and only taken again under the object lock after the
+ * src pad changed, as currentConfig() does for the config. */
+static GstPad* feedSrcPad( GstStillReplaceFeed* feed )
+{
+  if (g_atomic_int_get( &feed->srcpadSerial ) == feed->pushPadSerial)
+    return feed->pushPad;
+
+  GstPad* old = feed->pushPad;
+  GST_OBJECT_LOCK(feed->filter);
+  feed->pushPad = feed->srcpad ? gst_object_ref( feed->srcpad ) : NULL;
+  feed->pushPadSerial = g_atomic_int_get( &feed->srcpadSerial );
+  GST_OBJECT_UNLOCK(feed->filter);
+  if (old)
+    gst_object_unref( old );
+  return feed->pushPad;
+}
+
+/* Measurements of one frame, posted as element message when post-messages
+ * is set and added to the stats counters */
+typedef struct
+{
+  gboolean compared;
+  gboolean held; // Only spot checked inside a hold window
+  gboolean reused; // Repeat of the previous frame, its decision was reused
+  gboolean coarse; // Rejected by the coarse compare, psnr is then of the sparse grid only
+  gboolean complete; // FALSE when the compare stopped early, psnr is then an upper bound
+  gdouble psnr[GST_VIDEO_MAX_COMPONENTS]; // Per component, < 0 when not compared
+  gint ident; // Index of the matched ident, -1 for none
+  GstClockTime compareTime, replaceTime, waitTime;
+} FrameStats;
+
+/* Compare the pixels inside @rects with @ref on a grid of every @rowStep-th
+ * row and @columnStep-th pixel, see stillreplace_ref_compare_grid().
+ * Returns TRUE when any component is closer to the reference than the
+ * configured psnr. The psnr of every compared component is stored in
+ * @stats. @ref must cover @rects. */
+static gboolean compareFrame( const GstStillReplaceConfig* cfg, const GstStillReplaceRef* ref, GstVideoFrame* frame,
+    const StillReplaceRect* rects, guint n_rects, guint rowStep, guint columnStep, FrameStats* stats )
+{
+  MatchLayout layout;
+  if (!planeLayout( frame, 0, &layout )||((guint)layout.pstride != ref->pstride)||(layout.sample != ref->sample))
+    return FALSE;
+
+  StillReplaceRect* planeRects = g_newa( StillReplaceRect, n_rects );
+  guint n_planeRects = 0;
+  for ( guint i = 0; i < n_rects; ++i )
+  {
+    if (matchRect( &frame->info, layout.comp, &rects[i], &planeRects[n_planeRects] ))
+      n_planeRects++;
+  }
+
+  StillReplaceRefData data = { ref->data, ref->stride, ref->pstride, ref->sample, ref->depth, layout.lane_mask, ref->area };
+  StillReplaceCompareResult result;
+  gboolean matched = stillreplace_ref_compare_grid( cfg->slicePool, &data, GST_VIDEO_FRAME_PLANE_DATA(frame, 0),
+      GST_VIDEO_FRAME_PLANE_STRIDE(frame, 0), planeRects, n_planeRects, rowStep, columnStep, cfg->sse_budget, &result );
+  if (result.samples == 0)
+    return FALSE;
+
+  /* sums stopped early only give a lower bound of the error */
+  stats->complete &= result.complete;
+  for ( guint comp = 0; comp < GST_VIDEO_FRAME_N_COMPONENTS(frame); ++comp )
+  {
+    if ((matchComponents( frame ) & (1 << comp))&&(GST_VIDEO_FRAME_COMP_PLANE(frame, comp) == 0))
+      stats->psnr[comp] = stillreplace_ref_psnr( result.sums[componentLane( frame->info.finfo, comp, &layout )], result.samples, ref->depth );
+  }
+  if (!result.complete)
+  {
+    if (cfg->silent == FALSE )
+      GST_INFO("over error budget, skipped rest of compare\n");
+    return FALSE;
+  }
+  if (cfg->silent == FALSE )
+  {
+    for ( guint lane = 0; lane < stillreplace_match_n_lanes( layout.sample, layout.pstride ); ++lane)
+    {
+      if (layout.lane_mask & (1 << lane))
+        GST_INFO("psnr: %f  \n", stillreplace_ref_psnr( result.sums[lane], result.samples, ref->depth ));
+    }
+  }
+  return matched;
+}
+
+
+/* Fingerprint @area of the first plane of @frame */
+static gboolean fingerprintFrame( const GstVideoFrame* frame, const StillReplaceRect* area, guint8* fingerprint )
+{
+  MatchLayout layout;
+  StillReplaceRect r;
+  if (!planeLayout( frame, 0, &layout )||(!matchRect( &frame->info, layout.comp, area, &r )))
+    return FALSE;
+  stillreplace_match_fingerprint( GST_VIDEO_FRAME_PLANE_DATA(frame, 0), GST_VIDEO_FRAME_PLANE_STRIDE(frame, 0),
+      layout.pstride, layout.sample, layout.depth, layout.lane_mask, &r, fingerprint );
+  return TRUE;
+}
+
+/* Fingerprint @area of @ref, which must cover it */
+static gboolean fingerprintReference( const GstStillReplaceRef* ref, const GstVideoInfo* info, const StillReplaceRect* area, guint8* fingerprint )
+{
+  StillReplaceRect r;
+  if (!matchRect( info, ref->comp, area, &r ))
+    return FALSE;
+  r.x -= ref->area.x;
+  r.y -= ref->area.y;
+  stillreplace_match_fingerprint( ref->data, ref->stride, ref->pstride, ref->sample, ref->depth, ref->lane_mask, &r, fingerprint );
+  return TRUE;
+}
+
+/* Pick the reference whose fingerprint is closest to the one of @frame, so
+ * only that one needs a full compare. Reference fingerprints are cached
+ * until the reference or the compared area changes, the cache is shared by
+ * all feeds. */
+static guint pickCandidate( GstStillReplaceFilter* filter, const GstStillReplaceConfig* cfg, const GstVideoFrame* frame, const StillReplaceRect* area )
+{
+  guint8 fingerprint[STILLREPLACE_FINGERPRINT_SIZE];
+  guint best = 0;
+  guint bestDistance = G_MAXUINT;
+
+  if (!fingerprintFrame( frame, area, fingerprint ))
+    return 0;
+
+  for ( guint i = 0; i < cfg->n_refs; ++i )
+  {
+    GstStillReplaceIdent* ident = cfg->idents[i];
+    gboolean valid = TRUE;
+    guint distance = G_MAXUINT;
+    g_mutex_lock( &filter->fingerprintMutex );
+    if ((ident->fingerprintRef != cfg->refs[i])||(memcmp( &ident->fingerprintArea, area, sizeof(*area) ) != 0))
+    {
+      valid = fingerprintReference( cfg->refs[i], &frame->info, area, ident->fingerprint );
+      referenceReplace( &ident->fingerprintRef, valid ? cfg->refs[i] : NULL );
+      ident->fingerprintArea = *area;
+    }
+    if (valid)
+      distance = stillreplace_match_fingerprint_distance( fingerprint, ident->fingerprint );
+    g_mutex_unlock( &filter->fingerprintMutex );
+    if (!valid)
+      continue;
+    if (cfg->silent == FALSE)
+      GST_INFO("ident %u fingerprint distance %u\n", ident->index, distance);
+    if (distance < bestDistance)
+    {
+      bestDistance = distance;
+      best = i;
+    }
+  }
+  return best;
+}
+
+/* TRUE when @replaceBuffer has exactly the memory layout @dest negotiated
+ * on the main sink, so it can be pushed as is instead of being copied. When
+ * downstream understands GstVideoMeta (@anyLayout) the format and size are
+ * enough as long as the buffer describes its layout with one. */
+static gboolean replacementFitsFrame( const GstVideoInfo* dest, const GstVideoInfo* src, GstBuffer* replaceBuffer, gboolean anyLayout )
+{
+  if ((src->finfo == NULL)||(dest->finfo == NULL))
+    return FALSE;
+  if ((GST_VIDEO_INFO_FORMAT(src) != GST_VIDEO_INFO_FORMAT(dest))||
+      (src->width != dest->width)||(src->height != dest->height))
+    return FALSE;
+
+  GstVideoMeta* meta = gst_buffer_get_video_meta( replaceBuffer );
+  if (meta && anyLayout)
+    return TRUE;
+  for ( guint plane = 0; plane < GST_VIDEO_INFO_N_PLANES(dest); ++plane )
+  {
+    gint stride = meta ? meta->stride[plane] : GST_VIDEO_INFO_PLANE_STRIDE(src, plane);
+    gsize offset = meta ? meta->offset[plane] : GST_VIDEO_INFO_PLANE_OFFSET(src, plane);
+    if ((stride != GST_VIDEO_INFO_PLANE_STRIDE(dest, plane))||(offset != GST_VIDEO_INFO_PLANE_OFFSET(dest, plane)))
+      return FALSE;
+  }
+  return TRUE;
+}
+
+/* Negotiate the pool replaced frames are written into, the way video
+ * decoders do: downstream's pool when it offers one, a video pool with its
+ * allocator otherwise, with GstVideoMeta when downstream understands it.
+ * Also finds out whether downstream draws overlay composition meta. */
+static void decideAllocation( GstStillReplaceFeed* feed, const GstStillReplaceConfig* cfg )
+{
+  GstStillReplaceFilter* filter = feed->filter;
+  dropOutputPool( feed );
+  GST_OBJECT_LOCK(filter);
+  GstPad* srcpad = feed->srcpad ? gst_object_ref( feed->srcpad ) : NULL;
+  GST_OBJECT_UNLOCK(filter);
+  GstCaps* caps = srcpad ? gst_pad_get_current_caps( srcpad ) : NULL;
+  if (caps == NULL)
+  {
+    if (srcpad)
+      gst_object_unref( srcpad );
+    return;
+  }
+
+  GstQuery* query = gst_query_new_allocation( caps, TRUE );
+  if (!gst_pad_peer_query( srcpad, query ))
+    GST_DEBUG_OBJECT( filter, "Downstream didn't answer the allocation query" );
+
+  GstBufferPool* pool = NULL;
+  guint size = 0, min = 0, max = 0;
+  if (gst_query_get_n_allocation_pools( query ) > 0)
+    gst_query_parse_nth_allocation_pool( query, 0, &pool, &size, &min, &max );
+  size = MAX( size, (guint)GST_VIDEO_INFO_SIZE(&cfg->info) );
+
+  GstAllocator* allocator = NULL;
+  GstAllocationParams params;
+  gst_allocation_params_init( &params );
+  if (gst_query_get_n_allocation_params( query ) > 0)
+    gst_query_parse_nth_allocation_param( query, 0, &allocator, &params );
+  gboolean videoMeta = gst_query_find_allocation_meta( query, GST_VIDEO_META_API_TYPE, NULL );
+  gboolean overlayMeta = gst_query_find_allocation_meta( query, GST_VIDEO_OVERLAY_COMPOSITION_META_API_TYPE, NULL );
+  GST_OBJECT_LOCK(filter);
+  feed->downstreamOverlay = overlayMeta;
+  GST_OBJECT_UNLOCK(filter);
+
+  /* downstream's pool may not take our configuration, our own one will */
+  for ( guint attempt = 0; attempt < 2; ++attempt )
+  {
+    if (pool == NULL)
+      pool = gst_video_buffer_pool_new();
+    GstStructure* config = gst_buffer_pool_get_config( pool );
+    gst_buffer_pool_config_set_params( config, caps, size, min, max );
+    gst_buffer_pool_config_set_allocator( config, allocator, &params );
+    if (videoMeta && gst_buffer_pool_has_option( pool, GST_BUFFER_POOL_OPTION_VIDEO_META ))
+      gst_buffer_pool_config_add_option( config, GST_BUFFER_POOL_OPTION_VIDEO_META );
+    if (gst_buffer_pool_set_config( pool, config )&&gst_buffer_pool_set_active( pool, TRUE ))
+      break;
+    GST_DEBUG_OBJECT( filter, "Could not configure %" GST_PTR_FORMAT, pool );
+    g_clear_pointer( &pool, gst_object_unref );
+  }
+  if (pool)
+  {
+    GST_DEBUG_OBJECT( filter, "Writing replaced frames into %" GST_PTR_FORMAT ", %u bytes, video meta %d", pool, size, videoMeta );
+    GST_OBJECT_LOCK(filter);
+    feed->outputPool = pool;
+    feed->downstreamVideoMeta = videoMeta;
+    GST_OBJECT_UNLOCK(filter);
+  }
+  if (allocator)
+    gst_object_unref( allocator );
+  gst_query_unref( query );
+  gst_caps_unref( caps );
+  gst_object_unref( srcpad );
+}
+
+/* Negotiate the output pool again after a caps change or when downstream
+ * asked for it with a reconfigure event */
+static void updateOutputPool( GstStillReplaceFeed* feed, const GstStillReplaceConfig* cfg )
+{
+  GstPad* srcpad = feedSrcPad( feed );
+  if (srcpad == NULL)
+    return;
+  if (gst_pad_check_reconfigure( srcpad )||(feed->outputPool == NULL))
+    decideAllocation( feed, cfg );
+}
+
+/* Metas of the input frame follow it onto the output buffer, except those
+ * describing its memory */
+static gboolean copyMeta( GstBuffer* buf, GstMeta** meta, gpointer user_data )
+{
+  GstBuffer* out = user_data;
+  const GstMetaInfo* info = (*meta)->info;
+  if ((info->transform_func == NULL)||
+      gst_meta_api_type_has_tag( info->api, g_quark_from_static_string( GST_META_TAG_MEMORY_STR ) ))
+    return TRUE;
+  GstMetaTransformCopy copy = { FALSE, 0, (gsize)-1 };
+  info->transform_func( out, *meta, buf, _gst_meta_transform_copy, &copy );
+  return TRUE;
+}
+
+/* Copy the GstVideoMeta of @src onto @out, which got the memory of @src */
+static void copyVideoMeta( GstBuffer* src, GstBuffer* out )
+{
+  gpointer state = NULL;
+  GstMeta* meta;
+  while ((meta = gst_buffer_iterate_meta( src, &state )) != NULL)
+  {
+    if (meta->info->api != GST_VIDEO_META_API_TYPE)
+      continue;
+    GstMetaTransformCopy copy = { FALSE, 0, (gsize)-1 };
+    meta->info->transform_func( out, meta, src, _gst_meta_transform_copy, &copy );
+  }
+}
+
+/* Writable buffer for the replacement of @buf, taking ownership of @buf.
+ * That is @buf itself when it and its memory are writable, a buffer from
+ * the output pool with the timestamps, flags and metas of @buf otherwise.
+ * With @keepPixels the picture of @buf is copied into it, as only part of
+ * it gets replaced. Only falls back to copying @buf into fresh memory when
+ * there is no pool. */
+static GstBuffer* outputBuffer( GstStillReplaceFeed* feed, const GstStillReplaceConfig* cfg, GstBuffer* buf, gboolean keepPixels )
+{
+  if (gst_buffer_is_writable( buf )&&gst_buffer_is_all_memory_writable( buf ))
+    return buf;
+
+  GstBuffer* out = NULL;
+  if ((feed->outputPool == NULL)||(gst_buffer_pool_acquire_buffer( feed->outputPool, &out, NULL ) != GST_FLOW_OK))
+    return gst_buffer_make_writable( buf );
+  if (keepPixels)
+  {
+    GstVideoFrame srcFrame, destFrame;
+    gboolean copied = FALSE;
+    if (gst_video_frame_map( &srcFrame, &cfg->info, buf, GST_MAP_READ ))
+    {
+      if (gst_video_frame_map( &destFrame, &cfg->info, out, GST_MAP_WRITE ))
       {
-        GstVideoFrame destFrame;
-        if (gst_video_frame_map (&destFrame, &filter->sink_info, buf, GST_MAP_WRITE))
-        {
-          int planes = GST_VIDEO_FRAME_N_PLANES(&destFrame);
-          for ( int plane=0; plane<planes; ++plane)
-          {
-            guint8 *pData = GST_VIDEO_FRAME_PLANE_DATA(&destFrame, plane);
-            int height = GST_VIDEO_FRAME_COMP_HEIGHT(&destFrame,0);
-            if (height > GST_VIDEO_FRAME_COMP_HEIGHT(&srcFrame,0))
-              height = GST_VIDEO_FRAME_COMP_HEIGHT(&srcFrame,0);
-            int stride = GST_VIDEO_FRAME_PLANE_STRIDE(&destFrame, plane);
-            if (stride > GST_VIDEO_FRAME_PLANE_STRIDE(&srcFrame, plane))
-              stride = GST_VIDEO_FRAME_PLANE_STRIDE(&srcFrame, plane);
-            guint8 *pSrcData = GST_VIDEO_FRAME_PLANE_DATA(&srcFrame, plane);
-            //memcpy (pData, pSrcData, GST_VIDEO_FRAME_COMP_HEIGHT(&destFrame, 0) * GST_VIDEO_FRAME_PLANE_STRIDE(&destFrame, plane) );
-            for ( int line = 0; line < height; ++line )
-            {
-              memcpy( pData, pSrcData, stride );
-              pData += GST_VIDEO_FRAME_PLANE_STRIDE(&destFrame, plane);
-              pSrcData += GST_VIDEO_FRAME_PLANE_STRIDE(&srcFrame, plane);
-            }
-          }
-          gst_video_frame_unmap( &destFrame );
-        }
-        else
-        {
-          GST_ERROR_OBJECT(filter, "mapping destFrame failed\n");
-        }
-        gst_video_frame_unmap( &srcFrame );
+        copied = gst_video_frame_copy( &destFrame, &srcFrame );
+        gst_video_frame_unmap( &destFrame );
       }
-      else
+      gst_video_frame_unmap( &srcFrame );
+    }
+    if (!copied)
+    {
+      gst_buffer_unref( out );
+      return gst_buffer_make_writable( buf );
+    }
+  }
+  gst_buffer_copy_into( out, buf, GST_BUFFER_COPY_FLAGS | GST_BUFFER_COPY_TIMESTAMPS, 0, -1 );
+  gst_buffer_foreach_meta( buf, copyMeta, out );
+  gst_buffer_unref( buf );
+  return out;
+}
+
+/* Rows of every plane of the replace copy are split over the slices */
+typedef struct
+{
+  const GstVideoFrame *srcFrame, *destFrame;
+} CopySlices;
+
+static void copySlice( gpointer data, guint slice, guint n_slices )
+{
+  CopySlices* job = data;
+  const GstVideoFrame* srcFrame = job->srcFrame;
+  const GstVideoFrame* destFrame = job->destFrame;
+  int planes = GST_VIDEO_FRAME_N_PLANES(destFrame);
+  if (planes > GST_VIDEO_FRAME_N_PLANES(srcFrame))
+    planes = GST_VIDEO_FRAME_N_PLANES(srcFrame);
+  for ( int plane=0; plane<planes; ++plane)
+  {
+    guint comp = planeComponent( destFrame, plane );
+    /* subsampled planes are smaller than the frame */
+    int height = GST_VIDEO_FRAME_COMP_HEIGHT(destFrame, comp);
+    if (height > GST_VIDEO_FRAME_COMP_HEIGHT(srcFrame, comp))
+      height = GST_VIDEO_FRAME_COMP_HEIGHT(srcFrame, comp);
+    gsize rowbytes = MIN( rowBytes( &destFrame->info, comp, 0, GST_VIDEO_FRAME_COMP_WIDTH(destFrame, comp) ),
+        rowBytes( &srcFrame->info, comp, 0, GST_VIDEO_FRAME_COMP_WIDTH(srcFrame, comp) ) );
+    int first = (guint64)height * slice / n_slices;
+    int last = (guint64)height * (slice + 1) / n_slices;
+    guint8 *pData = (guint8*)GST_VIDEO_FRAME_PLANE_DATA(destFrame, plane) + first * GST_VIDEO_FRAME_PLANE_STRIDE(destFrame, plane);
+    const guint8 *pSrcData = (const guint8*)GST_VIDEO_FRAME_PLANE_DATA(srcFrame, plane) + first * GST_VIDEO_FRAME_PLANE_STRIDE(srcFrame, plane);
+    for ( int line = first; line < last; ++line )
+    {
+      memcpy( pData, pSrcData, rowbytes );
+      pData += GST_VIDEO_FRAME_PLANE_STRIDE(destFrame, plane);
+      pSrcData += GST_VIDEO_FRAME_PLANE_STRIDE(srcFrame, plane);
+    }
+  }
+}
+
+/* Only the replace regions are copied, the rows of every region of every
+ * plane are split over the slices. Regions are already clipped to both
+ * frames. */
+typedef struct
+{
+  const GstVideoFrame *srcFrame, *destFrame;
+  const GstStillReplaceRegion* regions;
+  guint n_regions;
+} CopyRegions;
+
+static void copyRegionSlice( gpointer data, guint slice, guint n_slices )
+{
+  CopyRegions* job = data;
+  const GstVideoFrame* srcFrame = job->srcFrame;
+  const GstVideoFrame* destFrame = job->destFrame;
+  int planes = MIN( GST_VIDEO_FRAME_N_PLANES(destFrame), GST_VIDEO_FRAME_N_PLANES(srcFrame) );
+  for ( int plane=0; plane<planes; ++plane)
+  {
+    guint comp = planeComponent( destFrame, plane );
+    for ( guint i = 0; i < job->n_regions; ++i )
+    {
+      const GstStillReplaceRegion* region = &job->regions[i];
+      StillReplaceRect src = { region->src_x, region->src_y, region->dest.width, region->dest.height };
+      StillReplaceRect d, s;
+      /* subsampled planes get the scaled rectangles */
+      if (!planeRect( &destFrame->info, comp, &region->dest, &d )||!planeRect( &srcFrame->info, comp, &src, &s ))
+        continue;
+      /* v210 regions are copied in whole groups of 6 pixels */
+      guint height = MIN( d.height, s.height );
+      gsize rowbytes = MIN( rowBytes( &destFrame->info, comp, d.x, d.width ), rowBytes( &srcFrame->info, comp, s.x, s.width ) );
+      guint first = (guint64)height * slice / n_slices;
+      guint last = (guint64)height * (slice + 1) / n_slices;
+      guint8 *pData = (guint8*)GST_VIDEO_FRAME_PLANE_DATA(destFrame, plane) +
+          (d.y + first) * GST_VIDEO_FRAME_PLANE_STRIDE(destFrame, plane) + rowOffset( &destFrame->info, comp, d.x );
+      const guint8 *pSrcData = (const guint8*)GST_VIDEO_FRAME_PLANE_DATA(srcFrame, plane) +
+          (s.y + first) * GST_VIDEO_FRAME_PLANE_STRIDE(srcFrame, plane) + rowOffset( &srcFrame->info, comp, s.x );
+      for ( guint line = first; line < last; ++line )
+      {
+        memcpy( pData, pSrcData, rowbytes );
+        pData += GST_VIDEO_FRAME_PLANE_STRIDE(destFrame, plane);
+        pSrcData += GST_VIDEO_FRAME_PLANE_STRIDE(srcFrame, plane);
+      }
+    }
+  }
+}
+
+/* Pixels a row of @info can only be written in whole of: the chroma
+ * subsampling, which covers the macropixels of YUY2 and UYVY, and the
+ * 6-pixel groups of v210 */
+static guint horizontalAlignment( const GstVideoInfo* info )
+{
+  if (GST_VIDEO_INFO_FORMAT(info) == GST_VIDEO_FORMAT_v210)
+    return STILLREPLACE_V210_GROUP_PIXELS;
+  guint align = 1;
+  for ( guint comp = 0; comp < GST_VIDEO_INFO_N_COMPONENTS(info); ++comp )
+    align = MAX( align, 1u << GST_VIDEO_FORMAT_INFO_W_SUB(info->finfo, comp) );
+  return align;
+}
+
+/* Clip @regions to both the output frame @dest and the replacement frame
+ * @src, after widening their left and right edges to the horizontal
+ * alignment of the formats; a region edge inside a macropixel or v210
+ * group would otherwise mix the chroma of both frames or write past the
+ * region. Returns the amount left in @out, which has room for all of
+ * them. */
+static guint clipReplaceRegions( GArray* regions, const GstVideoInfo* dest, const GstVideoInfo* src, GstStillReplaceRegion* out )
+{
+  guint align = MAX( horizontalAlignment( dest ), horizontalAlignment( src ) );
+  guint n = 0;
+  for ( guint i = 0; i < regions->len; ++i )
+  {
+    const GstStillReplaceRegion* region = &g_array_index( regions, GstStillReplaceRegion, i );
+    guint x = region->dest.x - region->dest.x % align;
+    guint srcX = region->src_x - region->src_x % align;
+    guint64 x1 = ((guint64)region->dest.x + region->dest.width + align - 1) / align * align;
+    if ((x >= (guint)dest->width)||(region->dest.y >= (guint)dest->height)||
+        (srcX >= (guint)src->width)||(region->src_y >= (guint)src->height))
+      continue;
+    out[n] = *region;
+    out[n].dest.x = x;
+    out[n].src_x = srcX;
+    out[n].dest.width = MIN( x1 - x, MIN( dest->width - x, src->width - srcX ) );
+    out[n].dest.height = MIN( region->dest.height, MIN( dest->height - region->dest.y, src->height - region->src_y ) );
+    ++n;
+  }
+  return n;
+}
+
+/* Converter from @srcRect of frames of @srcInfo to @info for overlay
+ * region @index. Built once and reused for every replacement buffer, so a
+ * live replacesink stream doesn't set up a converter and its threads per
+ * frame. Runs on as many threads as the slice pool. */
+static GstVideoConverter* overlayConverter( GstStillReplaceFeed* feed, const GstStillReplaceConfig* cfg, guint index,
+    const GstVideoInfo* srcInfo, const StillReplaceRect* srcRect, const GstVideoInfo* info )
+{
+  guint n_threads = stillreplace_slice_pool_get_n_threads( cfg->slicePool );
+  if (feed->overlay.converters->len <= index)
+    g_ptr_array_set_size( feed->overlay.converters, index + 1 );
+  OverlayConverter* c = g_ptr_array_index( feed->overlay.converters, index );
+  if (c && (c->n_threads == n_threads)&&gst_video_info_is_equal( &c->info, srcInfo )&&
+      (memcmp( &c->src, srcRect, sizeof(*srcRect) ) == 0))
+    return c->converter;
+
+  freeOverlayConverter( c );
+  g_ptr_array_index( feed->overlay.converters, index ) = NULL;
+  GstVideoConverter* converter = gst_video_converter_new( (GstVideoInfo*)srcInfo, (GstVideoInfo*)info,
+      gst_structure_new( "GstVideoConverter",
+          GST_VIDEO_CONVERTER_OPT_SRC_X, G_TYPE_INT, (gint)srcRect->x,
+          GST_VIDEO_CONVERTER_OPT_SRC_Y, G_TYPE_INT, (gint)srcRect->y,
+          GST_VIDEO_CONVERTER_OPT_SRC_WIDTH, G_TYPE_INT, (gint)srcRect->width,
+          GST_VIDEO_CONVERTER_OPT_SRC_HEIGHT, G_TYPE_INT, (gint)srcRect->height,
+          GST_VIDEO_CONVERTER_OPT_THREADS, G_TYPE_UINT, n_threads,
+          NULL ) );
+  if (converter == NULL)
+    return NULL;
+  c = g_new0( OverlayConverter, 1 );
+  c->info = *srcInfo;
+  c->src = *srcRect;
+  c->n_threads = n_threads;
+  c->converter = converter;
+  g_ptr_array_index( feed->overlay.converters, index ) = c;
+  return converter;
+}
+
+/* Overlay rectangle showing @srcRect of @srcFrame at @dest, for overlay
+ * region @index. The pixels are converted to the overlay format, scaled
+ * when @dest has another size. */
+static GstVideoOverlayRectangle* overlayRectangle( GstStillReplaceFeed* feed, const GstStillReplaceConfig* cfg, guint index,
+    const GstVideoFrame* srcFrame, const StillReplaceRect* srcRect, const StillReplaceRect* dest )
+{
+  GstVideoInfo info;
+  GstVideoFrame frame;
+  gst_video_info_set_format( &info, GST_VIDEO_OVERLAY_COMPOSITION_FORMAT_RGB, srcRect->width, srcRect->height );
+  GstVideoConverter* converter = overlayConverter( feed, cfg, index, &srcFrame->info, srcRect, &info );
+  if (converter == NULL)
+    return NULL;
+  GstBuffer* pixels = gst_buffer_new_allocate( NULL, GST_VIDEO_INFO_SIZE(&info), NULL );
+  gst_buffer_add_video_meta( pixels, GST_VIDEO_FRAME_FLAG_NONE, GST_VIDEO_INFO_FORMAT(&info), info.width, info.height );
+  if (!gst_video_frame_map (&frame, &info, pixels, GST_MAP_WRITE))
+  {
+    gst_buffer_unref( pixels );
+    return NULL;
+  }
+  gst_video_converter_frame( converter, srcFrame, &frame );
+  gst_video_frame_unmap( &frame );
+  GstVideoOverlayRectangle* rect = gst_video_overlay_rectangle_new_raw( pixels, dest->x, dest->y,
+      dest->width, dest->height, GST_VIDEO_OVERLAY_FORMAT_FLAG_NONE );
+  gst_buffer_unref( pixels );
+  return rect;
+}
+
+/* Overlay composition putting @replaceBuffer over frames of cfg->info: the
+ * whole replacement scaled to the frame, or the replace regions. Reuses
+ * the last one built while the replacement buffer and regions are the
+ * same, which is the case for a replace-location still. */
+static GstVideoOverlayComposition* overlayComposition( GstStillReplaceFeed* feed, const GstStillReplaceConfig* cfg,
+    const GstVideoInfo* replaceInfo, GstBuffer* replaceBuffer )
+{
+  if ((feed->overlay.source == replaceBuffer)&&(feed->overlay.regions == cfg->replace_regions)&&
+      (feed->overlay.width == cfg->info.width)&&(feed->overlay.height == cfg->info.height))
+    return feed->overlay.composition;
+
+  forgetOverlay( feed );
+  GstVideoFrame srcFrame;
+  if (!gst_video_frame_map (&srcFrame, replaceInfo, replaceBuffer, GST_MAP_READ))
+  {
+    GST_ERROR_OBJECT(feed->filter, "mapping srcFrame failed\n");
+    return NULL;
+  }
+  GstVideoOverlayComposition* composition = NULL;
+  GstStillReplaceRegion* clipped = g_newa( GstStillReplaceRegion, MAX( cfg->replace_regions->len, 1 ) );
+  guint n_regions = 1;
+  if (cfg->replace_regions->len > 0)
+  {
+    n_regions = clipReplaceRegions( cfg->replace_regions, &cfg->info, replaceInfo, clipped );
+  }
+  else
+  {
+    StillReplaceRect frame = { 0, 0, cfg->info.width, cfg->info.height };
+    clipped[0].dest = frame;
+    clipped[0].src_x = clipped[0].src_y = 0;
+  }
+  for ( guint i = 0; i < n_regions; ++i )
+  {
+    StillReplaceRect src = { clipped[i].src_x, clipped[i].src_y, clipped[i].dest.width, clipped[i].dest.height };
+    if (cfg->replace_regions->len == 0)
+    {
+      src.width = replaceInfo->width;
+      src.height = replaceInfo->height;
+    }
+    GstVideoOverlayRectangle* rect = overlayRectangle( feed, cfg, i, &srcFrame, &src, &clipped[i].dest );
+    if (!rect)
+      continue;
+    if (composition)
+      gst_video_overlay_composition_add_rectangle( composition, rect );
+    else
+      composition = gst_video_overlay_composition_new( rect );
+    gst_video_overlay_rectangle_unref( rect );
+  }
+  gst_video_frame_unmap( &srcFrame );
+  /* regions that went away don't need their converter anymore */
+  if (feed->overlay.converters->len > n_regions)
+    g_ptr_array_set_size( feed->overlay.converters, n_regions );
+
+  feed->overlay.source = gst_buffer_ref( replaceBuffer );
+  feed->overlay.regions = g_array_ref( cfg->replace_regions );
+  feed->overlay.width = cfg->info.width;
+  feed->overlay.height = cfg->info.height;
+  feed->overlay.composition = composition;
+  return composition;
+}
+
+/* Attach @composition to @buf, under the overlays already on it since
+ * those were meant for the picture being replaced. Only the metadata of
+ * @buf is made writable, its memory is shared. */
+static GstBuffer* attachOverlay( GstBuffer* buf, GstVideoOverlayComposition* composition )
+{
+  buf = gst_buffer_make_writable( buf );
+  GstVideoOverlayCompositionMeta* meta = gst_buffer_get_video_overlay_composition_meta( buf );
+  if (meta)
+  {
+    GstVideoOverlayComposition* merged = gst_video_overlay_composition_copy( composition );
+    for ( guint i = 0; i < gst_video_overlay_composition_n_rectangles( meta->overlay ); ++i )
+      gst_video_overlay_composition_add_rectangle( merged, gst_video_overlay_composition_get_rectangle( meta->overlay, i ) );
+    gst_buffer_remove_video_overlay_composition_meta( buf, meta );
+    gst_buffer_add_video_overlay_composition_meta( buf, merged );
+    gst_video_overlay_composition_unref( merged );
+  }
+  else
+  {
+    gst_buffer_add_video_overlay_composition_meta( buf, composition );
+  }
+  return buf;
+}
+
+/* Replace the content of @buf with the next frame of @ident's replacement
+ * stream. Takes ownership of @buf and returns the buffer to push.
+ *
+ * When the replacement has the same layout as the input, or downstream
+ * takes any layout through GstVideoMeta, a new buffer sharing the
+ * replacement's memory and carrying the timestamps and flags of @buf is
+ * returned, so no pixels are copied. Otherwise the replacement is copied
+ * line by line, in slices over the slice pool for large frames, into @buf
+ * when it is writable or into a buffer of the pool negotiated with
+ * downstream, see outputBuffer().
+ *
+ * With replace-regions set only those rectangles are copied and the rest
+ * of the input is kept. @buf is then written in place when it is
+ * writable, so the bytes touched are those of the regions only.
+ * Likewise a replacement smaller than the frame only covers its top left
+ * corner and the input shows around it.
+ *
+ * In overlay mode the pixels of @buf are left alone and the replacement is
+ * attached as overlay composition meta instead, see overlayComposition().
+ * That needs downstream to draw the meta; without it the replacement is
+ * copied as in the other mode.
+ *
+ * A replace-location image takes precedence over the replacesink stream; it
+ * is already converted to the negotiated format so it always takes the
+ * first path. The time spent waiting for the replacesink is stored in
+ * @stats. */
+static GstBuffer* replaceFrame( GstStillReplaceFeed* feed, const GstStillReplaceConfig* cfg, GstStillReplaceIdent* ident, GstBuffer* buf, FrameStats* stats )
+{
+  GstBuffer* replaceBuffer = NULL;
+  const GstVideoInfo* replaceInfo = &cfg->info;
+  if ((ident->index == 0)&&(cfg->replaceStill))
+    replaceBuffer = gst_buffer_ref( cfg->replaceStill );
+  if (!replaceBuffer)
+  {
+    GstClockTime start = gst_util_get_timestamp();
+    replaceBuffer = getNextReplaceBuffer( feed, ident );
+    stats->waitTime = gst_util_get_timestamp() - start;
+    replaceInfo = &ident->replacesink_info;
+  }
+  if (!replaceBuffer)
+    return buf;
+
+  updateOutputPool( feed, cfg );
+  if ((cfg->replace_mode == GST_STILL_REPLACE_MODE_OVERLAY)&&feed->downstreamOverlay)
+  {
+    GstVideoOverlayComposition* composition = overlayComposition( feed, cfg, replaceInfo, replaceBuffer );
+    if (composition)
+      buf = attachOverlay( buf, composition );
+    gst_buffer_unref( replaceBuffer );
+    return buf;
+  }
+
+  gboolean regions = cfg->replace_regions->len > 0;
+  if (!regions && replacementFitsFrame( &cfg->info, replaceInfo, replaceBuffer, feed->downstreamVideoMeta ))
+  {
+    /* the memory comes with the GstVideoMeta describing it, everything else
+     * about the frame stays that of the input */
+    GstBuffer* out = gst_buffer_new();
+    gst_buffer_copy_into( out, replaceBuffer, GST_BUFFER_COPY_MEMORY, 0, -1 );
+    copyVideoMeta( replaceBuffer, out );
+    gst_buffer_copy_into( out, buf, GST_BUFFER_COPY_FLAGS | GST_BUFFER_COPY_TIMESTAMPS, 0, -1 );
+    gst_buffer_foreach_meta( buf, copyMeta, out );
+    gst_buffer_unref( replaceBuffer );
+    gst_buffer_unref( buf );
+    return out;
+  }
+
+  /* a replacement smaller than the frame leaves the rest of the input */
+  gboolean partial = (replaceInfo->width < cfg->info.width)||(replaceInfo->height < cfg->info.height);
+  buf = outputBuffer( feed, cfg, buf, regions || partial );
+  GstVideoFrame srcFrame;
+  if (gst_video_frame_map (&srcFrame, replaceInfo, replaceBuffer, GST_MAP_READ))
+  {
+    GstVideoFrame destFrame;
+    if (regions && gst_video_frame_map (&destFrame, &cfg->info, buf, GST_MAP_READWRITE))
+    {
+      GstStillReplaceRegion* clipped = g_newa( GstStillReplaceRegion, cfg->replace_regions->len );
+      CopyRegions job = { &srcFrame, &destFrame, clipped,
+          clipReplaceRegions( cfg->replace_regions, &cfg->info, replaceInfo, clipped ) };
+      guint64 rows = 0;
+      for ( guint i = 0; i < job.n_regions; ++i )
+        rows += clipped[i].dest.height;
+      stillreplace_slice_pool_run( cfg->slicePool, copyRegionSlice, &job,
+          stillreplace_slice_pool_n_slices( cfg->slicePool, rows ) );
+      gst_video_frame_unmap( &destFrame );
+    }
+    else if (!regions && gst_video_frame_map (&destFrame, &cfg->info, buf, partial ? GST_MAP_READWRITE : GST_MAP_WRITE))
+    {
+      CopySlices job = { &srcFrame, &destFrame };
+      stillreplace_slice_pool_run( cfg->slicePool, copySlice, &job,
+          stillreplace_slice_pool_n_slices( cfg->slicePool, GST_VIDEO_FRAME_HEIGHT(&destFrame) ) );
+      gst_video_frame_unmap( &destFrame );
+    }
+    else
+    {
+      GST_ERROR_OBJECT(feed->filter, "mapping destFrame failed\n");
+    }
+    gst_video_frame_unmap( &srcFrame );
+  }
+  else
+  {
+    GST_ERROR_OBJECT(feed->filter, "mapping srcFrame failed\n");
+  }
+  gst_buffer_unref( replaceBuffer );
+  return buf;
+}
+
+/* Open a replacement window after @ident matched with reference @ref at
+ * @pts. Does nothing when neither hold-frames nor hold-duration is set. */
+static void startHold( GstStillReplaceFeed* feed, const GstStillReplaceConfig* cfg, GstStillReplaceIdent* ident, GstStillReplaceRef* ref, GstClockTime pts )
+{
+  if ((cfg->hold_frames == 0)&&(cfg->hold_duration == 0))
+    return;
+  feed->holdIdent = ident;
+  referenceReplace( &feed->holdRef, ref );
+  feed->holdFramesLeft = cfg->hold_frames;
+  feed->holdEnd = GST_CLOCK_TIME_NONE;
+  if ((cfg->hold_duration > 0)&&(GST_CLOCK_TIME_IS_VALID(pts)))
+    feed->holdEnd = pts + cfg->hold_duration;
+}
+
+/* Whether the frame at @pts still falls inside the replacement window. It
+ * ends after hold-frames frames or hold-duration, whichever comes first. */
+static gboolean holdActive( GstStillReplaceFeed* feed, const GstStillReplaceConfig* cfg, GstClockTime pts )
+{
+  if (feed->holdIdent == NULL)
+    return FALSE;
+  if ((cfg->hold_frames > 0)&&(feed->holdFramesLeft == 0))
+    return FALSE;
+  if ((cfg->hold_duration > 0)&&((!GST_CLOCK_TIME_IS_VALID(pts))||(!GST_CLOCK_TIME_IS_VALID(feed->holdEnd))||(pts >= feed->holdEnd)))
+    return FALSE;
+  return TRUE;
+}
+
+/* Whether the decision kept in feed->decision was taken for a frame with
+ * @signature against the same references and settings */
+static gboolean decisionValid( GstStillReplaceFeed* feed, const GstStillReplaceConfig* cfg, guint64 signature )
+{
+  if ((feed->decision.refs == NULL)||(feed->decision.signature != signature))
+    return FALSE;
+  if ((feed->decision.regions != cfg->regions)||(feed->decision.sse_budget != cfg->sse_budget)||
+      (feed->decision.coarse_row_step != cfg->coarse_row_step)||(feed->decision.coarse_column_step != cfg->coarse_column_step)||
+      (memcmp( &feed->decision.area, &cfg->area, sizeof(cfg->area) ) != 0))
+    return FALSE;
+  if (feed->decision.refs->len != cfg->n_refs)
+    return FALSE;
+  for ( guint i = 0; i < cfg->n_refs; ++i )
+  {
+    if (g_ptr_array_index( feed->decision.refs, i ) != cfg->refs[i])
+      return FALSE;
+  }
+  return TRUE;
+}
+
+/* Keep the decision for the frame with @signature, holding on to the
+ * references and regions so their pointers identify them */
+static void keepDecision( GstStillReplaceFeed* feed, const GstStillReplaceConfig* cfg, guint64 signature, GstStillReplaceIdent* match )
+{
+  forgetDecision( feed );
+  feed->decision.signature = signature;
+  feed->decision.refs = g_ptr_array_new_full( cfg->n_refs, (GDestroyNotify)referenceUnref );
+  for ( guint i = 0; i < cfg->n_refs; ++i )
+    g_ptr_array_add( feed->decision.refs, referenceRef( cfg->refs[i] ) );
+  feed->decision.regions = g_array_ref( cfg->regions );
+  feed->decision.sse_budget = cfg->sse_budget;
+  feed->decision.coarse_row_step = cfg->coarse_row_step;
+  feed->decision.coarse_column_step = cfg->coarse_column_step;
+  feed->decision.area = cfg->area;
+  feed->decision.match = match;
+}
+
+/* Decide which ident, if any, @frame shows. Inside a replacement window
+ * only a few lines in the middle of the compared area are checked, to
+ * notice the ident ending early; otherwise the closest reference gets a
+ * full compare and a match may open a new window. */
+static GstStillReplaceIdent* decideFrame( GstStillReplaceFeed* feed, const GstStillReplaceConfig* cfg, GstVideoFrame* frame,
+    const StillReplaceRect* rects, guint n_rects, GstClockTime pts, FrameStats* stats )
+{
+  GstStillReplaceIdent* matched = NULL;
+  gboolean holdValid = FALSE;
+  for ( guint i = 0; i < cfg->n_refs; ++i )
+    holdValid |= (cfg->idents[i] == feed->holdIdent);
+  if (holdValid && holdActive( feed, cfg, pts ))
+  {
+    StillReplaceRect spot = boundingRect( rects, n_rects );
+    spot.y += (spot.height - MIN( cfg->hold_check_lines, spot.height )) / 2;
+    spot.height = MIN( cfg->hold_check_lines, spot.height );
+    if ((spot.height == 0)||compareFrame( cfg, feed->holdRef, frame, &spot, 1, 1, 1, stats ))
+      matched = feed->holdIdent;
+    if (matched)
+    {
+      stats->compared = TRUE;
+      stats->held = TRUE;
+      if (feed->holdFramesLeft > 0)
+        feed->holdFramesLeft--;
+    }
+    else
+    {
+      if (cfg->silent == FALSE)
+        GST_INFO("spot check failed, ending hold\n");
+      stats->complete = TRUE;
+      for ( guint comp = 0; comp < GST_VIDEO_MAX_COMPONENTS; ++comp )
+        stats->psnr[comp] = -1;
+    }
+  }
+  if (!matched)
+  {
+    endHold( feed );
+
+    guint candidate = 0;
+    if (cfg->n_refs > 1)
+    {
+      StillReplaceRect area = boundingRect( rects, n_rects );
+      candidate = pickCandidate( feed->filter, cfg, frame, &area );
+    }
+
+    stats->compared = TRUE;
+    /* a frame the sparse grid already tells apart never gets read in full */
+    gboolean coarse = (cfg->coarse_row_step > 1)||(cfg->coarse_column_step > 1);
+    if (coarse && !compareFrame( cfg, cfg->refs[candidate], frame, rects, n_rects,
+        cfg->coarse_row_step, cfg->coarse_column_step, stats ))
+    {
+      if (cfg->silent == FALSE)
+        GST_INFO("coarse compare failed, skipped full compare\n");
+      stats->coarse = TRUE;
+    }
+    else if (compareFrame( cfg, cfg->refs[candidate], frame, rects, n_rects, 1, 1, stats ))
+    {
+      matched = cfg->idents[candidate];
+      startHold( feed, cfg, matched, cfg->refs[candidate], pts );
+    }
+  }
+  return matched;
+}
+
+/* The rects compared with the settings of @filter, in the units of
+ * @ref->area and clipped to it, for saving along with @ref. Returns NULL
+ * when none of them is inside the area, the whole area is saved then.
+ * Called with the object lock held. */
+static StillReplaceRect* referenceRects( GstStillReplaceFilter* filter, const GstStillReplaceRef* ref, guint* n_rects )
+{
+  const GstVideoInfo* info = &filter->sink_info;
+  *n_rects = 0;
+  if (!referenceFitsCaps( ref, info ))
+    return NULL;
+
+  StillReplaceRect top = compareArea( info, filter->compare_lines, filter->regions );
+  const StillReplaceRect* rects = &top;
+  guint n = 1;
+  if (filter->regions->len > 0)
+  {
+    rects = (StillReplaceRect*)filter->regions->data;
+    n = filter->regions->len;
+  }
+  StillReplaceRect* out = g_new( StillReplaceRect, n );
+  for ( guint i = 0; i < n; ++i )
+  {
+    StillReplaceRect r;
+    if (!matchRect( info, ref->comp, &rects[i], &r ))
+      continue;
+    guint x0 = MAX( r.x, ref->area.x ), y0 = MAX( r.y, ref->area.y );
+    guint64 x1 = MIN( (guint64)r.x + r.width, (guint64)ref->area.x + ref->area.width );
+    guint64 y1 = MIN( (guint64)r.y + r.height, (guint64)ref->area.y + ref->area.height );
+    if ((x1 <= x0)||(y1 <= y0))
+      continue;
+    StillReplaceRect clipped = { x0, y0, x1 - x0, y1 - y0 };
+    out[(*n_rects)++] = clipped;
+  }
+  if (*n_rects == 0)
+    g_clear_pointer( &out, g_free );
+  return out;
+}
+
+/* Default handler of the save-reference action signal */
+static gboolean stillreplacefilter_save_reference( GstStillReplaceFilter* filter, const gchar* location )
+{
+  GstStillReplaceIdent* ident0;
+  GstStillReplaceRef* ref = NULL;
+  StillReplaceRect* rects = NULL;
+  guint n_rects = 0;
+  gchar* path;
+
+  GST_OBJECT_LOCK(filter);
+  ident0 = g_ptr_array_index( filter->idents, 0 );
+  if (ident0->refImage)
+  {
+    ref = referenceRef( ident0->refImage );
+    rects = referenceRects( filter, ref, &n_rects );
+  }
+  path = g_strdup( location ? location : filter->reference_location );
+  GST_OBJECT_UNLOCK(filter);
+
+  gboolean ret = FALSE;
+  if ((ref == NULL)||(path == NULL))
+  {
+    GST_WARNING_OBJECT( filter, "Nothing to save: %s", ref ? "no location" : "no reference yet" );
+    goto done;
+  }
+
+  StillReplaceRefFile header = { "", ref->width, ref->height, ref->comp,
+      { ref->data, ref->stride, ref->pstride, ref->sample, ref->depth, ref->lane_mask, ref->area }, rects, n_rects };
+  g_strlcpy( header.format, gst_video_format_to_string( ref->format ), sizeof(header.format) );
+  gsize size;
+  gchar* contents = stillreplace_ref_file_build( &header, &size );
+
+  GError* error = NULL;
+  ret = g_file_set_contents( path, contents, size, &error );
+  if (!ret)
+  {
+    GST_ERROR_OBJECT( filter, "Could not write reference %s: %s", path, error->message );
+    g_clear_error( &error );
+  }
+  g_free( contents );
+
+done:
+  if (ref)
+    referenceUnref( ref );
+  g_free( rects );
+  g_free( path );
+  return ret;
+}
+
+/* Add @stats to the counters of @feed and post them as element message
+ * when post-messages is set. Runs on the feed's streaming thread, the only
+ * writer of its counters, so no lock is taken per frame. */
+static void updateStats( GstStillReplaceFeed* feed, const GstStillReplaceConfig* cfg, GstClockTime pts, const FrameStats* stats )
+{
+  GstStillReplaceFilter* filter = feed->filter;
+  GstStillReplaceStats* counters = &feed->stats;
+  g_atomic_int_inc( &feed->statsSeq );
+  counters->frames++;
+  if (stats->compared)
+  {
+    counters->compared++;
+    if (stats->ident >= 0)
+      counters->matches++;
+    else
+      counters->misses++;
+    if (stats->held)
+      counters->held++;
+    if (stats->coarse)
+      counters->coarse_rejects++;
+  }
+  else if (stats->reused)
+  {
+    counters->reused++;
+    if (stats->ident >= 0)
+      counters->matches++;
+    else
+      counters->misses++;
+  }
+  counters->compare_time += stats->compareTime;
+  counters->replace_time += stats->replaceTime;
+  counters->wait_time += stats->waitTime;
+  g_atomic_int_inc( &feed->statsSeq );
+  if (!cfg->post_messages)
+    return;
+
+  GValue psnrs = G_VALUE_INIT;
+  g_value_init( &psnrs, GST_TYPE_ARRAY );
+  for ( guint comp = 0; comp < GST_VIDEO_MAX_COMPONENTS; ++comp )
+  {
+    if (stats->psnr[comp] < 0)
+      continue;
+    GValue v = G_VALUE_INIT;
+    g_value_init( &v, G_TYPE_DOUBLE );
+    g_value_set_double( &v, stats->psnr[comp] );
+    gst_value_array_append_value( &psnrs, &v );
+    g_value_unset( &v );
+  }
+  GstStructure* s = gst_structure_new( "stillreplacefilter",
+      "feed", G_TYPE_UINT, feed->index,
+      "timestamp", G_TYPE_UINT64, pts,
+      "compared", G_TYPE_BOOLEAN, stats->compared,
+      "held", G_TYPE_BOOLEAN, stats->held,
+      "reused", G_TYPE_BOOLEAN, stats->reused,
+      "coarse-rejected", G_TYPE_BOOLEAN, stats->coarse,
+      "complete", G_TYPE_BOOLEAN, stats->compared && stats->complete,
+      "matched", G_TYPE_BOOLEAN, stats->ident >= 0,
+      "ident", G_TYPE_INT, stats->ident,
+      "compare-time", G_TYPE_UINT64, stats->compareTime,
+      "replace-time", G_TYPE_UINT64, stats->replaceTime,
+      "wait-time", G_TYPE_UINT64, stats->waitTime,
+      NULL );
+  gst_structure_take_value( s, "psnr", &psnrs );
+  gst_element_post_message( GST_ELEMENT(filter), gst_message_new_element( GST_OBJECT(filter), s ) );
+}
+
+/* Decide which ident, if any, @buf of @feed shows and fill in @stats.
+ * Feed 0 takes the first reference when ident 0 has none for the current
+ * format and size yet, the other feeds wait for it. Runs on the feed's
+ * streaming thread, or on its match thread when pipelined; either way never
+ * on both at once, so the hold window and the kept decision of the feed
+ * need no lock. */
+static GstStillReplaceIdent* matchBuffer( GstStillReplaceFeed* feed, const GstStillReplaceConfig* cfg, GstBuffer* buf, FrameStats* stats )
+{
+  GstStillReplaceFilter* filter = feed->filter;
+  GstStillReplaceIdent* matched = NULL;
+
+  if (cfg->capture && (feed->index == 0))
+  {
+    if (cfg->silent == FALSE)
+      GST_INFO("replacing reference\n");
+    GstStillReplaceRef* ref = packReference( &cfg->info, buf, &cfg->area );
+    if (ref)
+    {
+      GST_OBJECT_LOCK( filter );
+      GstStillReplaceIdent* ident0 = g_ptr_array_index( filter->idents, 0 );
+      /* frames already in the pipeline were queued with the same snapshot,
+       * only the first of them becomes the reference */
+      if (!ident0->refImage || !referenceFitsCaps( ident0->refImage, &cfg->info ))
       {
-        GST_ERROR_OBJECT(filter, "mapping srcFrame failed\n");
+        referenceReplace( &ident0->refImage, ref );
+        publishConfig( filter );
       }
-      gst_buffer_unref( replaceBuffer );
+      GST_OBJECT_UNLOCK( filter );
+      referenceUnref( ref );
     }
+    return NULL;
   }
-  GstFlowReturn ret = gst_pad_push (filter->srcpad, buf);
-  if (filter->silent == FALSE)
+  /* posted here as publishConfig() runs under the object lock */
+  if (g_atomic_int_compare_and_exchange( &filter->uncoveredWarning, 1, 0 ))
+    GST_ELEMENT_WARNING( filter, STREAM, FAILED, ("Reference of ident 0 doesn't cover the compared area"),
+        ("Ident 0 isn't matched until it gets a new reference through resample or reference-location, or the compared area shrinks again") );
+  if ((cfg->n_refs == 0)||(cfg->psnr == 0))
+    return NULL;
+
+  // Compare frame
+  GstClockTime pts = GST_BUFFER_PTS(buf);
+  GstClockTime start = gst_util_get_timestamp();
+  GstVideoFrame frame;
+  if (gst_video_frame_map (&frame, &cfg->info, buf, GST_MAP_READ))
+  {
+    StillReplaceRect top = { 0, 0, cfg->info.width, cfg->compare_lines };
+    const StillReplaceRect* rects = &top;
+    guint n_rects = 1;
+    if (cfg->regions->len > 0)
+    {
+      rects = (StillReplaceRect*)cfg->regions->data;
+      n_rects = cfg->regions->len;
+    }
+    else if ((top.height == 0)||(top.height > cfg->info.height))
+    {
+      top.height = cfg->info.height;
+    }
+
+    /* A repeat of the previous frame gets the same decision */
+    StillReplaceRect sigArea;
+    MatchLayout sigLayout;
+    guint64 signature = 0;
+    gboolean haveSignature = (cfg->signature_lines > 0)&&planeLayout( &frame, 0, &sigLayout )&&
+        matchRect( &frame.info, sigLayout.comp, &cfg->area, &sigArea );
+    if (haveSignature)
+      signature = stillreplace_match_signature( GST_VIDEO_FRAME_PLANE_DATA(&frame, 0), GST_VIDEO_FRAME_PLANE_STRIDE(&frame, 0),
+          sigLayout.pstride, &sigArea, cfg->signature_lines );
+
+    if (haveSignature && decisionValid( feed, cfg, signature ))
+    {
+      matched = feed->decision.match;
+      stats->reused = TRUE;
+      if (matched && (matched == feed->holdIdent) && (feed->holdFramesLeft > 0))
+        feed->holdFramesLeft--;
+    }
+    else
+    {
+      matched = decideFrame( feed, cfg, &frame, rects, n_rects, pts, stats );
+      if (haveSignature)
+        keepDecision( feed, cfg, signature, matched );
+    }
+    gst_video_frame_unmap( &frame );
+  }
+  stats->compareTime = gst_util_get_timestamp() - start;
+  return matched;
+}
+
+/* Replace @buf when @matched is set, account for it and push it on the
+ * src pad of @feed. Always runs on the feed's streaming thread. */
+static GstFlowReturn finishBuffer( GstStillReplaceFeed* feed, const GstStillReplaceConfig* cfg, GstBuffer* buf, GstStillReplaceIdent* matched, FrameStats* stats )
+{
+  GstStillReplaceFilter* filter = feed->filter;
+  GstClockTime pts = GST_BUFFER_PTS(buf);
+  if (matched)
+  {
+    GstClockTime start = gst_util_get_timestamp();
+    stats->ident = matched->index;
+    buf = replaceFrame( feed, cfg, matched, buf, stats );
+    stats->replaceTime = gst_util_get_timestamp() - start - stats->waitTime;
+  }
+  updateStats( feed, cfg, pts, stats );
+  GstPad* srcpad = feedSrcPad( feed );
+  if (srcpad == NULL)
+  {
+    gst_buffer_unref( buf );
+    return GST_FLOW_NOT_LINKED;
+  }
+  GstFlowReturn ret = gst_pad_push (srcpad, buf);
+  if (cfg->silent == FALSE)
   {
     if (ret != GST_FLOW_OK )
       GST_INFO("%s done ret=%d\n", __PRETTY_FUNCTION__, ret);
   }
   if (ret == GST_FLOW_FLUSHING)
   {
-    g_mutex_lock (&filter->replacesinkMutex);
-    filter->flushing = TRUE; 
-    g_cond_broadcast( &filter->replacesinkEvent );
-    g_mutex_unlock (&filter->replacesinkMutex);
+    /* until the flush stop, or the pad being activated again */
+    setFeedFlushing( feed, TRUE );
   }
   if (ret == GST_FLOW_ERROR)
   {
@@ -508,17 +3228,138 @@ stillreplacefilter_chain (GstPad * pad, GstObject * parent, GstBuffer * buf)
     g_cond_broadcast( &filter->replacesinkEvent );
     g_mutex_unlock (&filter->replacesinkMutex);
   }
-  if (refImageBuffer) 
+  return ret;
+}
+
+static void initStats( FrameStats* stats )
+{
+  FrameStats init = { FALSE, FALSE, FALSE, FALSE, TRUE, { 0, }, -1, 0, 0, 0 };
+  *stats = init;
+  for ( guint comp = 0; comp < GST_VIDEO_MAX_COMPONENTS; ++comp )
+    stats->psnr[comp] = -1;
+}
+
+/* Frame handed to the match thread of a feed. Only done is shared with it,
+ * under the feed's pipelineMutex; the rest belongs to whichever side has
+ * the frame. */
+typedef struct
+{
+  GstBuffer* buf;
+  GstStillReplaceConfig* cfg;
+  GstStillReplaceIdent* matched;
+  FrameStats stats;
+  gboolean done;
+} PendingFrame;
+
+static void matchWorker( gpointer data, gpointer user_data )
+{
+  PendingFrame* pf = data;
+  GstStillReplaceFeed* feed = user_data;
+
+  pf->matched = matchBuffer( feed, pf->cfg, pf->buf, &pf->stats );
+
+  g_mutex_lock( &feed->pipelineMutex );
+  pf->done = TRUE;
+  g_cond_broadcast( &feed->pipelineDone );
+  g_mutex_unlock( &feed->pipelineMutex );
+}
+
+static void waitPendingFrame( GstStillReplaceFeed* feed, PendingFrame* pf )
+{
+  g_mutex_lock( &feed->pipelineMutex );
+  while (!pf->done)
+    g_cond_wait( &feed->pipelineDone, &feed->pipelineMutex );
+  g_mutex_unlock( &feed->pipelineMutex );
+}
+
+/* Finish the oldest frames until at most @depth are in flight. With @push
+ * unset they are dropped instead, as after a flush. Returns the first
+ * flow error, but finishes all frames regardless. Only called from the
+ * feed's streaming thread, which owns its pendingFrames queue, or after it
+ * stopped. */
+static GstFlowReturn finishPendingFrames( GstStillReplaceFeed* feed, guint depth, gboolean push )
+{
+  GstFlowReturn ret = GST_FLOW_OK;
+  while (g_queue_get_length( &feed->pendingFrames ) > depth)
   {
-    gst_buffer_unref( refImageBuffer );
+    PendingFrame* pf = g_queue_pop_head( &feed->pendingFrames );
+    waitPendingFrame( feed, pf );
+    if (push)
+    {
+      GstFlowReturn r = finishBuffer( feed, pf->cfg, pf->buf, pf->matched, &pf->stats );
+      if (ret == GST_FLOW_OK)
+        ret = r;
+    }
+    else
+    {
+      gst_buffer_unref( pf->buf );
+    }
+    configUnref( pf->cfg );
+    g_free( pf );
   }
   return ret;
 }
 
+/* chain function
+ * this function does the actual processing
+ */
+static GstFlowReturn
+stillreplacefilter_chain (GstPad * pad, GstObject * parent, GstBuffer * buf)
+{
+  GstStillReplaceFilter *filter;
+
+  filter = GST_STILLREPLACEFILTER (parent);
+  GstStillReplaceFeed* feed = gst_pad_get_element_private (pad);
+  /* no lock from here on, everything comes from the snapshot */
+  GstStillReplaceConfig* cfg = currentConfig( feed );
+
+  /* frames still in flight keep the order they came in */
+  if (!g_queue_is_empty( &feed->pendingFrames )&&(cfg->pipeline_depth == 0))
+  {
+    GstFlowReturn ret = finishPendingFrames( feed, 0, TRUE );
+    if (ret != GST_FLOW_OK)
+    {
+      gst_buffer_unref( buf );
+      return ret;
+    }
+  }
+
+  if (cfg->pipeline_depth == 0)
+  {
+    FrameStats stats;
+    initStats( &stats );
+    GstStillReplaceIdent* matched = matchBuffer( feed, cfg, buf, &stats );
+    return finishBuffer( feed, cfg, buf, matched, &stats );
+  }
+
+  /* Pipelined: this frame is matched on the match thread while the ones
+   * before it get replaced and pushed here */
+  if (feed->matchThread == NULL)
+  {
+    GError* error = NULL;
+    feed->matchThread = g_thread_pool_new( matchWorker, feed, 1, FALSE, &error );
+    if (feed->matchThread == NULL)
+    {
+      GST_ELEMENT_ERROR( filter, RESOURCE, FAILED, (NULL), ("Could not start match thread: %s", error->message) );
+      g_clear_error( &error );
+      gst_buffer_unref( buf );
+      return GST_FLOW_ERROR;
+    }
+  }
+  PendingFrame* pf = g_new0( PendingFrame, 1 );
+  pf->buf = buf;
+  pf->cfg = configRef( cfg );
+  initStats( &pf->stats );
+  g_queue_push_tail( &feed->pendingFrames, pf );
+  g_thread_pool_push( feed->matchThread, pf, NULL );
+  return finishPendingFrames( feed, cfg->pipeline_depth, TRUE );
+}
+
 static gboolean
 stillreplacefilter_replacepad_sink_event (GstPad * pad, GstObject * parent, GstEvent * event)
 {
   GstStillReplaceFilter *filter = GST_STILLREPLACEFILTER (parent);
+  GstStillReplaceIdent *ident = gst_pad_get_element_private (pad);
   gboolean ret;
 
   GST_LOG_OBJECT (filter, "Replacesink: Received %s event: %" GST_PTR_FORMAT, GST_EVENT_TYPE_NAME (event), event);
@@ -531,40 +3372,79 @@ stillreplacefilter_replacepad_sink_event (GstPad * pad, GstObject * parent, GstE
       GstVideoInfo info;
 
       gst_event_parse_caps (event, &caps);
-      /* do something with the caps */
-      if (!gst_video_info_from_caps (&info, caps))
+      ret = gst_video_info_from_caps (&info, caps);
+      if (ret)
       {
-        return FALSE;
+        GST_OBJECT_LOCK(filter);
+        ident->replacesink_info = info;
+        GST_OBJECT_UNLOCK(filter);
       }
-      GST_OBJECT_LOCK(filter);
-      filter->replacesink_info = info;
-      GST_OBJECT_UNLOCK(filter);
-
-      /* and forward */
-      ret = gst_pad_event_default (pad, parent, event);
       break;
     }
+    case GST_EVENT_FLUSH_START:
+    case GST_EVENT_FLUSH_STOP:
+    {
+      g_mutex_lock (&filter->replacesinkMutex);
+      ident->replaceFlushing = (GST_EVENT_TYPE (event) == GST_EVENT_FLUSH_START);
+      if (!ident->replaceFlushing)
+      {
+        ident->replaceEos = FALSE;
+        queueClear( ident );
+      }
+      g_cond_broadcast( &filter->replacesinkEvent );
+      g_mutex_unlock (&filter->replacesinkMutex);
+      ret = TRUE;
+      break;
+    }
+    case GST_EVENT_STREAM_START:
     case GST_EVENT_EOS:
     {
+      /* the main stream stops waiting for an ended replacement stream */
       g_mutex_lock (&filter->replacesinkMutex);
+      ident->replaceEos = (GST_EVENT_TYPE (event) == GST_EVENT_EOS);
       g_cond_broadcast( &filter->replacesinkEvent );
       g_mutex_unlock (&filter->replacesinkMutex);
-      ret = gst_pad_event_default (pad, parent, event);
+      ret = TRUE;
       break;
     }
     default:
-      ret = gst_pad_event_default (pad, parent, event);
+      ret = TRUE;
       break;
   }
+  /* replacements only reach downstream through the main stream, their
+   * events would end or flush it */
+  gst_event_unref (event);
   return ret;
 }
+
+/* this function handles queries on the replacesink and refsink pads. Their
+ * frames are only read through GstVideoFrame, which follows GstVideoMeta,
+ * so upstream may pick any stride and offsets. A replacement is pushed as
+ * it is only when downstream can take its layout, see
+ * replacementFitsFrame(), so no pool is offered. */
+static gboolean
+stillreplacefilter_readpad_query (GstPad * pad, GstObject * parent, GstQuery * query)
+{
+  switch (GST_QUERY_TYPE (query)) {
+    case GST_QUERY_ALLOCATION:
+      gst_query_add_allocation_meta (query, GST_VIDEO_META_API_TYPE, NULL);
+      return TRUE;
+    default:
+      return gst_pad_query_default (pad, parent, query);
+  }
+}
+
 static GstFlowReturn
 stillreplacefilter_replacepad_chain (GstPad * pad, GstObject * parent, GstBuffer * buf)
 {
   GstFlowReturn ret = GST_FLOW_OK;
   GstStillReplaceFilter *filter;
+  GstStillReplaceIdent *ident = gst_pad_get_element_private (pad);
 
   filter = GST_STILLREPLACEFILTER (parent);
+  GST_OBJECT_LOCK(filter);
+  gboolean stillActive = (ident->replaceStill != NULL);
+  GST_OBJECT_UNLOCK(filter);
   g_mutex_lock (&filter->replacesinkMutex);
 
   if (filter->eos)
@@ -574,39 +3454,401 @@ stillreplacefilter_replacepad_chain (GstPad * pad, GstObject * parent, GstBuffer
     gst_buffer_unref( buf );
     return GST_FLOW_EOS;
   }
-  if (filter->flushing)
+  if ((filter->flushing)||(ident->replaceFlushing))
   {
     g_cond_broadcast( &filter->replacesinkEvent );
     g_mutex_unlock (&filter->replacesinkMutex);
     gst_buffer_unref( buf );
     return GST_FLOW_FLUSHING;
   }
+  /* the replace-location image replaces instead, nothing would take this */
+  if (stillActive)
+  {
+    g_mutex_unlock (&filter->replacesinkMutex);
+    gst_buffer_unref( buf );
+    return GST_FLOW_OK;
+  }
 
-  while ( (filter->nextReplaceBuffer != NULL)&&(!filter->eos)&&(!filter->flushing) )
+  if (ident->replaceQueueSize != filter->replace_queue_size)
+  {
+    queueResize( ident, filter->replace_queue_size );
+  }
+  while ( (ident->replaceQueueLength >= ident->replaceQueueSize)&&(filter->replace_policy == GST_STILL_REPLACE_POLICY_BLOCK)&&
+          (ident->replacesinkpad == pad)&&(!filter->eos)&&(!filter->flushing)&&(!ident->replaceFlushing) )
+  {
     g_cond_wait( &filter->replacesinkEvent, &filter->replacesinkMutex );
+    if (ident->replaceQueueSize != filter->replace_queue_size)
+    {
+      queueResize( ident, filter->replace_queue_size );
+    }
+  }
   if (filter->eos)
   {
+    gst_buffer_unref( buf );
     ret = GST_FLOW_EOS;
   }
-  else if (filter->flushing)
+  else if ((filter->flushing)||(ident->replaceFlushing)||(ident->replacesinkpad != pad))
+  {
+    queueClear( ident );
+    gst_buffer_unref( buf );
+    ret = GST_FLOW_FLUSHING;
+  }
+  else
+  {
+    queuePush( ident, buf );
+    g_cond_broadcast( &filter->replacesinkEvent );
+  }
+  g_mutex_unlock (&filter->replacesinkMutex);
+  return ret;
+}
+
+static gboolean
+stillreplacefilter_refpad_sink_event (GstPad * pad, GstObject * parent, GstEvent * event)
+{
+  GstStillReplaceFilter *filter = GST_STILLREPLACEFILTER (parent);
+  gboolean ret = TRUE;
+
+  GST_LOG_OBJECT (filter, "Refsink: Received %s event: %" GST_PTR_FORMAT, GST_EVENT_TYPE_NAME (event), event);
+
+  if (GST_EVENT_TYPE (event) == GST_EVENT_CAPS)
   {
-    if (filter->nextReplaceBuffer)
+    GstCaps * caps;
+    GstVideoInfo info;
+
+    gst_event_parse_caps (event, &caps);
+    if (!gst_video_info_from_caps (&info, caps))
     {
-      gst_buffer_unref( filter->nextReplaceBuffer );
+      ret = FALSE;
     }
-    filter->nextReplaceBuffer = NULL;
-    ret = GST_FLOW_FLUSHING;
+    else
+    {
+      GST_OBJECT_LOCK(filter);
+      if ((filter->sink_info.finfo != NULL)&&
+          ((GST_VIDEO_INFO_FORMAT(&info) != GST_VIDEO_INFO_FORMAT(&filter->sink_info))||
+           (info.width != filter->sink_info.width)||(info.height != filter->sink_info.height)))
+      {
+        GST_ERROR_OBJECT( filter, "Caps negotiation failed: Refsink pad must have the same format and size as the main sink");
+        ret = FALSE;
+      }
+      else
+      {
+        GstStillReplaceIdent *ident = gst_pad_get_element_private (pad);
+        ident->refsink_info = info;
+      }
+      GST_OBJECT_UNLOCK(filter);
+    }
+  }
+  /* references are stills, nothing to forward downstream */
+  gst_event_unref (event);
+  return ret;
+}
+
+static GstFlowReturn
+stillreplacefilter_refpad_chain (GstPad * pad, GstObject * parent, GstBuffer * buf)
+{
+  GstStillReplaceFilter *filter = GST_STILLREPLACEFILTER (parent);
+  GstStillReplaceIdent *ident = gst_pad_get_element_private (pad);
+
+  if (filter->silent == FALSE)
+    GST_INFO("new reference for ident %u\n", ident->index);
+  GST_OBJECT_LOCK(filter);
+  GstVideoInfo info = ident->refsink_info.finfo ? ident->refsink_info : filter->sink_info;
+  StillReplaceRect area = compareArea( &info, filter->compare_lines, filter->regions );
+  GST_OBJECT_UNLOCK(filter);
+
+  GstStillReplaceRef* ref = info.finfo ? packReference( &info, buf, &area ) : NULL;
+  gst_buffer_unref( buf );
+  if (!ref)
+  {
+    GST_ELEMENT_ERROR( filter, STREAM, FORMAT, (NULL), ("Could not take reference for ident %u", ident->index) );
+    return GST_FLOW_ERROR;
+  }
+  GST_OBJECT_LOCK(filter);
+  referenceReplace( &ident->refImage, ref );
+  publishConfig( filter );
+  GST_OBJECT_UNLOCK(filter);
+  referenceUnref( ref );
+  return GST_FLOW_OK;
+}
+
+/* Filter for the internal links of a src pad, dropping the sink pads of
+ * the other feeds. @user_data holds the src pad. */
+static gint otherFeedSink( const GValue* item, const GValue* user_data )
+{
+  GstPad* pad = g_value_get_object( item );
+  GstPad* srcpad = g_value_get_object( user_data );
+  if (!isFeedPad( pad ))
+    return 0;
+  return (gst_pad_get_element_private( pad ) == gst_pad_get_element_private( srcpad )) ? 0 : 1;
+}
+
+/* Events and queries of a feed only travel between its own sink and src
+ * pad. The src pad still reaches the replacesink pads, so caps queries take
+ * the replacements into account, and those reach every src pad. */
+static GstIterator*
+stillreplacefilter_iterate_internal_links (GstPad * pad, GstObject * parent)
+{
+  GstStillReplaceFilter *filter = GST_STILLREPLACEFILTER (parent);
+
+  if (!isFeedPad( pad ))
+    return gst_pad_iterate_internal_links_default (pad, parent);
+
+  if (GST_PAD_IS_SRC (pad))
+  {
+    GValue srcpad = G_VALUE_INIT;
+    g_value_init( &srcpad, GST_TYPE_PAD );
+    g_value_set_object( &srcpad, pad );
+    GstIterator* it = gst_iterator_filter( gst_pad_iterate_internal_links_default (pad, parent),
+        (GCompareFunc)otherFeedSink, &srcpad );
+    g_value_unset( &srcpad );
+    return it;
+  }
+
+  GstStillReplaceFeed *feed = gst_pad_get_element_private (pad);
+  GstIterator* it;
+  GST_OBJECT_LOCK(filter);
+  if (feed->srcpad)
+  {
+    GValue v = G_VALUE_INIT;
+    g_value_init( &v, GST_TYPE_PAD );
+    g_value_set_object( &v, feed->srcpad );
+    it = gst_iterator_new_single( GST_TYPE_PAD, &v );
+    g_value_unset( &v );
   }
   else
   {
-    if (filter->nextReplaceBuffer)
+    it = gst_iterator_new_single( GST_TYPE_PAD, NULL );
+  }
+  GST_OBJECT_UNLOCK(filter);
+  return it;
+}
+
+/* sink_N and src_N carry feed N, created by whichever of them comes first.
+ * Feed 0 is the always present sink and src pads. */
+static GstPad*
+requestFeedPad (GstStillReplaceFilter * filter, GstPadTemplate * templ, const gchar * name, gboolean isSink)
+{
+  const gchar *prefix = isSink ? "sink_%u" : "src_%u";
+  guint index = 0;
+  GstPad *pad;
+
+  GST_OBJECT_LOCK(filter);
+  if (name == NULL)
+  {
+    /* first feed lacking this kind of pad */
+    for ( index = 1; index < filter->feeds->len; ++index )
     {
-      gst_buffer_unref( filter->nextReplaceBuffer );
+      GstStillReplaceFeed* feed = g_ptr_array_index( filter->feeds, index );
+      if ((isSink ? feed->sinkpad : feed->srcpad) == NULL)
+        break;
     }
-    filter->nextReplaceBuffer = buf;
-    g_cond_broadcast( &filter->replacesinkEvent );
   }
+  else if ((sscanf( name, prefix, &index ) != 1)||(index == 0))
+  {
+    GST_OBJECT_UNLOCK(filter);
+    GST_WARNING_OBJECT( filter, "Invalid pad name %s", name );
+    return NULL;
+  }
+  while (filter->feeds->len <= index)
+  {
+    g_ptr_array_add( filter->feeds, newFeed( filter, filter->feeds->len ) );
+  }
+  GstStillReplaceFeed* feed = g_ptr_array_index( filter->feeds, index );
+  if ((isSink ? feed->sinkpad : feed->srcpad) != NULL)
+  {
+    GST_OBJECT_UNLOCK(filter);
+    GST_WARNING_OBJECT( filter, "Pad %s already exists", name );
+    return NULL;
+  }
+  gchar* padName = g_strdup_printf( prefix, index );
+  pad = gst_pad_new_from_template (templ, padName);
+  g_free( padName );
+  gst_pad_set_element_private (pad, feed);
+  gst_pad_set_iterate_internal_links_function (pad, GST_DEBUG_FUNCPTR(stillreplacefilter_iterate_internal_links));
+  GST_PAD_SET_PROXY_CAPS (pad);
+  if (isSink)
+  {
+    gst_pad_set_event_function (pad, GST_DEBUG_FUNCPTR(stillreplacefilter_sink_event));
+    gst_pad_set_chain_function (pad, GST_DEBUG_FUNCPTR(stillreplacefilter_chain));
+    gst_pad_set_activatemode_function (pad, GST_DEBUG_FUNCPTR(stillreplacefilter_sink_activate_mode));
+    GST_PAD_SET_PROXY_ALLOCATION (pad);
+    feed->sinkpad = pad;
+    feed->eos = FALSE;
+  }
+  else
+  {
+    gst_pad_set_query_function (pad, GST_DEBUG_FUNCPTR(stillreplacefilter_src_query));
+    feed->srcpad = pad;
+    g_atomic_int_inc( &feed->srcpadSerial );
+  }
+  GST_OBJECT_UNLOCK(filter);
+
+  gst_pad_set_active (pad, TRUE);
+  gst_element_add_pad (GST_ELEMENT (filter), pad);
+  return pad;
+}
+
+/* Request pads add references to the library: refsink_N receives the still
+ * to look for, replacesink_N what to replace it with. Index 0 is taken by
+ * the captured reference and the always present replacesink pad. sink_N
+ * and src_N add feeds, see requestFeedPad(). */
+static GstPad*
+stillreplacefilter_request_new_pad (GstElement * element, GstPadTemplate * templ, const gchar * name, const GstCaps * caps)
+{
+  GstStillReplaceFilter *filter = GST_STILLREPLACEFILTER (element);
+  GstElementClass *klass = GST_ELEMENT_GET_CLASS (element);
+  gboolean isRef = (templ == gst_element_class_get_pad_template (klass, "refsink_%u"));
+  const gchar *prefix = isRef ? "refsink_%u" : "replacesink_%u";
+  guint index = 0;
+  GstPad *pad;
+
+  if ((templ == gst_element_class_get_pad_template (klass, "sink_%u"))||
+      (templ == gst_element_class_get_pad_template (klass, "src_%u")))
+    return requestFeedPad( filter, templ, name, templ == gst_element_class_get_pad_template (klass, "sink_%u") );
+  if ((templ != gst_element_class_get_pad_template (klass, "refsink_%u"))&&
+      (templ != gst_element_class_get_pad_template (klass, "replacesink_%u")))
+    return NULL;
+
+  GST_OBJECT_LOCK(filter);
+  if (name == NULL)
+  {
+    /* first ident lacking this kind of pad */
+    for ( index = 1; index < filter->idents->len; ++index )
+    {
+      GstStillReplaceIdent* ident = g_ptr_array_index( filter->idents, index );
+      if ((isRef ? ident->refsinkpad : ident->replacesinkpad) == NULL)
+        break;
+    }
+  }
+  else if ((sscanf( name, prefix, &index ) != 1)||(index == 0))
+  {
+    GST_OBJECT_UNLOCK(filter);
+    GST_WARNING_OBJECT( filter, "Invalid pad name %s", name );
+    return NULL;
+  }
+  while (filter->idents->len <= index)
+  {
+    g_ptr_array_add( filter->idents, newIdent( filter->idents->len ) );
+  }
+  GstStillReplaceIdent* ident = g_ptr_array_index( filter->idents, index );
+  if ((isRef ? ident->refsinkpad : ident->replacesinkpad) != NULL)
+  {
+    GST_OBJECT_UNLOCK(filter);
+    GST_WARNING_OBJECT( filter, "Pad %s already exists", name );
+    return NULL;
+  }
+  gchar* padName = g_strdup_printf( prefix, index );
+  pad = gst_pad_new_from_template (templ, padName);
+  g_free( padName );
+  gst_pad_set_element_private (pad, ident);
+  if (isRef)
+  {
+    gst_pad_set_event_function (pad, GST_DEBUG_FUNCPTR(stillreplacefilter_refpad_sink_event));
+    gst_pad_set_chain_function (pad, GST_DEBUG_FUNCPTR(stillreplacefilter_refpad_chain));
+    gst_pad_set_query_function (pad, GST_DEBUG_FUNCPTR(stillreplacefilter_readpad_query));
+    ident->refsinkpad = pad;
+  }
+  else
+  {
+    gst_pad_set_event_function (pad, GST_DEBUG_FUNCPTR(stillreplacefilter_replacepad_sink_event));
+    gst_pad_set_chain_function (pad, GST_DEBUG_FUNCPTR(stillreplacefilter_replacepad_chain));
+    gst_pad_set_query_function (pad, GST_DEBUG_FUNCPTR(stillreplacefilter_readpad_query));
+    gst_pad_set_activatemode_function (pad, GST_DEBUG_FUNCPTR(stillreplacefilter_sink_activate_mode));
+    gst_pad_set_iterate_internal_links_function (pad, GST_DEBUG_FUNCPTR(stillreplacefilter_iterate_internal_links));
+    GST_PAD_SET_PROXY_CAPS (pad);
+    ident->replacesinkpad = pad;
+  }
+  GST_OBJECT_UNLOCK(filter);
+
+  gst_pad_set_active (pad, TRUE);
+  gst_element_add_pad (element, pad);
+  return pad;
+}
+
+static void
+stillreplacefilter_release_pad (GstElement * element, GstPad * pad)
+{
+  GstStillReplaceFilter *filter = GST_STILLREPLACEFILTER (element);
+
+  if (isFeedPad( pad ))
+  {
+    /* the feed itself stays around until the element goes */
+    GstStillReplaceFeed *feed = gst_pad_get_element_private (pad);
+    GST_OBJECT_LOCK(filter);
+    g_mutex_lock (&filter->replacesinkMutex);
+    if (feed->sinkpad == pad)
+    {
+      feed->sinkpad = NULL;
+      updateFeedState( filter );
+    }
+    if (feed->srcpad == pad)
+    {
+      feed->srcpad = NULL;
+      g_atomic_int_inc( &feed->srcpadSerial );
+    }
+    g_mutex_unlock (&filter->replacesinkMutex);
+    GST_OBJECT_UNLOCK(filter);
+    gst_element_remove_pad (element, pad);
+    return;
+  }
+
+  GstStillReplaceIdent *ident = gst_pad_get_element_private (pad);
+  GST_OBJECT_LOCK(filter);
+  if (ident->refsinkpad == pad)
+  {
+    ident->refsinkpad = NULL;
+    referenceReplace( &ident->refImage, NULL );
+    publishConfig( filter );
+  }
+  GST_OBJECT_UNLOCK(filter);
+
+  g_mutex_lock (&filter->replacesinkMutex);
+  if (ident->replacesinkpad == pad)
+  {
+    ident->replacesinkpad = NULL;
+    ident->replaceEos = ident->replaceFlushing = FALSE;
+    queueClear( ident );
+    gst_buffer_replace( &ident->lastReplaceBuffer, NULL );
+  }
+  g_cond_broadcast( &filter->replacesinkEvent );
   g_mutex_unlock (&filter->replacesinkMutex);
+
+  gst_element_remove_pad (element, pad);
+}
+
+/* Frames left in the match pipeline of a feed belong to the run that just
+ * stopped: drop them, and the match thread with them, once the streaming
+ * threads are gone, so they don't go out ahead of the next stream. */
+static GstStateChangeReturn
+stillreplacefilter_change_state (GstElement * element, GstStateChange transition)
+{
+  GstStillReplaceFilter *filter = GST_STILLREPLACEFILTER (element);
+  GstStateChangeReturn ret;
+
+  ret = GST_ELEMENT_CLASS (parent_class)->change_state (element, transition);
+  if (ret == GST_STATE_CHANGE_FAILURE)
+    return ret;
+
+  if (transition == GST_STATE_CHANGE_PAUSED_TO_READY)
+  {
+    /* feeds are only freed on finalize, the array only grows */
+    GST_OBJECT_LOCK(filter);
+    guint n_feeds = filter->feeds->len;
+    GstStillReplaceFeed** feeds = g_newa( GstStillReplaceFeed*, n_feeds );
+    for ( guint i = 0; i < n_feeds; ++i )
+      feeds[i] = g_ptr_array_index( filter->feeds, i );
+    GST_OBJECT_UNLOCK(filter);
+
+    for ( guint i = 0; i < n_feeds; ++i )
+    {
+      finishPendingFrames( feeds[i], 0, FALSE );
+      if (feeds[i]->matchThread)
+      {
+        g_thread_pool_free( feeds[i]->matchThread, FALSE, TRUE );
+        feeds[i]->matchThread = NULL;
+      }
+    }
+  }
   return ret;
 }
 
@@ -624,6 +3866,9 @@ plugin_init (GstPlugin * stillreplacefilter)
   GST_DEBUG_CATEGORY_INIT (stillreplacefilter_debug, "stillreplacefilter",
       0, "Still replace filter");
 
+  stillreplace_match_init ();
+  GST_INFO ("using %s match kernels", stillreplace_match_impl_name ());
+
   return gst_element_register (stillreplacefilter, "stillreplacefilter", GST_RANK_NONE,
       GST_TYPE_STILLREPLACEFILTER);
 }
@@ -48,6 +48,9 @@
 
 #include <gst/video/gstvideofilter.h>
 
+#include "gststillreplacematch.h"
+#include "gststillreplaceslices.h"
+
 G_BEGIN_DECLS
 
 /* #defines don't like whitespacey bits */
@@ -64,34 +67,266 @@ G_BEGIN_DECLS
 
 typedef struct _GstStillReplaceFilter      GstStillReplaceFilter;
 typedef struct _GstStillReplaceFilterClass GstStillReplaceFilterClass;
+typedef struct _GstStillReplaceIdent       GstStillReplaceIdent;
+typedef struct _GstStillReplaceFeed        GstStillReplaceFeed;
+typedef struct _GstStillReplaceRef         GstStillReplaceRef;
+typedef struct _GstStillReplaceConfig      GstStillReplaceConfig;
+
+#define GST_TYPE_STILL_REPLACE_POLICY (gst_still_replace_policy_get_type())
+
+/* What the replacement queue does when it is full or empty */
+typedef enum
+{
+  GST_STILL_REPLACE_POLICY_BLOCK,       // Replacesink waits when full, main stream waits when empty
+  GST_STILL_REPLACE_POLICY_DROP_OLDEST, // Replacesink drops the oldest frame when full, main stream waits when empty
+  GST_STILL_REPLACE_POLICY_REPEAT_LAST  // Like drop-oldest, but the main stream repeats the last frame when empty
+} GstStillReplacePolicy;
+
+#define GST_TYPE_STILL_REPLACE_MODE (gst_still_replace_mode_get_type())
+
+/* How a replacement ends up in the output */
+typedef enum
+{
+  GST_STILL_REPLACE_MODE_PIXELS,  // Replacement pixels are written into the frame
+  GST_STILL_REPLACE_MODE_OVERLAY  // Replacement is attached as overlay composition meta when downstream draws it, copied otherwise
+} GstStillReplaceMode;
+
+/* Part of the frame written on a replacement: @dest in the output frame,
+ * taken from the replacement frame at src_x, src_y */
+typedef struct
+{
+  StillReplaceRect dest;
+  guint src_x, src_y;
+} GstStillReplaceRegion;
+
+/* Reference still reduced to the pixels that get compared: whole pixels of
+ * the plane holding the matched components inside the compare area, rows
+ * packed without padding. It never points into an upstream buffer. */
+struct _GstStillReplaceRef
+{
+  gint refcount;
+  GstVideoFormat format; // Format and size of the frame it was taken from
+  gint width, height;
+  guint comp, pstride, lane_mask; // As returned by planeLayout() for plane 0
+  StillReplaceSampleFormat sample;
+  guint depth;
+  StillReplaceRect area; // Packed area, in pixels of plane 0 (groups for v210)
+  gsize stride; // area.width * pstride
+  const guint8* data;
+  gpointer storage; // Owner of data, freed with storage_free
+  GDestroyNotify storage_free;
+};
+
+/* One reference still and the stream it gets replaced with. Ident 0 is
+ * captured from the main input and replaced from the "replacesink" pad,
+ * further idents are fed through the refsink_%u/replacesink_%u request
+ * pads. Idents are only freed on finalize, releasing their pads merely
+ * empties them. */
+struct _GstStillReplaceIdent
+{
+  guint index;
+  GstPad *refsinkpad, *replacesinkpad;
+  GstVideoInfo replacesink_info;
+  GstVideoInfo refsink_info;
+
+  GstStillReplaceRef* refImage;
+
+  /* Ring of replacement frames waiting to be used and the one used last,
+   * protected by replacesinkMutex. replaceGeneration counts the frames
+   * taken from the ring, so every feed shows each of them once. */
+  GstBuffer** replaceQueue;
+  guint replaceQueueHead, replaceQueueLength, replaceQueueSize;
+  GstBuffer* lastReplaceBuffer;
+  guint64 replaceGeneration;
+  gboolean replaceEos, replaceFlushing; // State of replacesinkpad, protected by replacesinkMutex
+
+  GstBuffer* replaceStill; // Decoded replace-location image, protected by the object lock
+
+  /* Shared by the threads matching frames of all feeds, protected by
+   * fingerprintMutex */
+  GstStillReplaceRef* fingerprintRef; // Reference the fingerprint was computed from
+  StillReplaceRect fingerprintArea;
+  guint8 fingerprint[STILLREPLACE_FINGERPRINT_SIZE];
+};
+
+/* Everything a streaming thread needs to match a frame. A snapshot is
+ * never modified once published: changes build a new one under the object
+ * lock and bump configSerial, every feed swaps it in at the start of its
+ * next frame. Only that swap takes the lock. */
+struct _GstStillReplaceConfig
+{
+  gint refcount;
+  GstVideoInfo info; // Caps of the feeds
+  gboolean silent;
+  guint compare_lines;
+  GArray* regions;
+  StillReplaceRect area; // Bounding box of what gets compared
+  GArray* replace_regions;
+  GstStillReplaceMode replace_mode;
+  guint psnr;
+  guint64 sse_budget;
+  guint n_threads;
+  StillReplaceSlicePool* slicePool; // Shared by all feeds, NULL for a single thread
+  gboolean post_messages;
+  guint hold_frames;
+  GstClockTime hold_duration;
+  guint hold_check_lines;
+  guint signature_lines;
+  guint coarse_row_step, coarse_column_step;
+  guint pipeline_depth;
+
+  /* Idents whose reference covers area, with a ref on each reference */
+  guint n_refs;
+  GstStillReplaceIdent** idents;
+  GstStillReplaceRef** refs;
+  gboolean capture; // Ident 0 needs a new reference from the next frame of feed 0
+  GstBuffer* replaceStill; // replaceStill of ident 0
+};
+
+/* One stream running through the element. The always present sink and
+ * src pads are feed 0, further feeds come in through the sink_%u/src_%u
+ * request pads. All feeds are matched against the same idents and
+ * replaced from the same replacement streams, so they must all have the
+ * same caps. Like idents, feeds are only freed on finalize. */
+/* Running counters of the stats property */
+typedef struct
+{
+  guint64 frames, compared, matches, misses, held, reused, coarse_rejects;
+  GstClockTime compare_time, replace_time, wait_time;
+} GstStillReplaceStats;
+
+struct _GstStillReplaceFeed
+{
+  GstStillReplaceFilter* filter;
+  guint index;
+  GstPad *sinkpad, *srcpad; // protected by the object lock
+  gint srcpadSerial; // Bumped atomically when srcpad is set or cleared
+  GstPad* pushPad; // Ref of srcpad frames are pushed to, only touched by the streaming thread
+  gint pushPadSerial; // srcpadSerial pushPad was taken at
+  GstVideoInfo info; // Caps of sinkpad, finfo NULL until negotiated, protected by the object lock
+
+  gboolean eos, flushing; // protected by replacesinkMutex
+  GArray* replaceSeen; // replaceGeneration of the last replacement shown, per ident, protected by replacesinkMutex
+
+  GstStillReplaceConfig* config; // Snapshot in use, only touched by the streaming thread
+  gint configSerial; // configSerial config was taken at
+
+  /* Current replacement window, only touched by the thread matching frames */
+  GstStillReplaceIdent* holdIdent;
+  GstStillReplaceRef* holdRef;
+  guint holdFramesLeft;
+  GstClockTime holdEnd;
+
+  /* Decision for the previous input frame, only touched by the thread
+   * matching frames. refs and regions are held so their pointers stay
+   * unique. */
+  struct
+  {
+    guint64 signature;
+    GPtrArray* refs;
+    GArray* regions;
+    guint64 sse_budget;
+    guint coarse_row_step, coarse_column_step;
+    StillReplaceRect area;
+    GstStillReplaceIdent* match;
+  } decision;
 
+  /* Overlay built for the last replacement in overlay mode, reused while
+   * the same buffer replaces frames. The converters building it outlive
+   * the buffer. Only touched by the streaming thread. */
+  struct
+  {
+    GstBuffer* source;
+    GArray* regions;
+    gint width, height;
+    GstVideoOverlayComposition* composition;
+    GPtrArray* converters; // One per region, kept across replacement buffers
+  } overlay;
+
+  /* Pool replaced frames are written into when the input frame can't be
+   * written in place, negotiated with downstream. Swapped under the object
+   * lock so a flush can wake up an acquire, otherwise only touched by the
+   * streaming thread. */
+  GstBufferPool* outputPool;
+  gboolean downstreamVideoMeta; // Downstream understands GstVideoMeta, replacements of any layout can be pushed as they are
+  gboolean downstreamOverlay; // Downstream draws GstVideoOverlayCompositionMeta, needed for the overlay replace mode
+
+  /* Counters of this feed, added up when the stats property is read. Only
+   * written by the streaming thread, statsSeq is odd while it does so and
+   * readers retry until they saw an even, unchanged statsSeq. */
+  GstStillReplaceStats stats;
+  gint statsSeq;
+
+  GThreadPool* matchThread; // Single thread, matches frames in the order they were pushed
+  GQueue pendingFrames; // Frames in flight, oldest first, only touched by the streaming thread or once it stopped
+  GMutex pipelineMutex;
+  GCond pipelineDone; // Signalled when the match thread finishes a frame
+};
+
+/* Locks are taken in the order object lock, replacesinkMutex */
 struct _GstStillReplaceFilter
 {
   GstElement parent;
   GMutex replacesinkMutex;
   GCond replacesinkEvent;
 
-  GstPad *sinkpad, *srcpad, *replacesinkpad;
-  GstVideoInfo sink_info;
-  GstVideoInfo replacesink_info;
+  GstPad *sinkpad, *srcpad; // Pads of feed 0
+  GstVideoInfo sink_info; // Caps shared by all feeds, protected by the object lock
+  GPtrArray* idents; // GstStillReplaceIdent's, protected by the object lock
+  GPtrArray* feeds; // GstStillReplaceFeed's, protected by the object lock
+  GMutex fingerprintMutex;
 
-  gboolean eos;
-  gboolean flushing;
+  gboolean eos; // All feeds are at EOS, protected by replacesinkMutex
+  gboolean flushing; // All feeds are flushing, protected by replacesinkMutex
 
+  GstStillReplaceConfig* config; // Newest snapshot, protected by the object lock
+  gboolean referenceUncovered; // Reference of ident 0 doesn't cover the compared area, protected by the object lock
+  gint uncoveredWarning; // Set atomically when that starts, the streaming thread posts a warning and clears it
+  gint configSerial; // Bumped atomically after config changes
+
+  /* Settings, protected by the object lock. The streaming thread only reads
+   * them through config. */
   gboolean silent;
   guint compare_lines; // Amount of lines to compare between received image and reference image
+  GArray* regions; // StillReplaceRect's to compare instead of compare_lines, replaced as a whole on change
+  StillReplaceRect roi; // Last values of the roi-* properties
+  gboolean regionsSet; // regions comes from the regions property, roi-* are ignored
   guint psnr; 
+  guint64 sse_budget; // psnr as maximum squared error per sample (48.16 fixed point)
+
+  GstStillReplaceMode replace_mode;
+  GArray* replace_regions; // GstStillReplaceRegion's written on a replacement instead of the whole frame, replaced as a whole on change
+  gchar* replace_location; // Still image replacing ident 0 instead of the replacesink stream
+  GThreadPool* stillLoader; // Single thread decoding replace-location, away from the streaming threads
+  guint stillGeneration; // Bumped for every load, only the newest one gets published, protected by the object lock
+  gchar* reference_location; // Reference file mapped as reference of ident 0
+  guint replace_queue_size; // protected by replacesinkMutex
+  GstStillReplacePolicy replace_policy; // protected by replacesinkMutex
+
+  guint n_threads; // 0 = one per CPU core
+  StillReplaceSlicePool* slicePool; // Pool for n_threads, handed to the feeds through config
 
-  GstBuffer* refImageBuffer;
-  GstBuffer* nextReplaceBuffer;
+  gboolean post_messages; // Post per frame statistics as element messages
+
+  guint hold_frames; // Frames replaced after a match with only a spot check (0 = off)
+  GstClockTime hold_duration; // Same as hold_frames as stream time
+  guint hold_check_lines; // Lines spot checked on every held frame
+  guint signature_lines; // Lines hashed to spot repeated input frames (0 = off)
+  guint coarse_row_step, coarse_column_step; // Grid compared before the full compare (1, 1 = off)
+  guint pipeline_depth; // Frames matched ahead on each feed's matchThread (0 = match in the chain function)
 };
 
 struct _GstStillReplaceFilterClass 
 {
   GstElementClass parent_class;
+
+  /* actions */
+  gboolean (*save_reference) (GstStillReplaceFilter * filter, const gchar * location);
 };
 
 GType stillreplacefilter_get_type (void);
+GType gst_still_replace_policy_get_type (void);
+GType gst_still_replace_mode_get_type (void);
 
 G_END_DECLS
 
@@ -0,0 +1,805 @@
+/*
+ * GStreamer
+ * Copyright (C) 2019 Yves De Muyter <yves@alfavisio.be>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Sum-of-squared-difference kernels used to compare incoming frames with
+ * the reference image.
+ *
+ * Every kernel makes one pass over a row and keeps a separate sum per byte
+ * position inside a pixel, so packed RGB formats get per-component errors
+ * without re-reading the row for each component. The SIMD variants work on
+ * blocks whose size is a multiple of 1, 2, 3 and 4 bytes (48 or 96 bytes)
+ * so each 32-bit accumulator lane always maps onto the same component.
+ * The best variant for the running CPU is picked once at plugin load.
+ *
+ * High bit depth formats have their own kernels working on 16-bit samples
+ * with 64-bit accumulators. v210 rows are unpacked a few groups at a time
+ * into 16-bit samples and go through the same kernels. Error budgets are
+ * in 8-bit units and get scaled to the depth of the samples.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include "gststillreplacematch.h"
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define STILLREPLACE_HAVE_X86 1
+#  include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  define STILLREPLACE_HAVE_NEON 1
+#  include <arm_neon.h>
+#endif
+
+/* Number of SIMD blocks after which the 32-bit lanes are flushed into the
+ * 64-bit sums. A lane grows by at most 255*255 per block. */
+#define FLUSH_BLOCKS 32768
+
+static const gchar *impl_name = "c";
+
+static void
+sse_row_c (const guint8 * ref, const guint8 * data, gsize len, guint pstride,
+    guint64 * sums)
+{
+  guint64 acc[STILLREPLACE_MATCH_MAX_PSTRIDE] = { 0, };
+  guint c = 0;
+  gsize i;
+
+  for (i = 0; i < len; ++i) {
+    gint tmp = ref[i] - data[i];
+    acc[c] += tmp * tmp;
+    if (++c == pstride)
+      c = 0;
+  }
+  for (c = 0; c < pstride; ++c)
+    sums[c] += acc[c];
+}
+
+StillReplaceSseRowFunc stillreplace_match_sse_row = sse_row_c;
+
+static void
+sse_row16_c (const guint16 * ref, const guint16 * data, gsize n_samples,
+    guint n_lanes, guint64 * sums)
+{
+  guint64 acc[STILLREPLACE_MATCH_MAX_PSTRIDE] = { 0, };
+  guint c = 0;
+  gsize i;
+
+  for (i = 0; i < n_samples; ++i) {
+    gint64 tmp = (gint) ref[i] - (gint) data[i];
+    acc[c] += tmp * tmp;
+    if (++c == n_lanes)
+      c = 0;
+  }
+  for (c = 0; c < n_lanes; ++c)
+    sums[c] += acc[c];
+}
+
+StillReplaceSseRow16Func stillreplace_match_sse_row16 = sse_row16_c;
+
+#if defined(STILLREPLACE_HAVE_X86) || defined(STILLREPLACE_HAVE_NEON)
+/* lanes[i] holds the sum for byte i of a block; blocks always start at a
+ * multiple of the pixel stride */
+static inline void
+fold_lanes (const guint32 * lanes, guint n_lanes, guint pstride,
+    guint64 * sums)
+{
+  guint i;
+
+  for (i = 0; i < n_lanes; ++i)
+    sums[i % pstride] += lanes[i];
+}
+
+static inline void
+fold_lanes64 (const guint64 * lanes, guint n_lanes, guint pstride,
+    guint64 * sums)
+{
+  guint i;
+
+  for (i = 0; i < n_lanes; ++i)
+    sums[i % pstride] += lanes[i];
+}
+#endif
+
+#ifdef STILLREPLACE_HAVE_X86
+#define SSE2_BLOCK 48
+
+__attribute__ ((target ("sse2")))
+static inline void
+sse2_accumulate (__m128i a, __m128i b, __m128i * acc)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  __m128i d = _mm_or_si128 (_mm_subs_epu8 (a, b), _mm_subs_epu8 (b, a));
+  __m128i lo = _mm_unpacklo_epi8 (d, zero);
+  __m128i hi = _mm_unpackhi_epi8 (d, zero);
+
+  /* |d| <= 255, so d*d fits an unsigned 16-bit lane */
+  lo = _mm_mullo_epi16 (lo, lo);
+  hi = _mm_mullo_epi16 (hi, hi);
+  acc[0] = _mm_add_epi32 (acc[0], _mm_unpacklo_epi16 (lo, zero));
+  acc[1] = _mm_add_epi32 (acc[1], _mm_unpackhi_epi16 (lo, zero));
+  acc[2] = _mm_add_epi32 (acc[2], _mm_unpacklo_epi16 (hi, zero));
+  acc[3] = _mm_add_epi32 (acc[3], _mm_unpackhi_epi16 (hi, zero));
+}
+
+__attribute__ ((target ("sse2")))
+static void
+sse_row_sse2 (const guint8 * ref, const guint8 * data, gsize len,
+    guint pstride, guint64 * sums)
+{
+  gsize blocks = len / SSE2_BLOCK;
+  gsize done = blocks * SSE2_BLOCK;
+
+  while (blocks > 0) {
+    gsize n = MIN (blocks, FLUSH_BLOCKS);
+    __m128i acc[12];
+    guint32 lanes[SSE2_BLOCK];
+    guint i;
+
+    for (i = 0; i < 12; ++i)
+      acc[i] = _mm_setzero_si128 ();
+    blocks -= n;
+    while (n--) {
+      for (i = 0; i < 3; ++i) {
+        sse2_accumulate (_mm_loadu_si128 ((const __m128i *) (ref + i * 16)),
+            _mm_loadu_si128 ((const __m128i *) (data + i * 16)), acc + i * 4);
+      }
+      ref += SSE2_BLOCK;
+      data += SSE2_BLOCK;
+    }
+    for (i = 0; i < 12; ++i)
+      _mm_storeu_si128 ((__m128i *) (lanes + i * 4), acc[i]);
+    fold_lanes (lanes, SSE2_BLOCK, pstride, sums);
+  }
+  sse_row_c (ref, data, len - done, pstride, sums);
+}
+
+/* 16-bit blocks hold 24 samples, a multiple of 1, 2, 3 and 4 lanes. The
+ * squares of 16-bit differences need the full 32 bits, so they go straight
+ * into 64-bit accumulators and never need flushing. */
+#define SSE2_BLOCK16 24
+
+__attribute__ ((target ("sse2")))
+static inline void
+sse2_accumulate16 (__m128i a, __m128i b, __m128i * acc)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  __m128i d = _mm_or_si128 (_mm_subs_epu16 (a, b), _mm_subs_epu16 (b, a));
+  __m128i lo = _mm_mullo_epi16 (d, d);
+  __m128i hi = _mm_mulhi_epu16 (d, d);
+  __m128i sq0 = _mm_unpacklo_epi16 (lo, hi);
+  __m128i sq1 = _mm_unpackhi_epi16 (lo, hi);
+
+  acc[0] = _mm_add_epi64 (acc[0], _mm_unpacklo_epi32 (sq0, zero));
+  acc[1] = _mm_add_epi64 (acc[1], _mm_unpackhi_epi32 (sq0, zero));
+  acc[2] = _mm_add_epi64 (acc[2], _mm_unpacklo_epi32 (sq1, zero));
+  acc[3] = _mm_add_epi64 (acc[3], _mm_unpackhi_epi32 (sq1, zero));
+}
+
+__attribute__ ((target ("sse2")))
+static void
+sse_row16_sse2 (const guint16 * ref, const guint16 * data, gsize n_samples,
+    guint n_lanes, guint64 * sums)
+{
+  gsize blocks = n_samples / SSE2_BLOCK16;
+  gsize done = blocks * SSE2_BLOCK16;
+  __m128i acc[12];
+  guint64 lanes[SSE2_BLOCK16];
+  guint i;
+
+  if (blocks == 0) {
+    sse_row16_c (ref, data, n_samples, n_lanes, sums);
+    return;
+  }
+  for (i = 0; i < 12; ++i)
+    acc[i] = _mm_setzero_si128 ();
+  while (blocks--) {
+    for (i = 0; i < 3; ++i) {
+      sse2_accumulate16 (_mm_loadu_si128 ((const __m128i *) (ref + i * 8)),
+          _mm_loadu_si128 ((const __m128i *) (data + i * 8)), acc + i * 4);
+    }
+    ref += SSE2_BLOCK16;
+    data += SSE2_BLOCK16;
+  }
+  for (i = 0; i < 12; ++i)
+    _mm_storeu_si128 ((__m128i *) (lanes + i * 2), acc[i]);
+  fold_lanes64 (lanes, SSE2_BLOCK16, n_lanes, sums);
+  sse_row16_c (ref, data, n_samples - done, n_lanes, sums);
+}
+
+#define AVX2_BLOCK 96
+
+__attribute__ ((target ("avx2")))
+static inline void
+avx2_accumulate (__m128i d, __m256i * acc)
+{
+  __m256i sq = _mm256_cvtepu8_epi16 (d);
+
+  sq = _mm256_mullo_epi16 (sq, sq);
+  acc[0] = _mm256_add_epi32 (acc[0],
+      _mm256_cvtepu16_epi32 (_mm256_castsi256_si128 (sq)));
+  acc[1] = _mm256_add_epi32 (acc[1],
+      _mm256_cvtepu16_epi32 (_mm256_extracti128_si256 (sq, 1)));
+}
+
+__attribute__ ((target ("avx2")))
+static void
+sse_row_avx2 (const guint8 * ref, const guint8 * data, gsize len,
+    guint pstride, guint64 * sums)
+{
+  gsize blocks = len / AVX2_BLOCK;
+  gsize done = blocks * AVX2_BLOCK;
+
+  while (blocks > 0) {
+    gsize n = MIN (blocks, FLUSH_BLOCKS);
+    __m256i acc[12];
+    guint32 lanes[AVX2_BLOCK];
+    guint i;
+
+    for (i = 0; i < 12; ++i)
+      acc[i] = _mm256_setzero_si256 ();
+    blocks -= n;
+    while (n--) {
+      for (i = 0; i < 3; ++i) {
+        __m256i a = _mm256_loadu_si256 ((const __m256i *) (ref + i * 32));
+        __m256i b = _mm256_loadu_si256 ((const __m256i *) (data + i * 32));
+        __m256i d = _mm256_or_si256 (_mm256_subs_epu8 (a, b),
+            _mm256_subs_epu8 (b, a));
+
+        avx2_accumulate (_mm256_castsi256_si128 (d), acc + i * 4);
+        avx2_accumulate (_mm256_extracti128_si256 (d, 1), acc + i * 4 + 2);
+      }
+      ref += AVX2_BLOCK;
+      data += AVX2_BLOCK;
+    }
+    for (i = 0; i < 12; ++i)
+      _mm256_storeu_si256 ((__m256i *) (lanes + i * 8), acc[i]);
+    fold_lanes (lanes, AVX2_BLOCK, pstride, sums);
+  }
+  sse_row_c (ref, data, len - done, pstride, sums);
+}
+#define AVX2_BLOCK16 48
+
+__attribute__ ((target ("avx2")))
+static inline void
+avx2_accumulate16 (__m128i d, __m256i * acc)
+{
+  __m256i sq = _mm256_cvtepu16_epi32 (d);
+
+  /* |d| <= 65535, so d*d fits an unsigned 32-bit lane */
+  sq = _mm256_mullo_epi32 (sq, sq);
+  acc[0] = _mm256_add_epi64 (acc[0],
+      _mm256_cvtepu32_epi64 (_mm256_castsi256_si128 (sq)));
+  acc[1] = _mm256_add_epi64 (acc[1],
+      _mm256_cvtepu32_epi64 (_mm256_extracti128_si256 (sq, 1)));
+}
+
+__attribute__ ((target ("avx2")))
+static void
+sse_row16_avx2 (const guint16 * ref, const guint16 * data, gsize n_samples,
+    guint n_lanes, guint64 * sums)
+{
+  gsize blocks = n_samples / AVX2_BLOCK16;
+  gsize done = blocks * AVX2_BLOCK16;
+  __m256i acc[12];
+  guint64 lanes[AVX2_BLOCK16];
+  guint i;
+
+  if (blocks == 0) {
+    sse_row16_c (ref, data, n_samples, n_lanes, sums);
+    return;
+  }
+  for (i = 0; i < 12; ++i)
+    acc[i] = _mm256_setzero_si256 ();
+  while (blocks--) {
+    for (i = 0; i < 3; ++i) {
+      __m256i a = _mm256_loadu_si256 ((const __m256i *) (ref + i * 16));
+      __m256i b = _mm256_loadu_si256 ((const __m256i *) (data + i * 16));
+      __m256i d = _mm256_or_si256 (_mm256_subs_epu16 (a, b),
+          _mm256_subs_epu16 (b, a));
+
+      avx2_accumulate16 (_mm256_castsi256_si128 (d), acc + i * 4);
+      avx2_accumulate16 (_mm256_extracti128_si256 (d, 1), acc + i * 4 + 2);
+    }
+    ref += AVX2_BLOCK16;
+    data += AVX2_BLOCK16;
+  }
+  for (i = 0; i < 12; ++i)
+    _mm256_storeu_si256 ((__m256i *) (lanes + i * 4), acc[i]);
+  fold_lanes64 (lanes, AVX2_BLOCK16, n_lanes, sums);
+  sse_row16_c (ref, data, n_samples - done, n_lanes, sums);
+}
+#endif /* STILLREPLACE_HAVE_X86 */
+
+#ifdef STILLREPLACE_HAVE_NEON
+#define NEON_BLOCK 48
+
+static void
+sse_row_neon (const guint8 * ref, const guint8 * data, gsize len,
+    guint pstride, guint64 * sums)
+{
+  gsize blocks = len / NEON_BLOCK;
+  gsize done = blocks * NEON_BLOCK;
+
+  while (blocks > 0) {
+    gsize n = MIN (blocks, FLUSH_BLOCKS);
+    uint32x4_t acc[12];
+    guint32 lanes[NEON_BLOCK];
+    guint i;
+
+    for (i = 0; i < 12; ++i)
+      acc[i] = vdupq_n_u32 (0);
+    blocks -= n;
+    while (n--) {
+      for (i = 0; i < 3; ++i) {
+        uint8x16_t d = vabdq_u8 (vld1q_u8 (ref + i * 16),
+            vld1q_u8 (data + i * 16));
+        uint16x8_t lo = vmull_u8 (vget_low_u8 (d), vget_low_u8 (d));
+        uint16x8_t hi = vmull_u8 (vget_high_u8 (d), vget_high_u8 (d));
+
+        acc[i * 4 + 0] = vaddw_u16 (acc[i * 4 + 0], vget_low_u16 (lo));
+        acc[i * 4 + 1] = vaddw_u16 (acc[i * 4 + 1], vget_high_u16 (lo));
+        acc[i * 4 + 2] = vaddw_u16 (acc[i * 4 + 2], vget_low_u16 (hi));
+        acc[i * 4 + 3] = vaddw_u16 (acc[i * 4 + 3], vget_high_u16 (hi));
+      }
+      ref += NEON_BLOCK;
+      data += NEON_BLOCK;
+    }
+    for (i = 0; i < 12; ++i)
+      vst1q_u32 (lanes + i * 4, acc[i]);
+    fold_lanes (lanes, NEON_BLOCK, pstride, sums);
+  }
+  sse_row_c (ref, data, len - done, pstride, sums);
+}
+#define NEON_BLOCK16 24
+
+static void
+sse_row16_neon (const guint16 * ref, const guint16 * data, gsize n_samples,
+    guint n_lanes, guint64 * sums)
+{
+  gsize blocks = n_samples / NEON_BLOCK16;
+  gsize done = blocks * NEON_BLOCK16;
+  uint64x2_t acc[12];
+  guint64 lanes[NEON_BLOCK16];
+  guint i;
+
+  if (blocks == 0) {
+    sse_row16_c (ref, data, n_samples, n_lanes, sums);
+    return;
+  }
+  for (i = 0; i < 12; ++i)
+    acc[i] = vdupq_n_u64 (0);
+  while (blocks--) {
+    for (i = 0; i < 3; ++i) {
+      uint16x8_t d = vabdq_u16 (vld1q_u16 (ref + i * 8),
+          vld1q_u16 (data + i * 8));
+      uint32x4_t lo = vmull_u16 (vget_low_u16 (d), vget_low_u16 (d));
+      uint32x4_t hi = vmull_u16 (vget_high_u16 (d), vget_high_u16 (d));
+
+      acc[i * 4 + 0] = vaddw_u32 (acc[i * 4 + 0], vget_low_u32 (lo));
+      acc[i * 4 + 1] = vaddw_u32 (acc[i * 4 + 1], vget_high_u32 (lo));
+      acc[i * 4 + 2] = vaddw_u32 (acc[i * 4 + 2], vget_low_u32 (hi));
+      acc[i * 4 + 3] = vaddw_u32 (acc[i * 4 + 3], vget_high_u32 (hi));
+    }
+    ref += NEON_BLOCK16;
+    data += NEON_BLOCK16;
+  }
+  for (i = 0; i < 12; ++i)
+    vst1q_u64 (lanes + i * 2, acc[i]);
+  fold_lanes64 (lanes, NEON_BLOCK16, n_lanes, sums);
+  sse_row16_c (ref, data, n_samples - done, n_lanes, sums);
+}
+#endif /* STILLREPLACE_HAVE_NEON */
+
+/* v210 groups unpacked per call of the 16-bit kernel */
+#define V210_CHUNK_GROUPS 32
+
+static inline guint32
+read_word_le (const guint8 * p)
+{
+  guint32 v;
+
+  memcpy (&v, p, sizeof (v));
+  return GUINT32_FROM_LE (v);
+}
+
+static void
+unpack_v210 (const guint8 * src, gsize n_groups, guint16 * dest)
+{
+  gsize i;
+
+  for (i = 0; i < n_groups * 4; ++i) {
+    guint32 v = read_word_le (src + i * 4);
+
+    *dest++ = v & 0x3ff;
+    *dest++ = (v >> 10) & 0x3ff;
+    *dest++ = (v >> 20) & 0x3ff;
+  }
+}
+
+/* Squared error of @len bytes of v210 groups. Samples alternate between
+ * chroma and luma, so sums[0] gets Cb and Cr and sums[1] gets Y. */
+void
+stillreplace_match_sse_row_v210 (const guint8 * ref, const guint8 * data,
+    gsize len, guint64 * sums)
+{
+  guint16 a[V210_CHUNK_GROUPS * 12], b[V210_CHUNK_GROUPS * 12];
+  gsize groups = len / STILLREPLACE_V210_GROUP_BYTES;
+
+  while (groups > 0) {
+    gsize n = MIN (groups, V210_CHUNK_GROUPS);
+
+    unpack_v210 (ref, n, a);
+    unpack_v210 (data, n, b);
+    stillreplace_match_sse_row16 (a, b, n * 12, 2, sums);
+    ref += n * STILLREPLACE_V210_GROUP_BYTES;
+    data += n * STILLREPLACE_V210_GROUP_BYTES;
+    groups -= n;
+  }
+}
+
+/* Amount of separate sums a pixel (a group for v210) of @pstride bytes
+ * gets */
+guint
+stillreplace_match_n_lanes (StillReplaceSampleFormat sample, guint pstride)
+{
+  switch (sample) {
+    case STILLREPLACE_SAMPLE_16:
+      return pstride / 2;
+    case STILLREPLACE_SAMPLE_V210:
+      return 2;
+    default:
+      return pstride;
+  }
+}
+
+/* Select the fastest kernel for this CPU. Called once from plugin_init. */
+void
+stillreplace_match_init (void)
+{
+#ifdef STILLREPLACE_HAVE_X86
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2")) {
+    stillreplace_match_sse_row = sse_row_avx2;
+    stillreplace_match_sse_row16 = sse_row16_avx2;
+    impl_name = "avx2";
+  } else if (__builtin_cpu_supports ("sse2")) {
+    stillreplace_match_sse_row = sse_row_sse2;
+    stillreplace_match_sse_row16 = sse_row16_sse2;
+    impl_name = "sse2";
+  }
+#elif defined(STILLREPLACE_HAVE_NEON)
+  stillreplace_match_sse_row = sse_row_neon;
+  stillreplace_match_sse_row16 = sse_row16_neon;
+  impl_name = "neon";
+#endif
+}
+
+const gchar *
+stillreplace_match_impl_name (void)
+{
+  return impl_name;
+}
+
+/* Add the per-byte-position squared error of @rows rows to @sums. Only the
+ * first @row_bytes of every row are read, so stride padding is skipped. */
+void
+stillreplace_match_sse_rows (const guint8 * ref, gsize ref_stride,
+    const guint8 * data, gsize stride, gsize row_bytes, guint rows,
+    guint pstride, guint64 * sums)
+{
+  guint row;
+
+  for (row = 0; row < rows; ++row) {
+    stillreplace_match_sse_row (ref, data, row_bytes, pstride, sums);
+    ref += ref_stride;
+    data += stride;
+  }
+}
+
+/* Fixed point precision of the error budget */
+#define BUDGET_SHIFT 16
+
+/* Turn a psnr threshold into the largest mean squared error per sample that
+ * still counts as a match, in 48.16 fixed point. The psnr of a component is
+ * 10 * log10 (255^2 / mse), so it exceeds @psnr as long as
+ * mse < 255^2 / 10^(psnr / 10). Computed once whenever the property
+ * changes so the streaming thread never has to take a logarithm. */
+guint64
+stillreplace_match_psnr_to_budget (guint psnr)
+{
+  return (guint64) floor (65025.0 * (1 << BUDGET_SHIFT) * pow (10.0,
+          -(gdouble) psnr / 10.0));
+}
+
+/* Total squared error @n_samples samples may accumulate and still match. */
+guint64
+stillreplace_match_budget_limit (guint64 budget, guint64 n_samples)
+{
+  if (budget != 0 && n_samples > G_MAXUINT64 / budget)
+    return G_MAXUINT64 >> BUDGET_SHIFT;
+  return (budget * n_samples) >> BUDGET_SHIFT;
+}
+
+/* Scale a limit from stillreplace_match_budget_limit() to samples of
+ * @depth bits, so the same psnr threshold holds: the squared error of
+ * those is (2^depth - 1)^2 / 255^2 times larger. */
+guint64
+stillreplace_match_budget_limit_depth (guint64 budget, guint64 n_samples,
+    guint depth)
+{
+  guint64 limit = stillreplace_match_budget_limit (budget, n_samples);
+  guint64 peak = ((guint64) 1 << depth) - 1;
+  guint64 scale = peak * peak;
+
+  if (depth <= 8)
+    return limit;
+  if (limit / 65025 > G_MAXUINT64 / scale)
+    return G_MAXUINT64;
+  return limit / 65025 * scale + limit % 65025 * scale / 65025;
+}
+
+/* Same as stillreplace_match_sse_rows() but gives up as soon as the sums of
+ * all byte positions in @lane_mask are above their @limits, as such a frame
+ * can no longer match. Returns FALSE when it stopped early. */
+gboolean
+stillreplace_match_sse_rows_bounded (const guint8 * ref, gsize ref_stride,
+    const guint8 * data, gsize stride, gsize row_bytes, guint rows,
+    guint pstride, guint lane_mask, const guint64 * limits, guint64 * sums)
+{
+  return stillreplace_match_sse_rows_bounded_samples (ref, ref_stride, data,
+      stride, row_bytes, rows, STILLREPLACE_SAMPLE_8, pstride, lane_mask,
+      limits, sums);
+}
+
+/* stillreplace_match_sse_rows_bounded() for rows of any @sample format,
+ * with @n_lanes sums as returned by stillreplace_match_n_lanes(). */
+gboolean
+stillreplace_match_sse_rows_bounded_samples (const guint8 * ref,
+    gsize ref_stride, const guint8 * data, gsize stride, gsize row_bytes,
+    guint rows, StillReplaceSampleFormat sample, guint n_lanes,
+    guint lane_mask, const guint64 * limits, guint64 * sums)
+{
+  guint row, i;
+
+  for (row = 0; row < rows; ++row) {
+    gboolean over = TRUE;
+
+    switch (sample) {
+      case STILLREPLACE_SAMPLE_16:
+        stillreplace_match_sse_row16 ((const guint16 *) ref,
+            (const guint16 *) data, row_bytes / 2, n_lanes, sums);
+        break;
+      case STILLREPLACE_SAMPLE_V210:
+        stillreplace_match_sse_row_v210 (ref, data, row_bytes, sums);
+        break;
+      default:
+        stillreplace_match_sse_row (ref, data, row_bytes, n_lanes, sums);
+        break;
+    }
+    ref += ref_stride;
+    data += stride;
+
+    for (i = 0; i < n_lanes && over; ++i) {
+      if ((lane_mask & (1 << i)) && sums[i] <= limits[i])
+        over = FALSE;
+    }
+    if (over)
+      return FALSE;
+  }
+  return TRUE;
+}
+
+/* Add the squared error of every @column_step-th pixel (v210 group) of
+ * @n_pixels at @ref and @data to @n_lanes @sums. */
+static void
+sse_pixels (const guint8 * ref, const guint8 * data, guint n_pixels,
+    guint pstride, guint column_step, StillReplaceSampleFormat sample,
+    guint n_lanes, guint64 * sums)
+{
+  gsize skip = (gsize) column_step * pstride;
+  guint x, lane;
+
+  for (x = 0; x < n_pixels; x += column_step) {
+    switch (sample) {
+      case STILLREPLACE_SAMPLE_16:
+        for (lane = 0; lane < n_lanes; ++lane) {
+          guint16 a, b;
+          gint64 tmp;
+
+          memcpy (&a, ref + lane * 2, sizeof (a));
+          memcpy (&b, data + lane * 2, sizeof (b));
+          tmp = (gint) a - (gint) b;
+          sums[lane] += tmp * tmp;
+        }
+        break;
+      case STILLREPLACE_SAMPLE_V210:
+        stillreplace_match_sse_row_v210 (ref, data, pstride, sums);
+        break;
+      default:
+        for (lane = 0; lane < n_lanes; ++lane) {
+          gint tmp = ref[lane] - data[lane];
+          sums[lane] += tmp * tmp;
+        }
+        break;
+    }
+    ref += skip;
+    data += skip;
+  }
+}
+
+/* stillreplace_match_sse_rows_bounded_samples() over a sparse grid: only
+ * every @column_step-th of the @n_pixels pixels (v210 groups) of each of
+ * the @rows rows is compared. Skipping rows is up to the caller, through
+ * @ref_stride and @stride. */
+gboolean
+stillreplace_match_sse_grid_bounded (const guint8 * ref, gsize ref_stride,
+    const guint8 * data, gsize stride, guint n_pixels, guint rows,
+    guint pstride, guint column_step, StillReplaceSampleFormat sample,
+    guint n_lanes, guint lane_mask, const guint64 * limits, guint64 * sums)
+{
+  guint row, i;
+
+  if (column_step <= 1)
+    return stillreplace_match_sse_rows_bounded_samples (ref, ref_stride, data,
+        stride, (gsize) n_pixels * pstride, rows, sample, n_lanes, lane_mask,
+        limits, sums);
+
+  for (row = 0; row < rows; ++row) {
+    gboolean over = TRUE;
+
+    sse_pixels (ref, data, n_pixels, pstride, column_step, sample, n_lanes,
+        sums);
+    ref += ref_stride;
+    data += stride;
+
+    for (i = 0; i < n_lanes && over; ++i) {
+      if ((lane_mask & (1 << i)) && sums[i] <= limits[i])
+        over = FALSE;
+    }
+    if (over)
+      return FALSE;
+  }
+  return TRUE;
+}
+
+/* Sub-samples taken per fingerprint cell in each direction */
+#define FINGERPRINT_TAPS 2
+
+/* Sum of the samples in @lane_mask of the pixel (v210 group) at @p, scaled
+ * to 8 bits, and how many there are */
+static inline void
+fingerprint_tap (const guint8 * p, guint pstride,
+    StillReplaceSampleFormat sample, guint depth, guint lane_mask,
+    guint * sum, guint * count)
+{
+  guint16 samples[12];
+  guint lane;
+
+  switch (sample) {
+    case STILLREPLACE_SAMPLE_16:
+      for (lane = 0; lane < pstride / 2; ++lane) {
+        if (lane_mask & (1 << lane)) {
+          guint16 v;
+          memcpy (&v, p + lane * 2, sizeof (v));
+          *sum += v >> (depth - 8);
+          (*count)++;
+        }
+      }
+      break;
+    case STILLREPLACE_SAMPLE_V210:
+      unpack_v210 (p, 1, samples);
+      for (lane = 0; lane < 12; ++lane) {
+        if (lane_mask & (1 << (lane % 2))) {
+          *sum += samples[lane] >> 2;
+          (*count)++;
+        }
+      }
+      break;
+    default:
+      for (lane = 0; lane < pstride; ++lane) {
+        if (lane_mask & (1 << lane)) {
+          *sum += p[lane];
+          (*count)++;
+        }
+      }
+      break;
+  }
+}
+
+/* Compute the fingerprint of @area of a plane: the average of the samples
+ * in @lane_mask at FINGERPRINT_TAPS x FINGERPRINT_TAPS points per grid
+ * cell, scaled to 8 bits. This reads a few hundred pixels regardless of the
+ * frame size. */
+void
+stillreplace_match_fingerprint (const guint8 * plane, gsize stride,
+    guint pstride, StillReplaceSampleFormat sample, guint depth,
+    guint lane_mask, const StillReplaceRect * area, guint8 * fingerprint)
+{
+  const guint n = STILLREPLACE_FINGERPRINT_GRID * FINGERPRINT_TAPS;
+  guint cx, cy, tx, ty;
+
+  for (cy = 0; cy < STILLREPLACE_FINGERPRINT_GRID; ++cy) {
+    for (cx = 0; cx < STILLREPLACE_FINGERPRINT_GRID; ++cx) {
+      guint sum = 0, count = 0;
+
+      for (ty = 0; ty < FINGERPRINT_TAPS; ++ty) {
+        guint y = area->y + (guint) (((guint64) (cy * FINGERPRINT_TAPS + ty) *
+                2 + 1) * area->height / (2 * n));
+        for (tx = 0; tx < FINGERPRINT_TAPS; ++tx) {
+          guint x = area->x + (guint) (((guint64) (cx * FINGERPRINT_TAPS + tx)
+                  * 2 + 1) * area->width / (2 * n));
+          fingerprint_tap (plane + y * stride + (gsize) x * pstride, pstride,
+              sample, depth, lane_mask, &sum, &count);
+        }
+      }
+      fingerprint[cy * STILLREPLACE_FINGERPRINT_GRID + cx] =
+          count ? sum / count : 0;
+    }
+  }
+}
+
+/* Sum of absolute differences between two fingerprints */
+guint
+stillreplace_match_fingerprint_distance (const guint8 * a, const guint8 * b)
+{
+  guint i, dist = 0;
+
+  for (i = 0; i < STILLREPLACE_FINGERPRINT_SIZE; ++i)
+    dist += ABS (a[i] - b[i]);
+  return dist;
+}
+
+/* Hash of @n_lines rows of @area of a plane, spread evenly over its height.
+ * Used to notice an input frame is a repeat of the previous one, so every
+ * byte of the sampled rows counts, not just the matched components. */
+guint64
+stillreplace_match_signature (const guint8 * plane, gsize stride,
+    guint pstride, const StillReplaceRect * area, guint n_lines)
+{
+  const guint64 prime = G_GUINT64_CONSTANT (0x100000001b3);
+  guint64 hash = G_GUINT64_CONSTANT (0xcbf29ce484222325);
+  gsize len = (gsize) area->width * pstride;
+  guint line;
+
+  n_lines = MIN (n_lines, area->height);
+  for (line = 0; line < n_lines; ++line) {
+    guint y = area->y + (guint) (((guint64) line * 2 + 1) * area->height /
+        (2 * n_lines));
+    const guint8 *p = plane + y * stride + (gsize) area->x * pstride;
+    gsize i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+      guint64 v;
+      memcpy (&v, p + i, 8);
+      hash = (hash ^ v) * prime;
+      hash ^= hash >> 29;
+    }
+    for (; i < len; ++i)
+      hash = (hash ^ p[i]) * prime;
+    hash = (hash ^ y) * prime;
+  }
+  return hash;
+}
@@ -0,0 +1,119 @@
+/*
+ * GStreamer
+ * Copyright (C) 2019 Yves De Muyter <yves@alfavisio.be>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __GST_STILLREPLACEMATCH_H__
+#define __GST_STILLREPLACEMATCH_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Largest amount of samples in a pixel the match kernels can keep separate
+ * sums for, which is the pixel stride in bytes for 8-bit formats. */
+#define STILLREPLACE_MATCH_MAX_PSTRIDE 4
+
+/* How the samples of a plane are stored */
+typedef enum
+{
+  STILLREPLACE_SAMPLE_8,        /* one byte per sample */
+  STILLREPLACE_SAMPLE_16,       /* native endian 16-bit words */
+  STILLREPLACE_SAMPLE_V210      /* v210: groups of 6 pixels in 4 little endian
+                                 * words of three 10-bit samples, Cb Y Cr Y ... */
+} StillReplaceSampleFormat;
+
+/* A v210 group is the unit of a v210 plane: areas are in groups, the pixel
+ * stride is that of a group and there are two lanes, chroma and luma. */
+#define STILLREPLACE_V210_GROUP_PIXELS 6
+#define STILLREPLACE_V210_GROUP_BYTES 16
+
+/* Rectangle in pixels of the full resolution frame */
+typedef struct
+{
+  guint x, y;
+  guint width, height;
+} StillReplaceRect;
+
+/* Fingerprints are a grid of averaged samples of the compared area, used
+ * to pick the most likely reference before doing a full compare. */
+#define STILLREPLACE_FINGERPRINT_GRID 8
+#define STILLREPLACE_FINGERPRINT_SIZE \
+  (STILLREPLACE_FINGERPRINT_GRID * STILLREPLACE_FINGERPRINT_GRID)
+
+/* Sum of squared differences over one row of packed pixels.
+ *
+ * Walks @len bytes of @ref and @data once and adds the squared difference
+ * of every byte to sums[byte_index % pstride], so all components of a
+ * packed format are measured in a single pass. @pstride must be 1, 2, 3
+ * or 4. */
+typedef void (*StillReplaceSseRowFunc) (const guint8 * ref, const guint8 * data,
+    gsize len, guint pstride, guint64 * sums);
+
+extern StillReplaceSseRowFunc stillreplace_match_sse_row;
+
+/* Same for @n_samples 16-bit samples, summed into sums[sample_index %
+ * n_lanes]. @n_lanes must be 1, 2, 3 or 4. */
+typedef void (*StillReplaceSseRow16Func) (const guint16 * ref,
+    const guint16 * data, gsize n_samples, guint n_lanes, guint64 * sums);
+
+extern StillReplaceSseRow16Func stillreplace_match_sse_row16;
+
+void stillreplace_match_sse_row_v210 (const guint8 * ref, const guint8 * data,
+    gsize len, guint64 * sums);
+
+guint stillreplace_match_n_lanes (StillReplaceSampleFormat sample,
+    guint pstride);
+
+void stillreplace_match_init (void);
+const gchar *stillreplace_match_impl_name (void);
+
+guint64 stillreplace_match_psnr_to_budget (guint psnr);
+guint64 stillreplace_match_budget_limit (guint64 budget, guint64 n_samples);
+guint64 stillreplace_match_budget_limit_depth (guint64 budget,
+    guint64 n_samples, guint depth);
+
+void stillreplace_match_sse_rows (const guint8 * ref, gsize ref_stride,
+    const guint8 * data, gsize stride, gsize row_bytes, guint rows,
+    guint pstride, guint64 * sums);
+gboolean stillreplace_match_sse_rows_bounded (const guint8 * ref,
+    gsize ref_stride, const guint8 * data, gsize stride, gsize row_bytes,
+    guint rows, guint pstride, guint lane_mask, const guint64 * limits,
+    guint64 * sums);
+gboolean stillreplace_match_sse_rows_bounded_samples (const guint8 * ref,
+    gsize ref_stride, const guint8 * data, gsize stride, gsize row_bytes,
+    guint rows, StillReplaceSampleFormat sample, guint n_lanes,
+    guint lane_mask, const guint64 * limits, guint64 * sums);
+gboolean stillreplace_match_sse_grid_bounded (const guint8 * ref,
+    gsize ref_stride, const guint8 * data, gsize stride, guint n_pixels,
+    guint rows, guint pstride, guint column_step,
+    StillReplaceSampleFormat sample, guint n_lanes, guint lane_mask,
+    const guint64 * limits, guint64 * sums);
+
+void stillreplace_match_fingerprint (const guint8 * plane, gsize stride,
+    guint pstride, StillReplaceSampleFormat sample, guint depth,
+    guint lane_mask, const StillReplaceRect * area, guint8 * fingerprint);
+guint stillreplace_match_fingerprint_distance (const guint8 * a,
+    const guint8 * b);
+
+guint64 stillreplace_match_signature (const guint8 * plane, gsize stride,
+    guint pstride, const StillReplaceRect * area, guint n_lines);
+
+G_END_DECLS
+
+#endif /* __GST_STILLREPLACEMATCH_H__ */
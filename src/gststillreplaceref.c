@@ -0,0 +1,394 @@
+/*
+ * GStreamer
+ * Copyright (C) 2019 Yves De Muyter <yves@alfavisio.be>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Comparing frames against a packed reference, and the file format
+ * packed references are stored in.
+ *
+ * This is the matching engine shared by the element and the offline
+ * scanner. It only knows about one plane of bytes and rectangles in that
+ * plane; mapping frames and regions onto it is up to the caller.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include "gststillreplaceref.h"
+
+#include <math.h>
+#include <string.h>
+
+/* Slices of a compare look at each other's progress every CHUNK_ROWS */
+#define CHUNK_ROWS 16
+
+typedef guint64 SliceSums[STILLREPLACE_MATCH_MAX_PSTRIDE];
+
+/* Every slice sums its share of the rows of each rect into its own sums */
+typedef struct
+{
+  const StillReplaceRefData *ref;
+  const guint8 *plane;
+  gsize stride;
+  const StillReplaceRect *rects;
+  guint n_rects;
+  guint row_step, column_step;
+  guint n_lanes;
+  const guint64 *limits;
+  SliceSums *sums;              /* one set per slice */
+  gint over;                    /* set as soon as a slice is over budget on its own */
+} CompareJob;
+
+/* Amount of rows or columns of @size a grid with @step samples */
+static inline guint
+grid_count (guint size, guint step)
+{
+  return (size + step - 1) / step;
+}
+
+static void
+compare_slice (gpointer data, guint slice, guint n_slices)
+{
+  CompareJob *job = data;
+  const StillReplaceRefData *ref = job->ref;
+  guint64 *sums = job->sums[slice];
+  guint i, row;
+
+  for (i = 0; i < job->n_rects; ++i) {
+    const StillReplaceRect *r = &job->rects[i];
+    guint rows = grid_count (r->height, job->row_step);
+    guint first = (guint64) rows * slice / n_slices;
+    guint last = (guint64) rows * (slice + 1) / n_slices;
+
+    for (row = first; row < last; row += CHUNK_ROWS) {
+      guint y = r->y + row * job->row_step;
+
+      /* sums only grow, so one slice over budget means the whole plane is */
+      if (g_atomic_int_get (&job->over))
+        return;
+      if (!stillreplace_match_sse_grid_bounded (ref->data + (y -
+                  ref->area.y) * ref->stride + (gsize) (r->x -
+                  ref->area.x) * ref->pstride, ref->stride * job->row_step,
+              job->plane + y * job->stride + (gsize) r->x * ref->pstride,
+              job->stride * job->row_step, r->width, MIN (CHUNK_ROWS,
+                  last - row), ref->pstride, job->column_step, ref->sample,
+              job->n_lanes, ref->lane_mask, job->limits, sums)) {
+        g_atomic_int_set (&job->over, 1);
+        return;
+      }
+    }
+  }
+}
+
+/* Compare @rects of @plane with @ref in a single pass. @rects are in the
+ * units of ref->area and must lie inside it. Returns TRUE when any lane in
+ * ref->lane_mask is within the error @budget (as returned by
+ * stillreplace_match_psnr_to_budget(), scaled to ref->depth). The compare
+ * is abandoned as soon as all of them are over it. Large areas are split
+ * into horizontal slices over @pool, which may be NULL. */
+gboolean
+stillreplace_ref_compare (StillReplaceSlicePool * pool,
+    const StillReplaceRefData * ref, const guint8 * plane, gsize stride,
+    const StillReplaceRect * rects, guint n_rects, guint64 budget,
+    StillReplaceCompareResult * result)
+{
+  return stillreplace_ref_compare_grid (pool, ref, plane, stride, rects,
+      n_rects, 1, 1, budget, result);
+}
+
+/* stillreplace_ref_compare() of only the pixels on a grid of every
+ * @row_step-th row and @column_step-th pixel (v210 group) of each rect,
+ * starting at its top left corner. The budget holds per compared sample,
+ * so a sparse grid gives a cheap estimate of the full compare. Skipped
+ * rows are never read; skipped columns save work but not memory traffic
+ * unless the step spans a cache line. */
+gboolean
+stillreplace_ref_compare_grid (StillReplaceSlicePool * pool,
+    const StillReplaceRefData * ref, const guint8 * plane, gsize stride,
+    const StillReplaceRect * rects, guint n_rects, guint row_step,
+    guint column_step, guint64 budget, StillReplaceCompareResult * result)
+{
+  CompareJob job;
+  guint64 rows = 0;
+  guint n_lanes = stillreplace_match_n_lanes (ref->sample, ref->pstride);
+  guint i, lane, slice, n_slices;
+  gboolean matched = FALSE;
+
+  row_step = MAX (row_step, 1);
+  column_step = MAX (column_step, 1);
+  memset (result, 0, sizeof (*result));
+  result->complete = TRUE;
+  for (i = 0; i < n_rects; ++i) {
+    guint height = grid_count (rects[i].height, row_step);
+
+    result->samples +=
+        (guint64) grid_count (rects[i].width, column_step) * height;
+    rows += height;
+  }
+  /* a v210 group has 6 luma and 6 chroma samples */
+  if (ref->sample == STILLREPLACE_SAMPLE_V210)
+    result->samples *= STILLREPLACE_V210_GROUP_PIXELS;
+  if (result->samples == 0)
+    return FALSE;
+
+  for (lane = 0; lane < n_lanes; ++lane) {
+    if (ref->lane_mask & (1 << lane))
+      result->limits[lane] = stillreplace_match_budget_limit_depth (budget,
+          result->samples, ref->depth);
+  }
+
+  job.ref = ref;
+  job.plane = plane;
+  job.stride = stride;
+  job.rects = rects;
+  job.n_rects = n_rects;
+  job.row_step = row_step;
+  job.column_step = column_step;
+  job.n_lanes = n_lanes;
+  job.limits = result->limits;
+  job.over = 0;
+  n_slices = stillreplace_slice_pool_n_slices (pool, rows);
+  job.sums = g_newa (SliceSums, n_slices);
+  memset (job.sums, 0, n_slices * sizeof (job.sums[0]));
+  stillreplace_slice_pool_run (pool, compare_slice, &job, n_slices);
+
+  for (lane = 0; lane < n_lanes; ++lane) {
+    for (slice = 0; slice < n_slices; ++slice)
+      result->sums[lane] += job.sums[slice][lane];
+  }
+  result->complete = !job.over;
+  if (job.over)
+    return FALSE;
+
+  for (lane = 0; lane < n_lanes; ++lane) {
+    if ((ref->lane_mask & (1 << lane)) && result->sums[lane] <=
+        result->limits[lane])
+      matched = TRUE;
+  }
+  return matched;
+}
+
+/* PSNR of samples of @depth bits with a total squared error of @sum */
+gdouble
+stillreplace_ref_psnr (guint64 sum, guint64 samples, guint depth)
+{
+  gdouble peak = (gdouble) (((guint64) 1 << depth) - 1);
+
+  return 10 * log10 (peak * peak / ((gdouble) sum / samples));
+}
+
+/* All numbers are 32 bit little endian:
+ *
+ *   8 bytes    "SRREF\0\0\4"
+ *   16 bytes   video format name, NUL terminated
+ *   10 numbers frame width and height, comp, pstride, lane_mask, the
+ *              packed area x, y, width and height, and the sample format
+ *              with the depth in bits 8-15
+ *   area height rows of area width * pstride bytes
+ *   1 number   count of compared rects
+ *   4 numbers  x, y, width and height of each of them, in the units of
+ *              the area and inside it
+ *
+ * Version 3 files end after the rows, the whole area is compared. Version
+ * 2 files also lack the last header number and hold 8-bit samples.
+ * Samples wider than a byte are stored in host order, like the frames
+ * they come from.
+ */
+static const gchar magic[8] = { 'S', 'R', 'R', 'E', 'F', 0, 0, 4 };
+
+#define N_FIELDS 10
+#define N_FIELDS_V2 9
+#define VERSION_V3 3
+#define VERSION_V2 2
+
+/* Read the compared rects following the rows at @offset of a version 4
+ * file into @file */
+static gboolean
+parse_rects (const gchar * contents, gsize length, gsize offset,
+    StillReplaceRefFile * file)
+{
+  const StillReplaceRect *area = &file->data.area;
+  guint32 n_rects, fields[4];
+  guint i;
+
+  if (length - offset < sizeof (n_rects))
+    return FALSE;
+  memcpy (&n_rects, contents + offset, sizeof (n_rects));
+  n_rects = GUINT32_FROM_LE (n_rects);
+  offset += sizeof (n_rects);
+  if (n_rects == 0 || n_rects > (length - offset) / sizeof (fields))
+    return FALSE;
+
+  file->rects = g_new (StillReplaceRect, n_rects);
+  file->n_rects = n_rects;
+  for (i = 0; i < n_rects; ++i, offset += sizeof (fields)) {
+    StillReplaceRect *r = &file->rects[i];
+
+    memcpy (fields, contents + offset, sizeof (fields));
+    r->x = GUINT32_FROM_LE (fields[0]);
+    r->y = GUINT32_FROM_LE (fields[1]);
+    r->width = GUINT32_FROM_LE (fields[2]);
+    r->height = GUINT32_FROM_LE (fields[3]);
+    if (r->width == 0 || r->height == 0 || r->x < area->x || r->y < area->y
+        || (guint64) r->x + r->width > (guint64) area->x + area->width
+        || (guint64) r->y + r->height > (guint64) area->y + area->height) {
+      stillreplace_ref_file_clear (file);
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+/* Check @contents is a reference file and fill in @file, pointing into
+ * @contents for the data. Everything a compare reads is checked: the data
+ * must be there in full, the area inside the frame, the rects inside the
+ * area and the lanes inside a pixel. Whether the area fits the subsampled
+ * plane of @file->comp is up to the caller, which knows the format.
+ * Files without rects get the whole area as the only one. The rects are
+ * freed with stillreplace_ref_file_clear(). */
+gboolean
+stillreplace_ref_file_parse (const gchar * contents, gsize length,
+    StillReplaceRefFile * file)
+{
+  guint32 fields[N_FIELDS];
+  guint i, n_fields = N_FIELDS, n_lanes, version;
+  StillReplaceSampleFormat sample;
+  guint depth;
+  guint64 size;
+
+  file->rects = NULL;
+  file->n_rects = 0;
+  if (length < STILLREPLACE_REF_FILE_HEADER_SIZE
+      || memcmp (contents, magic, sizeof (magic) - 1) != 0)
+    return FALSE;
+  version = contents[sizeof (magic) - 1];
+  if (version == VERSION_V2)
+    n_fields = N_FIELDS_V2;
+  else if (version != VERSION_V3 && version != magic[sizeof (magic) - 1])
+    return FALSE;
+
+  memcpy (file->format, contents + sizeof (magic),
+      STILLREPLACE_REF_FILE_FORMAT_SIZE);
+  file->format[STILLREPLACE_REF_FILE_FORMAT_SIZE - 1] = '\0';
+  memset (fields, 0, sizeof (fields));
+  memcpy (fields, contents + sizeof (magic) + STILLREPLACE_REF_FILE_FORMAT_SIZE,
+      n_fields * sizeof (fields[0]));
+  for (i = 0; i < N_FIELDS; ++i)
+    fields[i] = GUINT32_FROM_LE (fields[i]);
+  sample = fields[9] & 0xff;
+  depth = n_fields == N_FIELDS_V2 ? 8 : (fields[9] >> 8) & 0xff;
+  if (sample > STILLREPLACE_SAMPLE_V210 || depth < 8 || depth > 16
+      || fields[3] == 0)
+    return FALSE;
+  n_lanes = stillreplace_match_n_lanes (sample, fields[3]);
+  if (n_lanes == 0 || n_lanes > STILLREPLACE_MATCH_MAX_PSTRIDE
+      || fields[4] == 0 || (fields[4] >> n_lanes) != 0)
+    return FALSE;
+  if (fields[2] >= STILLREPLACE_REF_MAX_COMPONENTS
+      || (guint64) fields[5] + fields[7] > fields[0]
+      || (guint64) fields[6] + fields[8] > fields[1])
+    return FALSE;
+  if (!g_uint64_checked_mul (&size, fields[7], fields[3])
+      || !g_uint64_checked_mul (&size, size, fields[8])
+      || size > length - STILLREPLACE_REF_FILE_HEADER_SIZE)
+    return FALSE;
+
+  file->width = fields[0];
+  file->height = fields[1];
+  file->comp = fields[2];
+  file->data.pstride = fields[3];
+  file->data.sample = sample;
+  file->data.depth = depth;
+  file->data.lane_mask = fields[4];
+  file->data.area.x = fields[5];
+  file->data.area.y = fields[6];
+  file->data.area.width = fields[7];
+  file->data.area.height = fields[8];
+  file->data.stride = (gsize) file->data.area.width * file->data.pstride;
+  file->data.data =
+      (const guint8 *) contents + STILLREPLACE_REF_FILE_HEADER_SIZE;
+  if (version == magic[sizeof (magic) - 1])
+    return parse_rects (contents, length,
+        STILLREPLACE_REF_FILE_HEADER_SIZE + size, file);
+
+  file->rects = g_new (StillReplaceRect, 1);
+  file->rects[0] = file->data.area;
+  file->n_rects = 1;
+  return TRUE;
+}
+
+/* Free the rects stillreplace_ref_file_parse() filled in */
+void
+stillreplace_ref_file_clear (StillReplaceRefFile * file)
+{
+  g_clear_pointer (&file->rects, g_free);
+  file->n_rects = 0;
+}
+
+/* Store @value at @p, returns where the next number goes */
+static gchar *
+write_number (gchar * p, guint32 value)
+{
+  value = GUINT32_TO_LE (value);
+  memcpy (p, &value, sizeof (value));
+  return p + sizeof (value);
+}
+
+/* Serialize @file, its data rows may have any stride. Without rects the
+ * whole area is written as the compared one. Returns a newly allocated
+ * buffer of @length bytes. */
+gchar *
+stillreplace_ref_file_build (const StillReplaceRefFile * file, gsize * length)
+{
+  const StillReplaceRefData *data = &file->data;
+  gsize row_bytes = (gsize) data->area.width * data->pstride;
+  gsize rows_end = STILLREPLACE_REF_FILE_HEADER_SIZE +
+      row_bytes * data->area.height;
+  guint32 fields[N_FIELDS] = { file->width, file->height, file->comp,
+    data->pstride, data->lane_mask, data->area.x, data->area.y,
+    data->area.width, data->area.height, data->sample | data->depth << 8
+  };
+  const StillReplaceRect *rects = file->n_rects ? file->rects : &data->area;
+  guint32 n_rects = file->n_rects ? file->n_rects : 1;
+  gchar *contents, *p;
+  guint i;
+
+  *length = rows_end + sizeof (n_rects) + n_rects * 4 * sizeof (guint32);
+  contents = g_malloc0 (*length);
+  for (i = 0; i < N_FIELDS; ++i)
+    fields[i] = GUINT32_TO_LE (fields[i]);
+  memcpy (contents, magic, sizeof (magic));
+  g_strlcpy (contents + sizeof (magic), file->format,
+      STILLREPLACE_REF_FILE_FORMAT_SIZE);
+  memcpy (contents + sizeof (magic) + STILLREPLACE_REF_FILE_FORMAT_SIZE,
+      fields, sizeof (fields));
+  for (i = 0; i < data->area.height; ++i)
+    memcpy (contents + STILLREPLACE_REF_FILE_HEADER_SIZE + i * row_bytes,
+        data->data + i * data->stride, row_bytes);
+
+  p = contents + rows_end;
+  p = write_number (p, n_rects);
+  for (i = 0; i < n_rects; ++i) {
+    p = write_number (p, rects[i].x);
+    p = write_number (p, rects[i].y);
+    p = write_number (p, rects[i].width);
+    p = write_number (p, rects[i].height);
+  }
+  return contents;
+}
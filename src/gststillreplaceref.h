@@ -0,0 +1,91 @@
+/*
+ * GStreamer
+ * Copyright (C) 2019 Yves De Muyter <yves@alfavisio.be>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __GST_STILLREPLACEREF_H__
+#define __GST_STILLREPLACEREF_H__
+
+#include <glib.h>
+
+#include "gststillreplacematch.h"
+#include "gststillreplaceslices.h"
+
+G_BEGIN_DECLS
+
+/* Packed reference: the whole pixels of one plane inside @area, rows
+ * @stride bytes apart, of which only the lanes in @lane_mask are compared.
+ * @area is in pixels of that plane, in groups for v210. @depth is the
+ * range of a sample in bits, 16 for formats keeping fewer bits in the top
+ * of a 16-bit word. */
+typedef struct
+{
+  const guint8 *data;
+  gsize stride;
+  guint pstride;
+  StillReplaceSampleFormat sample;
+  guint depth;
+  guint lane_mask;
+  StillReplaceRect area;
+} StillReplaceRefData;
+
+/* Outcome of stillreplace_ref_compare() and stillreplace_ref_compare_grid() */
+typedef struct
+{
+  guint64 sums[STILLREPLACE_MATCH_MAX_PSTRIDE]; /* squared error per lane */
+  guint64 limits[STILLREPLACE_MATCH_MAX_PSTRIDE]; /* largest matching sum, 0 outside lane_mask */
+  guint64 samples;              /* samples compared per lane */
+  gboolean complete;            /* FALSE when given up early, sums are then a lower bound */
+} StillReplaceCompareResult;
+
+gboolean stillreplace_ref_compare (StillReplaceSlicePool * pool,
+    const StillReplaceRefData * ref, const guint8 * plane, gsize stride,
+    const StillReplaceRect * rects, guint n_rects, guint64 budget,
+    StillReplaceCompareResult * result);
+gboolean stillreplace_ref_compare_grid (StillReplaceSlicePool * pool,
+    const StillReplaceRefData * ref, const guint8 * plane, gsize stride,
+    const StillReplaceRect * rects, guint n_rects, guint row_step,
+    guint column_step, guint64 budget, StillReplaceCompareResult * result);
+
+gdouble stillreplace_ref_psnr (guint64 sum, guint64 samples, guint depth);
+
+/* Reference files hold a packed reference as is, so a mapped file can be
+ * compared against without copying. */
+#define STILLREPLACE_REF_FILE_FORMAT_SIZE 16
+#define STILLREPLACE_REF_MAX_COMPONENTS 4 /* GST_VIDEO_MAX_COMPONENTS */
+#define STILLREPLACE_REF_FILE_HEADER_SIZE 64
+
+typedef struct
+{
+  gchar format[STILLREPLACE_REF_FILE_FORMAT_SIZE]; /* video format name of the frames */
+  guint width, height;          /* frame size */
+  guint comp;                   /* component whose plane the data is from */
+  StillReplaceRefData data;
+  StillReplaceRect *rects;      /* compared rects inside data.area, in its units */
+  guint n_rects;
+} StillReplaceRefFile;
+
+gboolean stillreplace_ref_file_parse (const gchar * contents, gsize length,
+    StillReplaceRefFile * file);
+void stillreplace_ref_file_clear (StillReplaceRefFile * file);
+gchar *stillreplace_ref_file_build (const StillReplaceRefFile * file,
+    gsize * length);
+
+G_END_DECLS
+
+#endif /* __GST_STILLREPLACEREF_H__ */
@@ -0,0 +1,173 @@
+/*
+ * GStreamer
+ * Copyright (C) 2019 Yves De Muyter <yves@alfavisio.be>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Worker pool used to split the compare and the replace copy of large
+ * frames into horizontal slices.
+ *
+ * The workers are started once and wait on a GThreadPool queue, so running
+ * a job only costs a queue push and a wakeup per slice. A job is finished
+ * when all of its slices are, the caller blocks until then so the frames
+ * the slices work on stay mapped.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include "gststillreplaceslices.h"
+
+struct _StillReplaceSlicePool
+{
+  gint refcount;
+  GThreadPool *workers;
+  guint n_threads;
+};
+
+typedef struct
+{
+  StillReplaceSliceFunc func;
+  gpointer data;
+  guint n_slices;
+
+  GMutex lock;
+  GCond done;
+  guint remaining;
+} SliceJob;
+
+typedef struct
+{
+  SliceJob *job;
+  guint slice;
+} SliceTask;
+
+static void
+slice_worker (gpointer data, gpointer user_data)
+{
+  SliceTask *task = data;
+  SliceJob *job = task->job;
+
+  job->func (job->data, task->slice, job->n_slices);
+
+  g_mutex_lock (&job->lock);
+  if (--job->remaining == 0)
+    g_cond_signal (&job->done);
+  g_mutex_unlock (&job->lock);
+}
+
+StillReplaceSlicePool *
+stillreplace_slice_pool_new (guint n_threads)
+{
+  StillReplaceSlicePool *pool = g_new0 (StillReplaceSlicePool, 1);
+
+  pool->refcount = 1;
+  pool->n_threads = MAX (n_threads, 1);
+  if (pool->n_threads > 1) {
+    GError *error = NULL;
+
+    pool->workers = g_thread_pool_new (slice_worker, NULL,
+        pool->n_threads - 1, TRUE, &error);
+    if (pool->workers == NULL) {
+      g_warning ("could not start slice workers: %s", error->message);
+      g_clear_error (&error);
+      pool->n_threads = 1;
+    }
+  }
+  return pool;
+}
+
+/* Pools are shared by everything running jobs on them, the workers stop
+ * when the last reference is dropped. Both accept NULL. */
+StillReplaceSlicePool *
+stillreplace_slice_pool_ref (StillReplaceSlicePool * pool)
+{
+  if (pool)
+    g_atomic_int_inc (&pool->refcount);
+  return pool;
+}
+
+void
+stillreplace_slice_pool_unref (StillReplaceSlicePool * pool)
+{
+  if (pool == NULL || !g_atomic_int_dec_and_test (&pool->refcount))
+    return;
+  if (pool->workers)
+    g_thread_pool_free (pool->workers, FALSE, TRUE);
+  g_free (pool);
+}
+
+guint
+stillreplace_slice_pool_get_n_threads (StillReplaceSlicePool * pool)
+{
+  return pool ? pool->n_threads : 1;
+}
+
+/* Amount of slices to split @rows rows of work into */
+guint
+stillreplace_slice_pool_n_slices (StillReplaceSlicePool * pool, guint64 rows)
+{
+  guint64 n = stillreplace_slice_pool_get_n_threads (pool);
+
+  n = MIN (n, rows / STILLREPLACE_MIN_SLICE_ROWS);
+  return MAX (n, 1);
+}
+
+/* Run @func on @n_slices slices and return once all of them are done.
+ * Without a pool, or with a single slice, everything runs on the calling
+ * thread. */
+void
+stillreplace_slice_pool_run (StillReplaceSlicePool * pool,
+    StillReplaceSliceFunc func, gpointer data, guint n_slices)
+{
+  SliceJob job;
+  SliceTask *tasks;
+  guint i;
+
+  if (n_slices == 0)
+    return;
+  if (pool == NULL || pool->workers == NULL || n_slices == 1) {
+    for (i = 0; i < n_slices; ++i)
+      func (data, i, n_slices);
+    return;
+  }
+
+  job.func = func;
+  job.data = data;
+  job.n_slices = n_slices;
+  job.remaining = n_slices - 1;
+  g_mutex_init (&job.lock);
+  g_cond_init (&job.done);
+
+  tasks = g_newa (SliceTask, n_slices);
+  for (i = 1; i < n_slices; ++i) {
+    tasks[i].job = &job;
+    tasks[i].slice = i;
+    g_thread_pool_push (pool->workers, &tasks[i], NULL);
+  }
+
+  func (data, 0, n_slices);
+
+  g_mutex_lock (&job.lock);
+  while (job.remaining > 0)
+    g_cond_wait (&job.done, &job.lock);
+  g_mutex_unlock (&job.lock);
+
+  g_cond_clear (&job.done);
+  g_mutex_clear (&job.lock);
+}
@@ -0,0 +1,54 @@
+/*
+ * GStreamer
+ * Copyright (C) 2019 Yves De Muyter <yves@alfavisio.be>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __GST_STILLREPLACESLICES_H__
+#define __GST_STILLREPLACESLICES_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Persistent set of worker threads splitting a job into slices. The
+ * calling thread always runs slice 0 itself, so a pool of n threads only
+ * starts n - 1 workers. Several threads may run jobs on the same pool at
+ * once, their slices are queued to the same workers. */
+typedef struct _StillReplaceSlicePool StillReplaceSlicePool;
+
+/* Slices handed to the workers are at least this many rows high */
+#define STILLREPLACE_MIN_SLICE_ROWS 32
+
+/* Process slice @slice out of @n_slices of the job described by @data */
+typedef void (*StillReplaceSliceFunc) (gpointer data, guint slice,
+    guint n_slices);
+
+StillReplaceSlicePool *stillreplace_slice_pool_new (guint n_threads);
+StillReplaceSlicePool *stillreplace_slice_pool_ref (StillReplaceSlicePool *
+    pool);
+void stillreplace_slice_pool_unref (StillReplaceSlicePool * pool);
+guint stillreplace_slice_pool_get_n_threads (StillReplaceSlicePool * pool);
+guint stillreplace_slice_pool_n_slices (StillReplaceSlicePool * pool,
+    guint64 rows);
+
+void stillreplace_slice_pool_run (StillReplaceSlicePool * pool,
+    StillReplaceSliceFunc func, gpointer data, guint n_slices);
+
+G_END_DECLS
+
+#endif /* __GST_STILLREPLACESLICES_H__ */
@@ -0,0 +1,468 @@
+/*
+ * GStreamer
+ * Copyright (C) 2019 Yves De Muyter <yves@alfavisio.be>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* End-to-end tests of the element: synthetic main and replacement streams
+ * go through GstHarness, and the frames coming out are checked. Pictures
+ * are flat, so their luma tells which frame came out.
+ *
+ * A hang in the replacesink handoff shows up as a test timeout. Every test
+ * also prints the frames per second and the worst time from pushing a
+ * frame to pulling it out, as one JSON object per test like the
+ * benchmark does. */
+
+#include <gst/check/gstcheck.h>
+#include <gst/check/gstharness.h>
+#include <string.h>
+
+#define WIDTH 1280
+#define HEIGHT 720
+#define FRAME_SIZE (WIDTH * HEIGHT * 3 / 2)
+#define FPS 25
+#define CAPS "video/x-raw,format=I420,width=1280,height=720,framerate=25/1"
+#define N_FRAMES 100
+
+/* Luma of the ident, of the programme around it and of the replacement.
+ * The programme and the replacement add the frame number modulo 8, so a
+ * frame coming out of order is noticed. */
+#define IDENT_LUMA 200
+#define PROGRAMME_LUMA 40
+#define REPLACEMENT_LUMA 100
+
+#define FRAME_PTS(n) gst_util_uint64_scale_int ((n), GST_SECOND, FPS)
+
+typedef struct
+{
+  const gchar *name;
+  guint frames;
+  gint64 start;
+  gint64 worst;                 /* longest push to pull, in us */
+} Measure;
+
+static void
+measure_start (Measure * m, const gchar * name)
+{
+  m->name = name;
+  m->frames = 0;
+  m->worst = 0;
+  m->start = g_get_monotonic_time ();
+}
+
+static void
+measure_report (Measure * m)
+{
+  gint64 elapsed = MAX (g_get_monotonic_time () - m->start, 1);
+
+  g_print ("{\"test\":\"%s\",\"frames\":%u,\"frames_per_s\":%.1f,"
+      "\"max_latency_us\":%" G_GINT64_FORMAT "}\n", m->name, m->frames,
+      m->frames * (gdouble) G_USEC_PER_SEC / elapsed, m->worst);
+}
+
+static GstBuffer *
+make_frame (guint8 luma, guint n)
+{
+  GstBuffer *buf = gst_buffer_new_allocate (NULL, FRAME_SIZE, NULL);
+  GstMapInfo map;
+
+  fail_unless (gst_buffer_map (buf, &map, GST_MAP_WRITE));
+  memset (map.data, luma, WIDTH * HEIGHT);
+  memset (map.data + WIDTH * HEIGHT, 128, FRAME_SIZE - WIDTH * HEIGHT);
+  gst_buffer_unmap (buf, &map);
+  GST_BUFFER_PTS (buf) = FRAME_PTS (n);
+  GST_BUFFER_DURATION (buf) = FRAME_PTS (1);
+  return buf;
+}
+
+/* Pull the next frame and check it shows @luma at @pts */
+static void
+pull_frame (GstHarness * h, guint8 luma, guint n)
+{
+  GstBuffer *buf = gst_harness_pull (h);
+  GstMapInfo map;
+
+  fail_unless (buf != NULL);
+  fail_unless (gst_buffer_map (buf, &map, GST_MAP_READ));
+  fail_unless_equals_int (map.data[0], luma);
+  fail_unless_equals_int (map.data[WIDTH * HEIGHT - 1], luma);
+  gst_buffer_unmap (buf, &map);
+  fail_unless_equals_uint64 (GST_BUFFER_PTS (buf), FRAME_PTS (n));
+  gst_buffer_unref (buf);
+}
+
+/* Push frame @n showing @luma and check @expected comes out. @m, when set,
+ * gets the time it took. */
+static void
+run_frame (GstHarness * h, Measure * m, guint8 luma, guint n, guint8 expected)
+{
+  gint64 start = g_get_monotonic_time ();
+
+  fail_unless_equals_int (gst_harness_push (h, make_frame (luma, n)),
+      GST_FLOW_OK);
+  pull_frame (h, expected, n);
+  if (m) {
+    m->worst = MAX (m->worst, g_get_monotonic_time () - start);
+    m->frames++;
+  }
+}
+
+/* The main stream, its first frame becomes the reference of ident 0 and
+ * goes out untouched */
+static GstHarness *
+setup_main (void)
+{
+  GstHarness *h =
+      gst_harness_new_with_padnames ("stillreplacefilter", "sink", "src");
+
+  gst_harness_set_src_caps_str (h, CAPS);
+  run_frame (h, NULL, IDENT_LUMA, 0, IDENT_LUMA);
+  return h;
+}
+
+static GstHarness *
+setup_replacement (GstHarness * h)
+{
+  GstHarness *r = gst_harness_new_with_element (h->element, "replacesink",
+      NULL);
+
+  gst_harness_set_src_caps_str (r, CAPS);
+  return r;
+}
+
+static guint64
+stats_field (GstHarness * h, const gchar * field)
+{
+  GstStructure *stats;
+  guint64 value = 0;
+
+  g_object_get (h->element, "stats", &stats, NULL);
+  fail_unless (gst_structure_get_uint64 (stats, field, &value));
+  gst_structure_free (stats);
+  return value;
+}
+
+/* Push on another thread, for pushes expected to wait in the element */
+typedef struct
+{
+  GstHarness *h;
+  GstBuffer *buf;
+  GstFlowReturn ret;
+} PushJob;
+
+static gpointer
+push_func (gpointer data)
+{
+  PushJob *job = data;
+
+  job->ret = gst_harness_push (job->h, job->buf);
+  return NULL;
+}
+
+static GThread *
+push_async (PushJob * job, GstHarness * h, GstBuffer * buf)
+{
+  job->h = h;
+  job->buf = buf;
+  job->ret = GST_FLOW_ERROR;
+  return g_thread_new ("push", push_func, job);
+}
+
+GST_START_TEST (test_match)
+{
+  GstHarness *h = setup_main ();
+  GstHarness *r = setup_replacement (h);
+  Measure m;
+  guint n;
+
+  measure_start (&m, "match");
+  for (n = 1; n <= N_FRAMES; ++n) {
+    fail_unless_equals_int (gst_harness_push (r,
+            make_frame (REPLACEMENT_LUMA + n % 8, n)), GST_FLOW_OK);
+    run_frame (h, &m, IDENT_LUMA, n, REPLACEMENT_LUMA + n % 8);
+  }
+  measure_report (&m);
+  fail_unless_equals_uint64 (stats_field (h, "matches"), N_FRAMES);
+
+  gst_harness_teardown (r);
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_no_match)
+{
+  GstHarness *h = setup_main ();
+  GstHarness *r = setup_replacement (h);
+  Measure m;
+  guint n;
+
+  /* never taken, the programme doesn't show the ident */
+  fail_unless_equals_int (gst_harness_push (r, make_frame (REPLACEMENT_LUMA,
+              0)), GST_FLOW_OK);
+  measure_start (&m, "no-match");
+  for (n = 1; n <= N_FRAMES; ++n)
+    run_frame (h, &m, PROGRAMME_LUMA + n % 8, n, PROGRAMME_LUMA + n % 8);
+  measure_report (&m);
+  fail_unless_equals_uint64 (stats_field (h, "misses"), N_FRAMES);
+
+  /* the ident coming back takes the queued replacement */
+  run_frame (h, NULL, IDENT_LUMA, n, REPLACEMENT_LUMA);
+
+  gst_harness_teardown (r);
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_coarse)
+{
+  GstHarness *h = setup_main ();
+  GstHarness *r = setup_replacement (h);
+  GstBuffer *buf;
+  GstMapInfo map;
+  Measure m;
+  guint n, y;
+
+  g_object_set (h->element, "coarse-row-step", 4, "coarse-column-step", 4,
+      NULL);
+
+  /* the programme is already told apart by the sparse grid */
+  measure_start (&m, "coarse");
+  for (n = 1; n <= N_FRAMES; ++n) {
+    if (n % 2) {
+      fail_unless_equals_int (gst_harness_push (r,
+              make_frame (REPLACEMENT_LUMA + n % 8, n)), GST_FLOW_OK);
+      run_frame (h, &m, IDENT_LUMA, n, REPLACEMENT_LUMA + n % 8);
+    } else {
+      run_frame (h, &m, PROGRAMME_LUMA + n % 8, n, PROGRAMME_LUMA + n % 8);
+    }
+  }
+  measure_report (&m);
+  fail_unless_equals_uint64 (stats_field (h, "matches"), N_FRAMES / 2);
+  fail_unless_equals_uint64 (stats_field (h, "coarse-rejects"), N_FRAMES / 2);
+
+  /* a frame differing only between the grid rows passes the coarse stage
+   * and is still rejected by the full compare */
+  buf = make_frame (IDENT_LUMA, n);
+  fail_unless (gst_buffer_map (buf, &map, GST_MAP_WRITE));
+  for (y = 2; y < HEIGHT; y += 4)
+    memset (map.data + y * WIDTH, PROGRAMME_LUMA, WIDTH);
+  gst_buffer_unmap (buf, &map);
+  fail_unless_equals_int (gst_harness_push (h, buf), GST_FLOW_OK);
+  pull_frame (h, IDENT_LUMA, n);
+  fail_unless_equals_uint64 (stats_field (h, "misses"), N_FRAMES / 2 + 1);
+  fail_unless_equals_uint64 (stats_field (h, "coarse-rejects"), N_FRAMES / 2);
+
+  gst_harness_teardown (r);
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_unlinked_replacesink)
+{
+  GstHarness *h = setup_main ();
+  Measure m;
+  guint n;
+
+  /* nothing to replace with, matched frames go out as they are instead of
+   * waiting */
+  measure_start (&m, "unlinked-replacesink");
+  for (n = 1; n <= N_FRAMES; ++n)
+    run_frame (h, &m, n % 2 ? IDENT_LUMA : PROGRAMME_LUMA, n,
+        n % 2 ? IDENT_LUMA : PROGRAMME_LUMA);
+  measure_report (&m);
+  fail_unless_equals_uint64 (stats_field (h, "matches"), N_FRAMES / 2);
+
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_eos)
+{
+  GstHarness *h = setup_main ();
+  GstHarness *r = setup_replacement (h);
+  GstEvent *event;
+  gboolean eos = FALSE;
+  Measure m;
+  guint n;
+
+  measure_start (&m, "eos");
+  for (n = 1; n <= N_FRAMES; ++n) {
+    fail_unless_equals_int (gst_harness_push (r,
+            make_frame (REPLACEMENT_LUMA + n % 8, n)), GST_FLOW_OK);
+    run_frame (h, &m, IDENT_LUMA, n, REPLACEMENT_LUMA + n % 8);
+  }
+  measure_report (&m);
+
+  /* EOS goes downstream, and the replacement stream is told it is done */
+  fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+  while ((event = gst_harness_try_pull_event (h))) {
+    eos |= GST_EVENT_TYPE (event) == GST_EVENT_EOS;
+    gst_event_unref (event);
+  }
+  fail_unless (eos);
+  fail_unless_equals_int (gst_harness_push (r, make_frame (REPLACEMENT_LUMA,
+              n)), GST_FLOW_EOS);
+
+  gst_harness_teardown (r);
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_replacesink_eos)
+{
+  GstHarness *h = setup_main ();
+  GstHarness *r = setup_replacement (h);
+  GstEvent *event;
+  PushJob job;
+  GThread *thread;
+  Measure m;
+  guint n = 1;
+
+  fail_unless_equals_int (gst_harness_push (r, make_frame (REPLACEMENT_LUMA,
+              n)), GST_FLOW_OK);
+  run_frame (h, NULL, IDENT_LUMA, n, REPLACEMENT_LUMA);
+
+  /* a match waiting for the next replacement gets the last one when the
+   * replacement stream ends */
+  ++n;
+  thread = push_async (&job, h, make_frame (IDENT_LUMA, n));
+  g_usleep (G_USEC_PER_SEC / 20);
+  fail_unless (gst_harness_push_event (r, gst_event_new_eos ()));
+  g_thread_join (thread);
+  fail_unless_equals_int (job.ret, GST_FLOW_OK);
+  pull_frame (h, REPLACEMENT_LUMA, n);
+
+  /* and so do all later ones, without waiting; the main stream goes on */
+  measure_start (&m, "replacesink-eos");
+  for (++n; n <= N_FRAMES; ++n)
+    run_frame (h, &m, IDENT_LUMA, n, REPLACEMENT_LUMA);
+  measure_report (&m);
+  while ((event = gst_harness_try_pull_event (h))) {
+    fail_if (GST_EVENT_TYPE (event) == GST_EVENT_EOS);
+    gst_event_unref (event);
+  }
+
+  gst_harness_teardown (r);
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_flush)
+{
+  GstHarness *h = setup_main ();
+  GstHarness *r = setup_replacement (h);
+  GstBuffer *buf;
+  GstSegment segment;
+  PushJob job;
+  GThread *thread;
+  Measure m;
+  guint n = 1;
+
+  fail_unless_equals_int (gst_harness_push (r, make_frame (REPLACEMENT_LUMA,
+              n)), GST_FLOW_OK);
+  run_frame (h, NULL, IDENT_LUMA, n, REPLACEMENT_LUMA);
+
+  /* a flush wakes a match waiting for its replacement */
+  ++n;
+  thread = push_async (&job, h, make_frame (IDENT_LUMA, n));
+  g_usleep (G_USEC_PER_SEC / 20);
+  fail_unless (gst_harness_push_event (h, gst_event_new_flush_start ()));
+  g_thread_join (thread);
+  fail_unless_equals_int (job.ret, GST_FLOW_FLUSHING);
+  fail_unless (gst_harness_push_event (h, gst_event_new_flush_stop (TRUE)));
+  gst_segment_init (&segment, GST_FORMAT_TIME);
+  fail_unless (gst_harness_push_event (h, gst_event_new_segment (&segment)));
+  while ((buf = gst_harness_try_pull (h)))
+    gst_buffer_unref (buf);
+
+  /* and both streams carry on after it */
+  measure_start (&m, "flush");
+  for (++n; n <= N_FRAMES; ++n) {
+    fail_unless_equals_int (gst_harness_push (r,
+            make_frame (REPLACEMENT_LUMA + n % 8, n)), GST_FLOW_OK);
+    run_frame (h, &m, IDENT_LUMA, n, REPLACEMENT_LUMA + n % 8);
+  }
+  measure_report (&m);
+
+  gst_harness_teardown (r);
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+/* A replacement pushed as it is keeps only its memory, the metas are those
+ * of the input frame */
+GST_START_TEST (test_replacement_metas)
+{
+  GstHarness *h = setup_main ();
+  GstHarness *r = setup_replacement (h);
+  GstCaps *input_ref = gst_caps_new_empty_simple ("timestamp/x-input");
+  GstCaps *replacement_ref =
+      gst_caps_new_empty_simple ("timestamp/x-replacement");
+  GstBuffer *buf;
+  GstReferenceTimestampMeta *meta;
+
+  buf = make_frame (REPLACEMENT_LUMA, 1);
+  gst_buffer_add_reference_timestamp_meta (buf, replacement_ref, 1, 0);
+  fail_unless_equals_int (gst_harness_push (r, buf), GST_FLOW_OK);
+  buf = make_frame (IDENT_LUMA, 1);
+  gst_buffer_add_reference_timestamp_meta (buf, input_ref, 2, 0);
+  fail_unless_equals_int (gst_harness_push (h, buf), GST_FLOW_OK);
+
+  buf = gst_harness_pull (h);
+  fail_unless (buf != NULL);
+  meta = gst_buffer_get_reference_timestamp_meta (buf, NULL);
+  fail_unless (meta != NULL);
+  fail_unless (gst_caps_is_equal (meta->reference, input_ref));
+  fail_unless (gst_buffer_get_reference_timestamp_meta (buf,
+          replacement_ref) == NULL);
+  gst_buffer_unref (buf);
+
+  gst_caps_unref (input_ref);
+  gst_caps_unref (replacement_ref);
+  gst_harness_teardown (r);
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+static Suite *
+stillreplacefilter_suite (void)
+{
+  Suite *s = suite_create ("stillreplacefilter");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_match);
+  tcase_add_test (tc_chain, test_no_match);
+  tcase_add_test (tc_chain, test_coarse);
+  tcase_add_test (tc_chain, test_unlinked_replacesink);
+  tcase_add_test (tc_chain, test_eos);
+  tcase_add_test (tc_chain, test_replacesink_eos);
+  tcase_add_test (tc_chain, test_flush);
+  tcase_add_test (tc_chain, test_replacement_metas);
+
+  return s;
+}
+
+GST_CHECK_MAIN (stillreplacefilter);
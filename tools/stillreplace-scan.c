@@ -0,0 +1,503 @@
+/*
+ * GStreamer
+ * Copyright (C) 2019 Yves De Muyter <yves@alfavisio.be>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Offline ident scanner.
+ *
+ * Finds where a reference still shows up in a recorded file, using the
+ * same compare as the stillreplacefilter element. The reference is a file
+ * written by the element's save-reference action, so it already holds the
+ * format, size and the rects the element compared.
+ *
+ * The file is split into --jobs chunks of equal duration, every chunk is
+ * decoded by its own pipeline, seeked to its start and running unsynced.
+ * Matching frames are gathered into intervals, which are joined across
+ * chunk boundaries and written as JSON or CSV with their start and end in
+ * seconds and the lowest and mean psnr of their frames.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "gststillreplacematch.h"
+#include "gststillreplaceref.h"
+
+/* Reported psnr of frames identical to the reference */
+#define MAX_PSNR 100.0
+
+typedef struct
+{
+  GstClockTime start, end;
+  guint64 frames;
+  gdouble min_psnr, psnr_sum;
+} ScanInterval;
+
+/* One part of the file, scanned on its own thread */
+typedef struct
+{
+  const gchar *location;
+  const StillReplaceRefFile *ref;
+  GstVideoFormat format;
+  guint64 budget;
+  GstClockTime start, stop;     /* scanned range, NONE for the whole file */
+
+  GstVideoInfo info;
+  gboolean have_info;
+  gboolean open;                /* the last interval is still growing */
+  GArray *intervals;            /* ScanIntervals in stream order */
+  gchar *error;
+} ScanChunk;
+
+static GstElement *
+make_pipeline (const gchar * location, const StillReplaceRefFile * ref,
+    GstVideoFormat format, GError ** error)
+{
+  GstElement *pipeline, *src, *capsfilter;
+  GstCaps *caps;
+
+  pipeline = gst_parse_launch ("filesrc name=src ! decodebin ! videoconvert ! "
+      "videoscale ! capsfilter name=filter ! "
+      "fakesink name=sink sync=false signal-handoffs=true", error);
+  if (pipeline == NULL)
+    return NULL;
+
+  caps = gst_caps_new_simple ("video/x-raw",
+      "format", G_TYPE_STRING, gst_video_format_to_string (format),
+      "width", G_TYPE_INT, ref->width, "height", G_TYPE_INT, ref->height,
+      NULL);
+  src = gst_bin_get_by_name (GST_BIN (pipeline), "src");
+  capsfilter = gst_bin_get_by_name (GST_BIN (pipeline), "filter");
+  g_object_set (src, "location", location, NULL);
+  g_object_set (capsfilter, "caps", caps, NULL);
+  gst_caps_unref (caps);
+  gst_object_unref (src);
+  gst_object_unref (capsfilter);
+  return pipeline;
+}
+
+static void
+chunk_add_frame (ScanChunk * chunk, GstClockTime pts, GstClockTime duration,
+    gboolean matched, gdouble psnr)
+{
+  ScanInterval *last;
+
+  if (!matched) {
+    chunk->open = FALSE;
+    return;
+  }
+  if (!chunk->open) {
+    ScanInterval interval = { pts, pts, 0, psnr, 0 };
+
+    g_array_append_val (chunk->intervals, interval);
+    chunk->open = TRUE;
+  }
+  last = &g_array_index (chunk->intervals, ScanInterval,
+      chunk->intervals->len - 1);
+  last->end = pts + duration;
+  last->frames++;
+  last->min_psnr = MIN (last->min_psnr, psnr);
+  last->psnr_sum += psnr;
+}
+
+/* Whether frames of @info have the pixel layout @ref was taken with and
+ * hold its whole area, so the compare never reads outside a plane */
+static gboolean
+frame_fits_reference (const GstVideoInfo * info,
+    const StillReplaceRefFile * ref)
+{
+  const StillReplaceRefData *data = &ref->data;
+  StillReplaceSampleFormat sample;
+  guint pstride, width, height;
+
+  if (ref->comp >= GST_VIDEO_INFO_N_COMPONENTS (info))
+    return FALSE;
+  width = GST_VIDEO_INFO_COMP_WIDTH (info, ref->comp);
+  height = GST_VIDEO_INFO_COMP_HEIGHT (info, ref->comp);
+  if (GST_VIDEO_INFO_FORMAT (info) == GST_VIDEO_FORMAT_v210) {
+    sample = STILLREPLACE_SAMPLE_V210;
+    pstride = STILLREPLACE_V210_GROUP_BYTES;
+    width = (width + STILLREPLACE_V210_GROUP_PIXELS - 1) /
+        STILLREPLACE_V210_GROUP_PIXELS;
+  } else {
+    sample = GST_VIDEO_INFO_COMP_DEPTH (info, ref->comp) > 8 ?
+        STILLREPLACE_SAMPLE_16 : STILLREPLACE_SAMPLE_8;
+    pstride = GST_VIDEO_INFO_COMP_PSTRIDE (info, ref->comp);
+  }
+  return sample == data->sample && pstride == data->pstride
+      && (guint64) data->area.x + data->area.width <= width
+      && (guint64) data->area.y + data->area.height <= height;
+}
+
+static void
+on_handoff (GstElement * sink, GstBuffer * buf, GstPad * pad,
+    ScanChunk * chunk)
+{
+  const StillReplaceRefData *ref = &chunk->ref->data;
+  GstClockTime pts = GST_BUFFER_PTS (buf);
+  GstClockTime duration = GST_BUFFER_DURATION (buf);
+  StillReplaceCompareResult result;
+  GstVideoFrame frame;
+  gdouble best = 0;
+  gboolean matched;
+  guint plane, lane, n_lanes;
+
+  if (!chunk->have_info) {
+    GstCaps *caps = gst_pad_get_current_caps (pad);
+
+    chunk->have_info = caps && gst_video_info_from_caps (&chunk->info, caps);
+    if (caps)
+      gst_caps_unref (caps);
+    if (!chunk->have_info)
+      return;
+    if (!frame_fits_reference (&chunk->info, chunk->ref)) {
+      /* ends the chunk with the error */
+      GST_ELEMENT_ERROR (sink, STREAM, FORMAT, (NULL),
+          ("Decoded %s frames don't fit the reference layout",
+              GST_VIDEO_INFO_NAME (&chunk->info)));
+      chunk->have_info = FALSE;
+      return;
+    }
+  }
+  /* accurate seeks may still let a frame before the chunk through */
+  if (!GST_CLOCK_TIME_IS_VALID (pts)
+      || (GST_CLOCK_TIME_IS_VALID (chunk->start) && pts < chunk->start)
+      || (GST_CLOCK_TIME_IS_VALID (chunk->stop) && pts >= chunk->stop))
+    return;
+  if (!GST_CLOCK_TIME_IS_VALID (duration))
+    duration = chunk->info.fps_n > 0 ? gst_util_uint64_scale_int (GST_SECOND,
+        chunk->info.fps_d, chunk->info.fps_n) : 0;
+
+  if (!gst_video_frame_map (&frame, &chunk->info, buf, GST_MAP_READ))
+    return;
+  plane = GST_VIDEO_FRAME_COMP_PLANE (&frame, chunk->ref->comp);
+  /* rows of the area must be inside the mapped plane */
+  if (GST_VIDEO_FRAME_PLANE_STRIDE (&frame, plane) <= 0
+      || (gsize) (ref->area.x + ref->area.width) * ref->pstride >
+      (gsize) GST_VIDEO_FRAME_PLANE_STRIDE (&frame, plane)) {
+    gst_video_frame_unmap (&frame);
+    return;
+  }
+  matched = stillreplace_ref_compare (NULL, ref,
+      GST_VIDEO_FRAME_PLANE_DATA (&frame, plane),
+      GST_VIDEO_FRAME_PLANE_STRIDE (&frame, plane), chunk->ref->rects,
+      chunk->ref->n_rects, chunk->budget, &result);
+  gst_video_frame_unmap (&frame);
+
+  n_lanes = stillreplace_match_n_lanes (ref->sample, ref->pstride);
+  for (lane = 0; lane < n_lanes && matched; ++lane) {
+    if ((ref->lane_mask & (1 << lane)) && result.sums[lane] <=
+        result.limits[lane])
+      best = MAX (best, MIN (stillreplace_ref_psnr (result.sums[lane],
+                  result.samples, ref->depth), MAX_PSNR));
+  }
+  chunk_add_frame (chunk, pts, duration, matched, best);
+}
+
+static gpointer
+scan_chunk (ScanChunk * chunk)
+{
+  GError *error = NULL;
+  GstElement *pipeline, *sink;
+  GstMessage *msg;
+  GstBus *bus;
+
+  pipeline = make_pipeline (chunk->location, chunk->ref, chunk->format,
+      &error);
+  if (pipeline == NULL) {
+    chunk->error = g_strdup (error ? error->message : "unknown error");
+    g_clear_error (&error);
+    return NULL;
+  }
+  g_clear_error (&error);
+  sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+  g_signal_connect (sink, "handoff", G_CALLBACK (on_handoff), chunk);
+  gst_object_unref (sink);
+
+  if (GST_CLOCK_TIME_IS_VALID (chunk->start)) {
+    gst_element_set_state (pipeline, GST_STATE_PAUSED);
+    if (gst_element_get_state (pipeline, NULL, NULL,
+            GST_CLOCK_TIME_NONE) == GST_STATE_CHANGE_FAILURE
+        || !gst_element_seek (pipeline, 1.0, GST_FORMAT_TIME,
+            GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_ACCURATE, GST_SEEK_TYPE_SET,
+            chunk->start, GST_CLOCK_TIME_IS_VALID (chunk->stop) ?
+            GST_SEEK_TYPE_SET : GST_SEEK_TYPE_NONE, chunk->stop)) {
+      chunk->error = g_strdup_printf ("Could not seek to %" GST_TIME_FORMAT,
+          GST_TIME_ARGS (chunk->start));
+      gst_element_set_state (pipeline, GST_STATE_NULL);
+      gst_object_unref (pipeline);
+      return NULL;
+    }
+  }
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+
+  bus = gst_element_get_bus (pipeline);
+  msg = gst_bus_timed_pop_filtered (bus, GST_CLOCK_TIME_NONE,
+      GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  if (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_ERROR) {
+    gst_message_parse_error (msg, &error, NULL);
+    chunk->error = g_strdup (error->message);
+    g_clear_error (&error);
+  }
+  gst_message_unref (msg);
+  gst_object_unref (bus);
+
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (pipeline);
+  return NULL;
+}
+
+/* Duration of the file, or NONE when it can't be split into chunks */
+static GstClockTime
+probe_duration (const gchar * location, const StillReplaceRefFile * ref,
+    GstVideoFormat format)
+{
+  GstElement *pipeline = make_pipeline (location, ref, format, NULL);
+  gint64 duration = -1;
+
+  if (pipeline == NULL)
+    return GST_CLOCK_TIME_NONE;
+  gst_element_set_state (pipeline, GST_STATE_PAUSED);
+  if (gst_element_get_state (pipeline, NULL, NULL,
+          GST_CLOCK_TIME_NONE) != GST_STATE_CHANGE_FAILURE)
+    gst_element_query_duration (pipeline, GST_FORMAT_TIME, &duration);
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (pipeline);
+  return duration > 0 ? (GstClockTime) duration : GST_CLOCK_TIME_NONE;
+}
+
+/* Join the intervals of all chunks, an interval continues into the next
+ * chunk when it starts within half a frame of where the previous ended */
+static GArray *
+merge_intervals (ScanChunk * chunks, guint n_chunks)
+{
+  GArray *merged = g_array_new (FALSE, FALSE, sizeof (ScanInterval));
+  guint c, i;
+
+  for (c = 0; c < n_chunks; ++c) {
+    GstClockTime tolerance = GST_MSECOND;
+
+    if (chunks[c].have_info && chunks[c].info.fps_n > 0)
+      tolerance = gst_util_uint64_scale_int (GST_SECOND / 2,
+          chunks[c].info.fps_d, chunks[c].info.fps_n);
+    for (i = 0; i < chunks[c].intervals->len; ++i) {
+      ScanInterval *interval =
+          &g_array_index (chunks[c].intervals, ScanInterval, i);
+      ScanInterval *last = merged->len ? &g_array_index (merged, ScanInterval,
+          merged->len - 1) : NULL;
+
+      if (last && interval->start <= last->end + tolerance) {
+        last->end = MAX (last->end, interval->end);
+        last->frames += interval->frames;
+        last->min_psnr = MIN (last->min_psnr, interval->min_psnr);
+        last->psnr_sum += interval->psnr_sum;
+      } else {
+        g_array_append_val (merged, *interval);
+      }
+    }
+  }
+  return merged;
+}
+
+static void
+write_json_string (FILE * out, const gchar * str)
+{
+  fputc ('"', out);
+  for (; *str; ++str) {
+    if (*str == '"' || *str == '\\')
+      fprintf (out, "\\%c", *str);
+    else if ((guchar) * str < 0x20)
+      fprintf (out, "\\u%04x", (guchar) * str);
+    else
+      fputc (*str, out);
+  }
+  fputc ('"', out);
+}
+
+static void
+write_intervals (FILE * out, gboolean csv, const gchar * location,
+    const gchar * reference, guint psnr, GArray * intervals)
+{
+  guint i;
+
+  if (csv) {
+    fprintf (out, "start,end,frames,min_psnr,mean_psnr\n");
+    for (i = 0; i < intervals->len; ++i) {
+      ScanInterval *interval = &g_array_index (intervals, ScanInterval, i);
+      fprintf (out, "%.3f,%.3f,%" G_GUINT64_FORMAT ",%.2f,%.2f\n",
+          (gdouble) interval->start / GST_SECOND,
+          (gdouble) interval->end / GST_SECOND, interval->frames,
+          interval->min_psnr, interval->psnr_sum / interval->frames);
+    }
+    return;
+  }
+
+  fprintf (out, "{\"file\":");
+  write_json_string (out, location);
+  fprintf (out, ",\"reference\":");
+  write_json_string (out, reference);
+  fprintf (out, ",\"psnr\":%u,\"matches\":[", psnr);
+  for (i = 0; i < intervals->len; ++i) {
+    ScanInterval *interval = &g_array_index (intervals, ScanInterval, i);
+    fprintf (out, "%s\n  {\"start\":%.3f,\"end\":%.3f,\"frames\":%"
+        G_GUINT64_FORMAT ",\"min_psnr\":%.2f,\"mean_psnr\":%.2f}",
+        i ? "," : "", (gdouble) interval->start / GST_SECOND,
+        (gdouble) interval->end / GST_SECOND, interval->frames,
+        interval->min_psnr, interval->psnr_sum / interval->frames);
+  }
+  fprintf (out, "\n]}\n");
+}
+
+int
+main (int argc, char *argv[])
+{
+  gchar *reference = NULL, *output = NULL, *output_format = NULL;
+  gint psnr = 40;
+  gint jobs = 0;
+  GOptionEntry entries[] = {
+    {"reference", 'r', 0, G_OPTION_ARG_FILENAME, &reference,
+        "Reference file written by the save-reference action", "FILE"},
+    {"psnr", 'p', 0, G_OPTION_ARG_INT, &psnr,
+        "Match threshold, as the psnr property", "DB"},
+    {"jobs", 'j', 0, G_OPTION_ARG_INT, &jobs,
+        "Chunks scanned in parallel (0 = one per core)", "N"},
+    {"output-format", 'f', 0, G_OPTION_ARG_STRING, &output_format,
+        "json (default) or csv", "FORMAT"},
+    {"output", 'o', 0, G_OPTION_ARG_FILENAME, &output,
+        "File to write the matches to instead of stdout", "FILE"},
+    {NULL}
+  };
+  GOptionContext *ctx;
+  GError *error = NULL;
+  GMappedFile *mapped;
+  StillReplaceRefFile ref;
+  GstVideoFormat format;
+  GstClockTime duration;
+  ScanChunk *chunks;
+  GThread **threads;
+  GArray *intervals;
+  gboolean csv = FALSE;
+  FILE *out = stdout;
+  gint ret = 0;
+  guint c;
+
+  ctx = g_option_context_new ("FILE - find a reference still in a recording");
+  g_option_context_add_main_entries (ctx, entries, NULL);
+  g_option_context_add_group (ctx, gst_init_get_option_group ());
+  if (!g_option_context_parse (ctx, &argc, &argv, &error)) {
+    g_printerr ("%s\n", error->message);
+    g_clear_error (&error);
+    g_option_context_free (ctx);
+    return 1;
+  }
+  g_option_context_free (ctx);
+  if (argc != 2 || reference == NULL) {
+    g_printerr ("Usage: %s --reference FILE [OPTION...] FILE\n", argv[0]);
+    return 1;
+  }
+  if (output_format && g_ascii_strcasecmp (output_format, "csv") == 0)
+    csv = TRUE;
+  else if (output_format && g_ascii_strcasecmp (output_format, "json") != 0) {
+    g_printerr ("Unknown output format %s\n", output_format);
+    return 1;
+  }
+
+  stillreplace_match_init ();
+
+  mapped = g_mapped_file_new (reference, FALSE, &error);
+  if (mapped == NULL) {
+    g_printerr ("Could not map reference %s: %s\n", reference, error->message);
+    g_clear_error (&error);
+    return 1;
+  }
+  if (!stillreplace_ref_file_parse (g_mapped_file_get_contents (mapped),
+          g_mapped_file_get_length (mapped), &ref)
+      || (format = gst_video_format_from_string (ref.format)) ==
+      GST_VIDEO_FORMAT_UNKNOWN) {
+    g_printerr ("%s is not a reference file\n", reference);
+    stillreplace_ref_file_clear (&ref);
+    g_mapped_file_unref (mapped);
+    return 1;
+  }
+
+  if (jobs <= 0)
+    jobs = g_get_num_processors ();
+  duration = jobs > 1 ? probe_duration (argv[1], &ref, format) :
+      GST_CLOCK_TIME_NONE;
+  if (!GST_CLOCK_TIME_IS_VALID (duration))
+    jobs = 1;
+
+  chunks = g_new0 (ScanChunk, jobs);
+  threads = g_new0 (GThread *, jobs);
+  for (c = 0; c < (guint) jobs; ++c) {
+    ScanChunk *chunk = &chunks[c];
+
+    chunk->location = argv[1];
+    chunk->ref = &ref;
+    chunk->format = format;
+    chunk->budget = stillreplace_match_psnr_to_budget (psnr);
+    chunk->start = GST_CLOCK_TIME_NONE;
+    chunk->stop = GST_CLOCK_TIME_NONE;
+    if (jobs > 1) {
+      chunk->start = gst_util_uint64_scale (duration, c, jobs);
+      if (c + 1 < (guint) jobs)
+        chunk->stop = gst_util_uint64_scale (duration, c + 1, jobs);
+    }
+    chunk->intervals = g_array_new (FALSE, FALSE, sizeof (ScanInterval));
+    threads[c] = g_thread_new ("scan", (GThreadFunc) scan_chunk, chunk);
+  }
+  for (c = 0; c < (guint) jobs; ++c) {
+    g_thread_join (threads[c]);
+    if (chunks[c].error) {
+      g_printerr ("Scanning %s failed: %s\n", argv[1], chunks[c].error);
+      ret = 1;
+    }
+  }
+
+  if (ret == 0) {
+    intervals = merge_intervals (chunks, jobs);
+    if (output && (out = fopen (output, "w")) == NULL) {
+      g_printerr ("Could not open %s for writing\n", output);
+      ret = 1;
+    } else {
+      write_intervals (out, csv, argv[1], reference, psnr, intervals);
+      if (out != stdout)
+        fclose (out);
+    }
+    g_array_unref (intervals);
+  }
+
+  for (c = 0; c < (guint) jobs; ++c) {
+    g_array_unref (chunks[c].intervals);
+    g_free (chunks[c].error);
+  }
+  g_free (chunks);
+  g_free (threads);
+  stillreplace_ref_file_clear (&ref);
+  g_mapped_file_unref (mapped);
+  g_free (reference);
+  g_free (output);
+  g_free (output_format);
+  return ret;
+}